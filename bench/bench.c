@@ -0,0 +1,248 @@
+/*
+ * Copyright (C) 2013-2014 Jolla Ltd.
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License version 2 as
+ * published by the Free Software Foundation.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ */
+
+#include "pa.h"
+#include "pa_log.h"
+#include "pa_table.h"
+#include "pa_wsp.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+/*
+ * Measures the per-notification work done by the agent itself: WSP
+ * decoding, routing and building the method call for the handler,
+ * the old way (a new message with names validated on every call) and
+ * the current one (a copy of the prebuilt template). Nothing is sent,
+ * the cost of the bus round trip doesn't depend on the agent.
+ */
+
+#define BENCH_ITERATIONS    (100000)
+#define BENCH_HANDLERS      (32)
+
+#define BENCH_SERVICE       "org.nemomobile.PushBench"
+#define BENCH_PATH          "/"
+#define BENCH_INTERFACE     "org.nemomobile.PushBench"
+#define BENCH_METHOD        "Notify"
+
+/* Transaction id, Push PDU, header length, application/vnd.wap.mms-message,
+ * X-Wap-Application-Id: x-wap-application:mms.ua, then the payload */
+static const guint8 bench_pdu[] = {
+    0x01, 0x06, 0x03, 0xbe, 0xaf, 0x84,
+    0x8c, 0x82, 0x98, 0x31, 0x32, 0x33, 0x00, 0x8d, 0x92, 0x89,
+    0x04, 0x80, 0x83, 0x41, 0x00, 0x96, 0x42, 0x65, 0x6e, 0x63,
+    0x68, 0x00, 0x8a, 0x80, 0x8e, 0x02, 0x04, 0x00, 0x88, 0x05,
+    0x81, 0x03, 0x01, 0x51, 0x80, 0x83, 0x68, 0x74, 0x74, 0x70,
+    0x3a, 0x2f, 0x2f, 0x6d, 0x6d, 0x73, 0x2f, 0x31, 0x00
+};
+
+static
+void
+bench_report(
+    const char* name,
+    gint64 start,
+    guint count)
+{
+    const gint64 usec = g_get_monotonic_time() - start;
+    printf("%-24s %8.1f ns/op\n", name, (usec * 1000.0) / count);
+}
+
+static
+void
+bench_decode(
+    guint count)
+{
+    guint i;
+    const gint64 start = g_get_monotonic_time();
+    for (i=0; i<count; i++) {
+        PushWsp wsp;
+        if (!push_wsp_decode(&wsp, bench_pdu, sizeof(bench_pdu))) {
+            fprintf(stderr, "Failed to decode the test PDU\n");
+            exit(1);
+        }
+        push_wsp_clear(&wsp);
+    }
+    bench_report("decode", start, count);
+}
+
+static
+PushHandlerTable*
+bench_table(
+    GDBusConnection* bus)
+{
+    int i;
+    PushAgentConfig config;
+    GKeyFile* conf = g_key_file_new();
+    PushHandlerTableBuilder* builder = push_handler_table_builder_new(NULL);
+    memset(&config, 0, sizeof(config));
+    config.dbus_timeout = -1;
+    config.max_in_flight = 1;
+    for (i=0; i<BENCH_HANDLERS; i++) {
+        char* group = g_strdup_printf("bench-%d", i);
+        PushHandler* handler;
+        g_key_file_set_string(conf, group, "Interface", BENCH_INTERFACE);
+        g_key_file_set_string(conf, group, "Service", BENCH_SERVICE);
+        g_key_file_set_string(conf, group, "Method", BENCH_METHOD);
+        g_key_file_set_string(conf, group, "Path", BENCH_PATH);
+        /* A few of them match, the rest doesn't */
+        switch (i % 8) {
+        case 0:
+            g_key_file_set_string(conf, group, "ContentType",
+                "application/vnd.wap.mms-message");
+            break;
+        case 1:
+            g_key_file_set_string(conf, group, "ContentType",
+                "application/vnd.wap.*");
+            break;
+        case 2:
+            g_key_file_set_string(conf, group, "ApplicationId",
+                "x-wap-application:mms.ua");
+            break;
+        default: {
+                char* type = g_strdup_printf("application/x-bench-%d", i);
+                g_key_file_set_string(conf, group, "ContentType", type);
+                g_free(type);
+            }
+            break;
+        }
+        handler = push_handler_new(conf, group, &config, bus, NULL, NULL);
+        if (handler) {
+            /* One file per handler, as they are usually installed */
+            char* file = g_strconcat(group, ".conf", NULL);
+            push_handler_table_builder_add(builder, file, handler);
+            g_free(file);
+        }
+        g_free(group);
+    }
+    g_key_file_unref(conf);
+    return push_handler_table_builder_finish(builder);
+}
+
+static
+void
+bench_route(
+    GDBusConnection* bus,
+    guint count)
+{
+    guint i;
+    gint64 start;
+    PushWsp wsp;
+    PushHandlerTable* table = bench_table(bus);
+    guint matched = 0;
+    push_wsp_decode(&wsp, bench_pdu, sizeof(bench_pdu));
+    start = g_get_monotonic_time();
+    for (i=0; i<count; i++) {
+        matched += push_handler_table_route(table, &wsp)->len;
+    }
+    bench_report("route", start, count);
+    printf("%-24s %8u of %u\n", "handlers matched", matched / count,
+        table->handlers->len);
+    push_wsp_clear(&wsp);
+    push_handler_table_unref(table);
+}
+
+static
+GVariant*
+bench_args(
+    GBytes* body)
+{
+    return g_variant_new("(ss@ay)", "244051234567890",
+        "application/vnd.wap.mms-message", g_variant_new_from_bytes(
+        G_VARIANT_TYPE_BYTESTRING, body, TRUE));
+}
+
+static
+void
+bench_message_new(
+    GBytes* body,
+    guint count)
+{
+    guint i;
+    const gint64 start = g_get_monotonic_time();
+    for (i=0; i<count; i++) {
+        /* This is what g_dbus_connection_call() does for each call */
+        GDBusMessage* msg;
+        if (!g_dbus_is_name(BENCH_SERVICE) ||
+            !g_variant_is_object_path(BENCH_PATH) ||
+            !g_dbus_is_interface_name(BENCH_INTERFACE) ||
+            !g_dbus_is_member_name(BENCH_METHOD)) {
+            exit(1);
+        }
+        msg = g_dbus_message_new_method_call(BENCH_SERVICE, BENCH_PATH,
+            BENCH_INTERFACE, BENCH_METHOD);
+        g_dbus_message_set_body(msg, bench_args(body));
+        g_object_unref(msg);
+    }
+    bench_report("message (new)", start, count);
+}
+
+static
+void
+bench_message_copy(
+    GBytes* body,
+    guint count)
+{
+    guint i;
+    GDBusMessage* tmpl = g_dbus_message_new_method_call(BENCH_SERVICE,
+        BENCH_PATH, BENCH_INTERFACE, BENCH_METHOD);
+    const gint64 start = g_get_monotonic_time();
+    for (i=0; i<count; i++) {
+        GDBusMessage* msg = g_dbus_message_copy(tmpl, NULL);
+        g_dbus_message_set_body(msg, bench_args(body));
+        g_object_unref(msg);
+    }
+    bench_report("message (template)", start, count);
+    g_object_unref(tmpl);
+}
+
+int main(int argc, char* argv[])
+{
+    const guint count = (argc > 1) ? (guint)atoi(argv[1]) :
+        BENCH_ITERATIONS;
+    GBytes* body = g_bytes_new_static(bench_pdu, sizeof(bench_pdu));
+    GError* error = NULL;
+    GDBusConnection* bus;
+
+    pa_log_level = PA_LOGLEVEL_NONE;
+    if (!count) {
+        fprintf(stderr, "Usage: %s [ITERATIONS]\n", argv[0]);
+        return 1;
+    }
+
+    bench_decode(count);
+
+    /* Handlers track their services, that needs a bus */
+    bus = g_bus_get_sync(G_BUS_TYPE_SESSION, NULL, &error);
+    if (bus) {
+        bench_route(bus, count);
+        g_object_unref(bus);
+    } else {
+        printf("%-24s skipped (%s)\n", "route", error->message);
+        g_error_free(error);
+    }
+
+    bench_message_new(body, count);
+    bench_message_copy(body, count);
+    g_bytes_unref(body);
+    return 0;
+}
+
+/*
+ * Local Variables:
+ * mode: C
+ * c-basic-offset: 4
+ * indent-tabs-mode: nil
+ * End:
+ */
@@ -30,10 +30,13 @@ make KEEP_SYMBOLS=1 release
 rm -rf %{buildroot}
 mkdir -p  %{buildroot}/%{_sbindir}
 mkdir -p %{buildroot}/%{_sysconfdir}/push-agent
+mkdir -p %{buildroot}/%{_localstatedir}/cache/push-agent
+mkdir -p %{buildroot}/%{_sysconfdir}/dbus-1/system.d
 mkdir -p %{buildroot}/%{_lib}/systemd/system/
 mkdir -p %{buildroot}/%{_lib}/systemd/system/network.target.wants
 cp build/release/push-agent %{buildroot}/%{_sbindir}
 cp push-agent.service %{buildroot}/%{_lib}/systemd/system/
+cp org.nemomobile.PushAgent.conf %{buildroot}/%{_sysconfdir}/dbus-1/system.d/
 ln -s ../push-agent.service %{buildroot}/%{_lib}/systemd/system/network.target.wants/
 
 %preun
@@ -49,6 +52,8 @@ systemctl daemon-reload
 %files
 %defattr(-,root,root,-)
 %dir %{_sysconfdir}/push-agent
+%dir %attr(0755,radio,radio) %{_localstatedir}/cache/push-agent
 %{_sbindir}/push-agent
+%config %{_sysconfdir}/dbus-1/system.d/org.nemomobile.PushAgent.conf
 /%{_lib}/systemd/system/push-agent.service
 /%{_lib}/systemd/system/network.target.wants/push-agent.service
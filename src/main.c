@@ -23,6 +23,9 @@
 #define RET_OK (0)
 #define RET_ERR (1)
 
+/* Lives in the configuration directory but isn't a handler file */
+#define PA_LOG_SETTINGS_FILE "push-agent.ini"
+
 static
 gboolean
 pa_signal_handler(
@@ -37,6 +40,76 @@ pa_signal_handler(
     return FALSE;
 }
 
+static
+int
+pa_log_level_parse(
+    const char* name)
+{
+    static const char* const levels[] = {
+        "none", "error", "warning", "info", "debug", "verbose"
+    };
+    int i;
+    for (i=0; i<(int)G_N_ELEMENTS(levels); i++) {
+        if (!g_ascii_strcasecmp(name, levels[i])) {
+            return i;
+        }
+    }
+    return -1;
+}
+
+/*
+ * Optional log settings, e.g.
+ *
+ * [Log]
+ * Level=debug
+ * Output=syslog
+ *
+ * Applied on top of the command line options at startup and then
+ * again every time the configuration is reloaded.
+ */
+static
+void
+pa_load_log_settings(
+    const PushAgentConfig* config)
+{
+    char* path = g_build_filename(config->config_dir, PA_LOG_SETTINGS_FILE,
+        NULL);
+    GKeyFile* conf = g_key_file_new();
+    if (g_key_file_load_from_file(conf, path, 0, NULL)) {
+        char* level = g_key_file_get_string(conf, "Log", "Level", NULL);
+        char* output = g_key_file_get_string(conf, "Log", "Output", NULL);
+        if (output) {
+            if (!pa_log_set_type(output)) {
+                PA_WARN("%s: invalid log output '%s'", path, output);
+            }
+            g_free(output);
+        }
+        if (level) {
+            const int value = pa_log_level_parse(level);
+            if (value >= 0) {
+                pa_log_level = value;
+            } else {
+                PA_WARN("%s: invalid log level '%s'", path, level);
+            }
+            g_free(level);
+        }
+    }
+    g_key_file_free(conf);
+    g_free(path);
+}
+
+static
+gboolean
+pa_reload_handler(
+    gpointer arg)
+{
+    PushAgent* agent = arg;
+    PA_INFO("Caught SIGHUP, reloading configuration...");
+    pa_load_log_settings(push_agent_config(agent));
+    push_agent_reload(agent);
+    return TRUE;
+}
+
 static
 gboolean
 pa_option_logtype(
@@ -73,6 +146,24 @@ pa_parse_options(
     GOptionEntry entries[] = {
         { "config-dir", 'c', 0, G_OPTION_ARG_FILENAME,
           (void*)&config->config_dir, config_dir_help, "DIR" },
+        { "spool-dir", 's', 0, G_OPTION_ARG_FILENAME,
+          (void*)&config->spool_dir, "Keep undelivered notifications in DIR",
+          "DIR" },
+        { "ack-first", 'a', 0, G_OPTION_ARG_NONE,
+          &config->ack_first, "Reply to oFono before notifying handlers",
+          NULL },
+        { "cache", 'k', 0, G_OPTION_ARG_FILENAME,
+          (void*)&config->cache_file, "Cache parsed configuration in FILE",
+          "FILE" },
+        { "imsi-cache", 'i', 0, G_OPTION_ARG_FILENAME,
+          (void*)&config->imsi_cache, "Remember IMSIs of known SIMs in FILE",
+          "FILE" },
+        { "reload-delay", 'r', 0, G_OPTION_ARG_INT,
+          &config->reload_delay, "Wait MS after a configuration change "
+          "before reloading [500]", "MS" },
+        { "decode-workers", 'w', 0, G_OPTION_ARG_INT,
+          &config->decode_workers, "Decode notifications on N threads, "
+          "sharded by modem [0]", "N" },
         { "verbose", 'v', 0, G_OPTION_ARG_NONE,
            &verbose, "Enable verbose output", NULL },
         { "log-output", 'o', 0, G_OPTION_ARG_CALLBACK, pa_option_logtype,
@@ -88,6 +179,7 @@ pa_parse_options(
     if (verbose) pa_log_level = PA_LOGLEVEL_VERBOSE;
 
     if (ok) {
+        pa_load_log_settings(config);
         PA_INFO("Starting");
         return TRUE;
     } else {
@@ -103,6 +195,13 @@ int main(int argc, char* argv[])
     PushAgentConfig config;
     config.config_dir = "/etc/push-agent";
     config.dbus_timeout = 5000;
+    config.max_in_flight = 1;
+    config.spool_dir = NULL;
+    config.ack_first = FALSE;
+    config.reload_delay = 500;
+    config.cache_file = NULL;
+    config.imsi_cache = NULL;
+    config.decode_workers = 0;
     pa_log_name = "push-agent";
 
 #ifdef __GNUC__
@@ -121,6 +220,7 @@ int main(int argc, char* argv[])
             GMainLoop* loop = g_main_loop_new(NULL, FALSE);
             g_unix_signal_add(SIGTERM, pa_signal_handler, agent);
             g_unix_signal_add(SIGINT, pa_signal_handler, agent);
+            g_unix_signal_add(SIGHUP, pa_reload_handler, agent);
             push_agent_run(agent, loop);
             g_main_loop_unref(loop);
             push_agent_free(agent);
@@ -13,128 +13,226 @@
  */
 
 #include "pa.h"
+#include "pa_cache.h"
+#include "pa_control.h"
+#include "pa_deadletter.h"
 #include "pa_dir.h"
+#include "pa_handler.h"
 #include "pa_log.h"
 #include "pa_ofono.h"
+#include "pa_service.h"
+#include "pa_spool.h"
+#include "pa_table.h"
+#include "pa_wsp.h"
 
-#include <gio/gio.h>
-#include <wspcodec.h>
 #include <string.h>
 
+/* Limits the number of notifications kept for inspection and replay */
+#define PUSH_AGENT_MAX_DEAD_LETTERS (64)
+
 struct push_agent {
     const PushAgentConfig* config;
     PushOfonoWatcher* ofono;
     PushDirWatcher* config_watch;
-    GSList* handlers;
+    PushControl* control;
+    PushHandlerTable* table;
+    PushConfigCache* cache;
+    PushSpool* spool;
+    PushDeadLetters* dead_letters;
     GMainLoop* loop;
 };
 
-typedef struct push_handler {
-    char* name;
-    char* content_type;
-    char* interface;
-    char* service;
-    char* method;
-    char* path;
-} PushHandler;
+static
+void
+push_agent_handler_result(
+    PushHandler* handler,
+    PushNotification* push,
+    const GError* error,
+    void* agent_data)
+{
+    PushAgent* agent = agent_data;
+    if (error && error->domain == PUSH_HANDLER_ERROR &&
+        push_dead_letters_full(agent->dead_letters)) {
+        /* A burst of shed notifications must not push the delivery
+         * failures out of the store. The handler has counted it. */
+        PA_DEBUG("%s: not keeping shed notification", handler->name);
+        if (push->spool_id) {
+            push_spool_done(agent->spool, push->spool_id, handler->name);
+        }
+    } else if (error) {
+        /* Stays in the spool until it's replayed or dropped */
+        push_dead_letters_add(agent->dead_letters, handler->name, push,
+            error);
+    } else if (push->spool_id) {
+        push_spool_done(agent->spool, push->spool_id, handler->name);
+    }
+}
 
 static
 void
-push_handler_notify(
+push_agent_dead_letter_dropped(
+    const PushDeadLetter* letter,
+    void* agent_data)
+{
+    PushAgent* agent = agent_data;
+    /* Keeping it in the spool would only resurrect it after restart,
+     * it's counted and reported by GetDeadLetters instead */
+    if (letter->push->spool_id) {
+        push_spool_done(agent->spool, letter->push->spool_id,
+            letter->handler);
+    }
+}
+
+static
+gboolean
+push_agent_config_file_match(
+    const char* file)
+{
+    return g_str_has_suffix(file, ".conf");
+}
+
+static
+gboolean
+push_agent_load_cached(
     PushAgent* agent,
-    PushHandler* handler,
-    const char* imsi,
-    const char* content_type,
-    const void* data,
-    unsigned int len)
+    PushHandlerTableBuilder* builder,
+    PushConfigCache* cache,
+    const char* file,
+    const PushConfigStamp* stamp)
+{
+    GVariant* handlers = push_config_cache_lookup(cache, file, stamp);
+    if (handlers) {
+        const gsize n = g_variant_n_children(handlers);
+        gsize i;
+        PA_DEBUG("Using cached %s", file);
+        for (i=0; i<n; i++) {
+            GVariant* var = g_variant_get_child_value(handlers, i);
+            PushHandler* h = push_handler_new_from_variant(var, agent->config,
+                push_ofono_watcher_bus(agent->ofono),
+                push_agent_handler_result, agent);
+            if (h) push_handler_table_builder_add(builder, file, h);
+            g_variant_unref(var);
+        }
+        g_variant_unref(handlers);
+        return TRUE;
+    }
+    return FALSE;
+}
+
+static
+void
+push_agent_load_file(
+    PushAgent* agent,
+    PushHandlerTableBuilder* builder,
+    PushConfigCache* cache,
+    const char* file)
 {
     GError* error = NULL;
-    GDBusConnection* bus = g_bus_get_sync(G_BUS_TYPE_SYSTEM, NULL, &error);
-    if (bus) {
-        GVariant* result;
-        GVariantBuilder b;
-        g_variant_builder_init(&b, G_VARIANT_TYPE("(ssay)"));
-        g_variant_builder_add(&b, "s", imsi);
-        g_variant_builder_add(&b, "s", content_type);
-        g_variant_builder_add_value(&b, g_variant_new_from_data(
-            G_VARIANT_TYPE_BYTESTRING, data, len, TRUE, NULL, NULL));
-        result = g_dbus_connection_call_sync(bus, handler->service,
-            handler->path, handler->interface, handler->method,
-            g_variant_builder_end(&b), NULL, G_DBUS_CALL_FLAGS_NONE,
-            agent->config->dbus_timeout, NULL, &error);
-        if (result) {
-            g_variant_unref(result);
+    GKeyFile* conf;
+    PushConfigStamp stamp;
+    char* path = g_strconcat(agent->config->config_dir, "/", file, NULL);
+    const gboolean stamped = cache && push_config_stamp(path, &stamp);
+    if (stamped && push_agent_load_cached(agent, builder, cache, file,
+        &stamp)) {
+        g_free(path);
+        return;
+    }
+    conf = g_key_file_new();
+    PA_DEBUG("Reading %s", file);
+    if (g_key_file_load_from_file(conf, path, 0, &error)) {
+        gsize i, n = 0;
+        char** names = g_key_file_get_groups(conf, &n);
+        GVariantBuilder cached;
+        g_variant_builder_init(&cached,
+            G_VARIANT_TYPE("a" PUSH_HANDLER_VARIANT_TYPE));
+        for (i=0; i<n; i++) {
+            PushHandler* h = push_handler_new(conf, names[i], agent->config,
+                push_ofono_watcher_bus(agent->ofono),
+                push_agent_handler_result, agent);
+            if (h) {
+                /* Remember which handlers came from which file */
+                g_variant_builder_add_value(&cached,
+                    push_handler_to_variant(h));
+                push_handler_table_builder_add(builder, file, h);
+            }
+        }
+        if (stamped) {
+            push_config_cache_add(cache, file, &stamp,
+                g_variant_builder_end(&cached));
         } else {
-            PA_ERR("%s", PA_ERRMSG(error));
-            g_error_free(error);
+            g_variant_builder_clear(&cached);
         }
-        g_object_unref(bus);
+        g_strfreev(names);
     } else {
-        PA_ERR("%s", PA_ERRMSG(error));
+        if (!g_error_matches(error, G_FILE_ERROR, G_FILE_ERROR_NOENT)) {
+            PA_WARN("%s", error->message);
+        }
         g_error_free(error);
+        push_config_cache_remove(cache, file);
     }
+    g_key_file_free(conf);
+    g_free(path);
 }
 
 static
 void
-push_handler_free(
-    void* data)
+push_agent_set_table(
+    PushAgent* agent,
+    PushHandlerTable* table)
 {
-    PushHandler* handler = data;
-    g_free(handler->content_type);
-    g_free(handler->interface);
-    g_free(handler->service);
-    g_free(handler->method);
-    g_free(handler->path);
-    g_free(handler->name);
-    g_free(handler);
+    /* Notifications which are being delivered hold a reference to
+     * the previous table, it goes away when they are done with it */
+    PushHandlerTable* prev = agent->table;
+    g_atomic_pointer_set(&agent->table, table);
+    if (prev) {
+        guint i;
+        GHashTable* kept = g_hash_table_new(g_direct_hash, g_direct_equal);
+        GHashTable* names = g_hash_table_new(g_str_hash, g_str_equal);
+        for (i=0; i<table->handlers->len; i++) {
+            PushHandler* h = table->handlers->pdata[i];
+            g_hash_table_add(kept, h);
+            /* Same as push_handler_table_find(), the first one wins */
+            if (!g_hash_table_contains(names, h->name)) {
+                g_hash_table_insert(names, h->name, h);
+            }
+        }
+        /* Handlers that are gone must not sit on their queues */
+        for (i=0; i<prev->handlers->len; i++) {
+            PushHandler* h = prev->handlers->pdata[i];
+            if (!g_hash_table_contains(kept, h)) {
+                push_handler_retire(h, g_hash_table_lookup(names, h->name));
+            }
+        }
+        g_hash_table_destroy(names);
+        g_hash_table_destroy(kept);
+    }
+    push_handler_table_unref(prev);
 }
 
 static
-void
-push_agent_parse_handler(
-    PushAgent* agent,
-    GKeyFile* conf,
-    const char* g)
-{
-    /* These are required */
-    char* interface = g_key_file_get_string(conf, g, "Interface", NULL);
-    char* service = g_key_file_get_string(conf, g, "Service", NULL);
-    char* method = g_key_file_get_string(conf, g, "Method", NULL);
-    char* path = g_key_file_get_string(conf, g, "Path", NULL);
-    if (interface && service && method && path) {
-        PushHandler* h = g_new0(PushHandler, 1);
-        h->name = g_strdup(g);
-        h->interface = interface;
-        h->service = service;
-        h->method = method;
-        h->path = path;
-
-        /* Content type is optional */
-        h->content_type = g_key_file_get_string(conf, g, "ContentType", NULL);
-
-        PA_INFO("Registered %s", h->name);
-        if (h->content_type) PA_DEBUG("  ContentType: %s", h->content_type);
-        PA_DEBUG("  Interface: %s", interface);
-        PA_DEBUG("  Service: %s", service);
-        PA_DEBUG("  Method: %s", method);
-        PA_DEBUG("  Path: %s", path);
-
-        agent->handlers = g_slist_append(agent->handlers, h);
-    } else {
-        g_free(interface);
-        g_free(service);
-        g_free(method);
-        g_free(path);
-    }
+PushHandlerTable*
+push_agent_get_table(
+    PushAgent* agent)
+{
+    return push_handler_table_ref(g_atomic_pointer_get(&agent->table));
 }
 
 static
-gboolean
-push_agent_config_file_match(
-    const char* file)
+void
+push_agent_finish_config(
+    PushAgent* agent,
+    PushHandlerTableBuilder* builder)
 {
-    return g_str_has_suffix(file, ".conf");
+    PushConfigCache* cache = agent->cache;
+    PushHandlerTable* table;
+    push_handler_table_builder_set_routes(builder,
+        push_config_cache_routes(cache));
+    table = push_handler_table_builder_finish(builder);
+    if (cache) {
+        push_config_cache_set_routes(cache, push_handler_table_routes(table));
+        push_config_cache_save(cache);
+    }
+    push_agent_set_table(agent, table);
 }
 
 static
@@ -144,37 +242,21 @@ push_agent_parse_config(
 {
     const char* config_dir = agent->config->config_dir;
     GDir* dir = g_dir_open(config_dir, 0, NULL);
-    if (agent->handlers) {
-        g_slist_free_full(agent->handlers, push_handler_free);
-        agent->handlers = NULL;
-    }
+    PushHandlerTableBuilder* builder = push_handler_table_builder_new(NULL);
+    push_config_cache_mark(agent->cache);
     if (dir) {
         const gchar* file;
         while ((file = g_dir_read_name(dir)) != NULL) {
             if (push_agent_config_file_match(file)) {
-                GError* error = NULL;
-                GKeyFile* conf = g_key_file_new();
-                char* path = g_strconcat(config_dir, "/", file, NULL);
-                PA_DEBUG("Reading %s", file);
-                if (g_key_file_load_from_file(conf, path, 0, &error)) {
-                    gsize i, n = 0;
-                    char** names = g_key_file_get_groups(conf, &n);
-                    for (i=0; i<n; i++) {
-                        push_agent_parse_handler(agent, conf, names[i]);
-                    }
-                    g_strfreev(names);
-                } else {
-                    PA_WARN("%s", error->message);
-                    g_error_free(error);
-                }
-                g_key_file_free(conf);
-                g_free(path);
+                push_agent_load_file(agent, builder, agent->cache, file);
             }
         }
         g_dir_close(dir);
     } else {
         PA_WARN("%s directory not found", config_dir);
     }
+    push_config_cache_sweep(agent->cache);
+    push_agent_finish_config(agent, builder);
 }
 
 static
@@ -185,22 +267,365 @@ push_agent_config_changed(
     unsigned int count)
 {
     unsigned int i;
+    PushHandlerTableBuilder* builder = NULL;
+    /* Configuration changes often come with new services installed */
+    push_service_refresh();
+    if (!files) {
+        PA_INFO("Reloading configuration");
+        push_agent_parse_config(agent);
+        return;
+    }
+    for (i=0; i<count; i++) {
+        const char* file = files[i];
+        if (push_agent_config_file_match(file)) {
+            /* Only the handlers defined in this file are affected */
+            PA_INFO("Reloading %s", file);
+            if (!builder) {
+                builder = push_handler_table_builder_new(agent->table);
+            }
+            push_handler_table_builder_remove_file(builder, file);
+            push_agent_load_file(agent, builder, agent->cache, file);
+        }
+    }
+    if (builder) {
+        push_agent_finish_config(agent, builder);
+    }
+}
+
+static
+void
+push_agent_deliver(
+    PushAgent* agent,
+    PushNotification* push,
+    const GPtrArray* handlers)
+{
+    guint i;
+    if (agent->spool) {
+        const char** names = g_new(const char*, handlers->len);
+        for (i=0; i<handlers->len; i++) {
+            PushHandler* h = handlers->pdata[i];
+            names[i] = h->name;
+        }
+        push->spool_id = push_spool_add(agent->spool, push->imsi,
+            push->content_type, push->data, names, handlers->len);
+        g_free(names);
+    }
+    for (i=0; i<handlers->len; i++) {
+        push_handler_deliver(handlers->pdata[i], push);
+    }
+}
+
+static
+void
+push_agent_replay(
+    guint64 id,
+    const char* imsi,
+    const char* content_type,
+    GBytes* data,
+    const char* const* handlers,
+    guint count,
+    void* agent_data)
+{
+    guint i;
+    PushAgent* agent = agent_data;
+    PushHandlerTable* table = push_agent_get_table(agent);
+    PushNotification* push = push_notification_new(imsi, content_type,
+        data, 0, g_bytes_get_size(data), NULL, NULL);
+    push->spool_id = id;
     for (i=0; i<count; i++) {
-        if (push_agent_config_file_match(files[i])) {
-            PA_INFO("Reloading configuration");
-            push_agent_parse_config(agent);
-            break;
+        PushHandler* h = push_handler_table_find(table, handlers[i]);
+        if (h) {
+            PA_DEBUG("Redelivering %s to %s", content_type, h->name);
+            push_handler_deliver(h, push);
+        } else {
+            PA_WARN("Handler %s is gone, dropping %s", handlers[i],
+                content_type);
+            push_spool_done(agent->spool, id, handlers[i]);
         }
     }
+    push_notification_unref(push);
+    push_handler_table_unref(table);
 }
 
 static
 gboolean
-push_handler_match(
-    PushHandler* handler,
-    const char* type)
+push_agent_replay_dead_letter(
+    const PushDeadLetter* letter,
+    void* agent_data)
+{
+    PushAgent* agent = agent_data;
+    PushHandler* h = push_handler_table_find(agent->table, letter->handler);
+    if (h) {
+        PA_DEBUG("Replaying %s to %s", letter->push->content_type, h->name);
+        push_handler_deliver(h, letter->push);
+        return TRUE;
+    } else {
+        PA_WARN("Handler %s is gone", letter->handler);
+        return FALSE;
+    }
+}
+
+GVariant*
+push_agent_handlers(
+    PushAgent* agent)
+{
+    guint i;
+    PushHandlerTable* table = agent->table;
+    GVariantBuilder builder;
+    g_variant_builder_init(&builder, G_VARIANT_TYPE("a(sssu)"));
+    for (i=0; i<table->handlers->len; i++) {
+        PushHandler* h = table->handlers->pdata[i];
+        g_variant_builder_add(&builder, "(sssu)", h->name, h->service,
+            push_handler_breaker_name(push_handler_breaker(h)),
+            push_handler_queued(h));
+    }
+    return g_variant_builder_end(&builder);
+}
+
+GVariant*
+push_agent_handler_queues(
+    PushAgent* agent)
+{
+    guint i;
+    PushHandlerTable* table = agent->table;
+    GVariantBuilder builder;
+    g_variant_builder_init(&builder, G_VARIANT_TYPE("a(sauau)"));
+    for (i=0; i<table->handlers->len; i++) {
+        PushHandler* h = table->handlers->pdata[i];
+        GVariantBuilder queued, shed;
+        int k;
+        g_variant_builder_init(&queued, G_VARIANT_TYPE("au"));
+        g_variant_builder_init(&shed, G_VARIANT_TYPE("au"));
+        for (k=0; k<PUSH_PRIORITY_COUNT; k++) {
+            g_variant_builder_add(&queued, "u",
+                push_handler_queued_priority(h, k));
+            g_variant_builder_add(&shed, "u", push_handler_shed_count(h, k));
+        }
+        g_variant_builder_add(&builder, "(sauau)", h->name, &queued, &shed);
+    }
+    return g_variant_builder_end(&builder);
+}
+
+GVariant*
+push_agent_dead_letters(
+    PushAgent* agent)
+{
+    return push_dead_letters_to_variant(agent->dead_letters);
+}
+
+guint
+push_agent_dead_letters_dropped(
+    PushAgent* agent)
+{
+    return push_dead_letters_dropped(agent->dead_letters);
+}
+
+guint
+push_agent_replay_dead_letters(
+    PushAgent* agent,
+    guint64 id)
+{
+    return push_dead_letters_replay(agent->dead_letters, id,
+        push_agent_replay_dead_letter, agent);
+}
+
+GVariant*
+push_agent_receive_queues(
+    PushAgent* agent)
 {
-    return (!handler->content_type || !strcmp(handler->content_type, type));
+    return push_ofono_watcher_queues(agent->ofono);
+}
+
+/* Things that come with the PDU */
+typedef struct push_agent_pdu {
+    const char* imsi;
+    const char* modem;
+    GBytes* bytes;
+    GVariant* info;
+    gint64 timestamp;
+} PushAgentPdu;
+
+static
+GVariant*
+push_agent_info(
+    const PushWsp* wsp,
+    const char* modem,
+    GVariant* info,
+    gint64 timestamp)
+{
+    GVariantBuilder builder;
+    GVariantBuilder headers;
+    g_variant_builder_init(&builder, G_VARIANT_TYPE_VARDICT);
+    g_variant_builder_init(&headers, G_VARIANT_TYPE("a{ss}"));
+    if (wsp->headers) {
+        guint i;
+        for (i=0; i<wsp->headers->len; i++) {
+            const PushWspHeader* h = &g_array_index(wsp->headers,
+                PushWspHeader, i);
+            g_variant_builder_add(&headers, "{ss}", h->name, h->value);
+        }
+    }
+    g_variant_builder_add(&builder, "{sv}", "Headers",
+        g_variant_builder_end(&headers));
+    if (info) {
+        g_variant_builder_add(&builder, "{sv}", "Info", info);
+    }
+    if (modem) {
+        g_variant_builder_add(&builder, "{sv}", "Modem",
+            g_variant_new_object_path(modem));
+    }
+    g_variant_builder_add(&builder, "{sv}", "Timestamp",
+        g_variant_new_int64(timestamp));
+    return g_variant_ref_sink(g_variant_builder_end(&builder));
+}
+
+static
+gboolean
+push_agent_route_extended(
+    const GPtrArray* route)
+{
+    guint i;
+    for (i=0; i<route->len; i++) {
+        PushHandler* h = route->pdata[i];
+        if (h->extended) {
+            return TRUE;
+        }
+    }
+    return FALSE;
+}
+
+static
+PushNotification*
+push_agent_push_new(
+    const PushAgentPdu* pdu,
+    const PushWsp* wsp,
+    GDestroyNotify done,
+    void* done_data)
+{
+    /* The payload is a slice of the original message */
+    return push_notification_new(pdu->imsi, wsp->content_type, pdu->bytes,
+        wsp->payload_offset, wsp->payload_len, done, done_data);
+}
+
+static
+void
+push_agent_push_deliver(
+    PushAgent* agent,
+    const PushAgentPdu* pdu,
+    const PushWsp* wsp,
+    PushNotification* push,
+    const GPtrArray* route)
+{
+    /* Headers are decoded once, no matter how many handlers */
+    if (push_agent_route_extended(route)) {
+        push->info = push_agent_info(wsp, pdu->modem, pdu->info,
+            pdu->timestamp);
+    }
+    push_agent_deliver(agent, push, route);
+}
+
+static
+gboolean
+push_agent_handler_explicit(
+    PushHandler* handler)
+{
+    const char* type = handler->content_type;
+    return type && strcmp(type, "*") && strcmp(type, "*/*");
+}
+
+/* Decoding doesn't touch the agent, it may happen on a decode worker.
+ * Strings point into the PDU which is referenced by the result. */
+typedef struct push_agent_decoded {
+    GBytes* bytes;
+    PushWsp wsp;
+    GArray* parts;
+} PushAgentDecoded;
+
+static
+gpointer
+push_agent_decode(
+    GBytes* bytes)
+{
+    gsize len = 0;
+    const guint8* data = g_bytes_get_data(bytes, &len);
+    PushAgentDecoded* decoded = g_new0(PushAgentDecoded, 1);
+    if (push_wsp_decode(&decoded->wsp, data, len)) {
+        PushWspMultipartIter iter;
+        decoded->bytes = g_bytes_ref(bytes);
+        if (push_wsp_multipart_init(&iter, data, &decoded->wsp)) {
+            PushWsp part;
+            decoded->parts = g_array_new(FALSE, FALSE, sizeof(PushWsp));
+            g_array_set_clear_func(decoded->parts,
+                (GDestroyNotify)push_wsp_clear);
+            while (push_wsp_multipart_next(&iter, &part)) {
+                if (!part.app_id) part.app_id = decoded->wsp.app_id;
+                g_array_append_val(decoded->parts, part);
+            }
+        }
+        return decoded;
+    }
+    g_free(decoded);
+    return NULL;
+}
+
+static
+void
+push_agent_decoded_free(
+    gpointer data)
+{
+    PushAgentDecoded* decoded = data;
+    if (decoded) {
+        if (decoded->parts) g_array_free(decoded->parts, TRUE);
+        push_wsp_clear(&decoded->wsp);
+        g_bytes_unref(decoded->bytes);
+        g_free(decoded);
+    }
+}
+
+static
+PushNotification*
+push_agent_multipart(
+    PushAgent* agent,
+    PushHandlerTable* table,
+    const PushAgentPdu* pdu,
+    const PushAgentDecoded* decoded,
+    GDestroyNotify done,
+    void* done_data)
+{
+    guint i;
+    const PushWsp* wsp = &decoded->wsp;
+    const GPtrArray* route = push_handler_table_route(table, wsp);
+    GPtrArray* whole = g_ptr_array_new();
+    PushNotification* push = push_agent_push_new(pdu, wsp, done,
+        done_data);
+
+    /* The whole thing only goes to those who explicitly asked for it */
+    for (i=0; i<route->len; i++) {
+        PushHandler* h = route->pdata[i];
+        if (push_agent_handler_explicit(h)) {
+            g_ptr_array_add(whole, h);
+        }
+    }
+    if (whole->len > 0) {
+        push_agent_push_deliver(agent, pdu, wsp, push, whole);
+    }
+    g_ptr_array_unref(whole);
+
+    /* Each part is routed on its own and holds a reference to the whole
+     * notification, so that the done callback is invoked when all the
+     * parts have been handled */
+    for (i=0; i<decoded->parts->len; i++) {
+        const PushWsp* part = &g_array_index(decoded->parts, PushWsp, i);
+        route = push_handler_table_route(table, part);
+        if (route->len > 0) {
+            PushNotification* part_push = push_agent_push_new(pdu, part,
+                (GDestroyNotify)push_notification_unref,
+                push_notification_ref(push));
+            push_agent_push_deliver(agent, pdu, part, part_push, route);
+            push_notification_unref(part_push);
+        }
+    }
+    return push;
 }
 
 static
@@ -208,38 +633,46 @@ void
 push_agent_notification(
     PushAgent* agent,
     const char* imsi,
-    const guint8* pdu,
-    gsize len)
-{
-    PA_INFO("Received %d bytes from %s", (int)len, imsi);
-    /* First two bytes are Transaction ID and PDU Type */
-    if (imsi && len >= 3 && pdu[1] == 6 /* Push PDU */) {
-        guint remain = len - 2;
-        const guint8* data = pdu + 2;
-        unsigned int hdrlen = 0;
-        unsigned int off = 0;
-        if (wsp_decode_uintvar(data, remain, &hdrlen, &off) &&
-            (off + hdrlen) <= remain) {
-            const void* ct = NULL;
-            data += off;
-            remain -= off;
-            PA_DEBUG("WAP header %u bytes", hdrlen);
-            if (wsp_decode_content_type(data, hdrlen, &ct, &off, NULL)) {
-                GSList* link = agent->handlers;
-                remain -= hdrlen;
-                data += hdrlen;
-                PA_DEBUG("WSP payload %u bytes", remain);
-                PA_DEBUG("Content type %s", (char*)ct);
-                while (link) {
-                    PushHandler* h = link->data;
-                    if (push_handler_match(h, ct)) {
-                        PA_INFO("Notifying %s", h->name);
-                        push_handler_notify(agent, h, imsi, ct, data, remain);
-                    }
-                    link = link->next;
-                }
+    const char* modem,
+    GBytes* bytes,
+    GVariant* info,
+    gpointer data,
+    GDestroyNotify done,
+    void* done_data)
+{
+    PushAgentDecoded* decoded = data;
+    PushNotification* push = NULL;
+    PushAgentPdu pdu;
+    PA_INFO("Received %d bytes from %s", (int)g_bytes_get_size(bytes), imsi);
+    pdu.imsi = imsi;
+    pdu.modem = modem;
+    pdu.bytes = bytes;
+    pdu.info = info;
+    pdu.timestamp = g_get_real_time();
+    if (imsi && decoded) {
+        /* The whole notification is routed with the same configuration */
+        PushHandlerTable* table = push_agent_get_table(agent);
+        if (decoded->parts) {
+            push = push_agent_multipart(agent, table, &pdu, decoded,
+                done, done_data);
+        } else {
+            const GPtrArray* route = push_handler_table_route(table,
+                &decoded->wsp);
+            if (route->len > 0) {
+                push = push_agent_push_new(&pdu, &decoded->wsp, done,
+                    done_data);
+                push_agent_push_deliver(agent, &pdu, &decoded->wsp, push,
+                    route);
             }
         }
+        push_handler_table_unref(table);
+    }
+    push_agent_decoded_free(decoded);
+    if (push) {
+        /* The last handler to finish will invoke the done callback */
+        push_notification_unref(push);
+    } else if (done) {
+        done(done_data);
     }
 }
 
@@ -249,12 +682,25 @@ push_agent_new(
 {
     PushAgent* agent = g_new0(PushAgent, 1);
     agent->config = config;
-    agent->ofono = push_ofono_watcher_new(push_agent_notification, agent);
+    agent->ofono = push_ofono_watcher_new(config, push_agent_decode,
+        push_agent_decoded_free, push_agent_notification, agent);
     if (agent->ofono) {
+        agent->dead_letters = push_dead_letters_new(
+            PUSH_AGENT_MAX_DEAD_LETTERS, push_agent_dead_letter_dropped,
+            agent);
         agent->config_watch = push_dir_watcher_new(config->config_dir,
-            push_agent_config_changed, agent);
+            MAX(config->reload_delay, 0), push_agent_config_changed, agent);
+        if (config->cache_file) {
+            agent->cache = push_config_cache_new(config->cache_file, config);
+        }
         PA_INFO("Loading configuration from %s", config->config_dir);
         push_agent_parse_config(agent);
+        if (config->spool_dir) {
+            agent->spool = push_spool_new(config->spool_dir);
+            push_spool_replay(agent->spool, push_agent_replay, agent);
+        }
+        agent->control = push_control_new(agent,
+            push_ofono_watcher_bus(agent->ofono));
         return agent;
     } else {
         g_free(agent);
@@ -268,9 +714,13 @@ push_agent_free(
 {
     if (agent) {
         PA_ASSERT(!agent->loop);
+        push_control_free(agent->control);
         push_dir_watcher_free(agent->config_watch);
         push_ofono_watcher_free(agent->ofono);
-        g_slist_free_full(agent->handlers, push_handler_free);
+        push_handler_table_unref(agent->table);
+        push_config_cache_free(agent->cache);
+        push_dead_letters_free(agent->dead_letters);
+        push_spool_free(agent->spool);
         g_free(agent);
     }
 }
@@ -295,6 +745,22 @@ push_agent_stop(
     }
 }
 
+const PushAgentConfig*
+push_agent_config(
+    PushAgent* agent)
+{
+    return agent->config;
+}
+
+void
+push_agent_reload(
+    PushAgent* agent)
+{
+    PA_INFO("Reloading configuration from %s", agent->config->config_dir);
+    push_service_refresh();
+    push_agent_parse_config(agent);
+}
+
 /*
  * Local Variables:
  * mode: C
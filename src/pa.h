@@ -21,6 +21,13 @@ typedef struct push_agent PushAgent;
 typedef struct push_agent_config {
     const char* config_dir;
     int dbus_timeout;
+    int max_in_flight;
+    const char* spool_dir;
+    gboolean ack_first;
+    int reload_delay;
+    const char* cache_file;
+    const char* imsi_cache;
+    int decode_workers; /* Routing and delivery stay on the main thread */
 } PushAgentConfig;
 
 PushAgent*
@@ -40,6 +47,50 @@ void
 push_agent_stop(
     PushAgent* agent);
 
+const PushAgentConfig*
+push_agent_config(
+    PushAgent* agent);
+
+/* Rereads the handler configuration. The modems and the registration
+ * with oFono are not affected. */
+void
+push_agent_reload(
+    PushAgent* agent);
+
+/* Handler states, as a(sssu) */
+GVariant*
+push_agent_handlers(
+    PushAgent* agent);
+
+/* Queue lengths and shed counts per priority class (low, normal,
+ * high) of each handler, as a(sauau) */
+GVariant*
+push_agent_handler_queues(
+    PushAgent* agent);
+
+/* Notifications that handlers failed to accept, as a(tssssxay) */
+GVariant*
+push_agent_dead_letters(
+    PushAgent* agent);
+
+/* Number of dead letters dropped because there were too many of them.
+ * Their notifications are gone for good. */
+guint
+push_agent_dead_letters_dropped(
+    PushAgent* agent);
+
+/* Zero id replays all of them. Returns the number of letters replayed */
+guint
+push_agent_replay_dead_letters(
+    PushAgent* agent,
+    guint64 id);
+
+/* Size, depth, high water mark and drop count of the queue of each
+ * decode worker (or the only queue without them), as a(uuuu) */
+GVariant*
+push_agent_receive_queues(
+    PushAgent* agent);
+
 #endif /* JOLLA_PUSH_AGENT_H */
 
 /*
@@ -9,22 +9,48 @@ QMAKE_CFLAGS += -Wno-unused-parameter -Wno-missing-field-initializers
 SOURCES += \
   main.c \
   pa.c \
+  pa_cache.c \
+  pa_control.c \
+  pa_deadletter.c \
   pa_dir.c \
+  pa_handler.c \
+  pa_imsi.c \
   pa_log.c \
-  pa_ofono.c
+  pa_notification.c \
+  pa_ofono.c \
+  pa_ring.c \
+  pa_route.c \
+  pa_service.c \
+  pa_spool.c \
+  pa_table.c \
+  pa_wsp.c
 HEADERS += \
   pa.h \
+  pa_cache.h \
+  pa_control.h \
+  pa_deadletter.h \
   pa_dir.h \
+  pa_handler.h \
+  pa_imsi.h \
   pa_log.h \
-  pa_ofono.h
+  pa_notification.h \
+  pa_ofono.h \
+  pa_ring.h \
+  pa_route.h \
+  pa_service.h \
+  pa_spool.h \
+  pa_table.h \
+  pa_wsp.h
 OTHER_FILES += \
+  $$DBUS_SPEC_DIR/org.nemomobile.PushAgent.xml \
   $$DBUS_SPEC_DIR/org.ofono.Manager.xml \
   $$DBUS_SPEC_DIR/org.ofono.Modem.xml \
   $$DBUS_SPEC_DIR/org.ofono.PushNotification.xml \
   $$DBUS_SPEC_DIR/org.ofono.PushNotificationAgent.xml \
   $$DBUS_SPEC_DIR/org.ofono.SimManager.xml \
   $$_PRO_FILE_PWD_/../rpm/push-agent.spec \
-  $$_PRO_FILE_PWD_/../push-agent.service
+  $$_PRO_FILE_PWD_/../push-agent.service \
+  $$_PRO_FILE_PWD_/../org.nemomobile.PushAgent.conf
 
 CONFIG(debug, debug|release) {
     DEFINES += DEBUG
@@ -33,62 +59,24 @@ CONFIG(debug, debug|release) {
     DESTDIR = $$_PRO_FILE_PWD_/../build/release
 }
 
-# org.ofono.Manager
-MANAGER_XML = $$DBUS_SPEC_DIR/org.ofono.Manager.xml
-MANAGER_GENERATE = gdbus-codegen --generate-c-code \
-  org.ofono.Manager $$MANAGER_XML
-MANAGER_H = org.ofono.Manager.h
-org_ofono_Manager_h.input = MANAGER_XML
-org_ofono_Manager_h.output = $$MANAGER_H
-org_ofono_Manager_h.commands = $$MANAGER_GENERATE
-org_ofono_Manager_h.CONFIG = no_link
-QMAKE_EXTRA_COMPILERS += org_ofono_Manager_h
+# org.nemomobile.PushAgent
+PUSH_AGENT_XML = $$DBUS_SPEC_DIR/org.nemomobile.PushAgent.xml
+PUSH_AGENT_GENERATE = gdbus-codegen --generate-c-code \
+  org.nemomobile.PushAgent $$PUSH_AGENT_XML
+PUSH_AGENT_H = org.nemomobile.PushAgent.h
+org_nemomobile_PushAgent_h.input = PUSH_AGENT_XML
+org_nemomobile_PushAgent_h.output = $$PUSH_AGENT_H
+org_nemomobile_PushAgent_h.commands = $$PUSH_AGENT_GENERATE
+org_nemomobile_PushAgent_h.CONFIG = no_link
+QMAKE_EXTRA_COMPILERS += org_nemomobile_PushAgent_h
 
-MANAGER_C = org.ofono.Manager.c
-org_ofono_Manager_c.input = MANAGER_XML
-org_ofono_Manager_c.output = $$MANAGER_C
-org_ofono_Manager_c.commands = $$MANAGER_GENERATE
-org_ofono_Manager_c.CONFIG = no_link
-QMAKE_EXTRA_COMPILERS += org_ofono_Manager_c
-GENERATED_SOURCES += $$MANAGER_C
-
-# org.ofono.Modem
-MODEM_XML = $$DBUS_SPEC_DIR/org.ofono.Modem.xml
-MODEM_GENERATE = gdbus-codegen --generate-c-code \
-  org.ofono.Modem $$MODEM_XML
-MODEM_H = org.ofono.Modem.h
-org_ofono_Modem_h.input = MODEM_XML
-org_ofono_Modem_h.output = $$MODEM_H
-org_ofono_Modem_h.commands = $$MODEM_GENERATE
-org_ofono_Modem_h.CONFIG = no_link
-QMAKE_EXTRA_COMPILERS += org_ofono_Modem_h
-
-MODEM_C = org.ofono.Modem.c
-org_ofono_Modem_c.input = MODEM_XML
-org_ofono_Modem_c.output = $$MODEM_C
-org_ofono_Modem_c.commands = $$MODEM_GENERATE
-org_ofono_Modem_c.CONFIG = no_link
-QMAKE_EXTRA_COMPILERS += org_ofono_Modem_c
-GENERATED_SOURCES += $$MODEM_C
-
-# org.ofono.PushNotification
-PUSH_NOTIFICATION_XML = $$DBUS_SPEC_DIR/org.ofono.PushNotification.xml
-PUSH_NOTIFICATION_H = org.ofono.PushNotification.h
-org_ofono_pushnotification_h.input = PUSH_NOTIFICATION_XML
-org_ofono_pushnotification_h.output = $$PUSH_NOTIFICATION_H
-org_ofono_pushnotification_h.commands = gdbus-codegen --generate-c-code \
-  org.ofono.PushNotification $$PUSH_NOTIFICATION_XML
-org_ofono_pushnotification_h.CONFIG = no_link
-QMAKE_EXTRA_COMPILERS += org_ofono_pushnotification_h
-
-PUSH_NOTIFICATION_C = org.ofono.PushNotification.c
-org_ofono_pushnotification_c.input = PUSH_NOTIFICATION_XML
-org_ofono_pushnotification_c.output = $$PUSH_NOTIFICATION_C
-org_ofono_pushnotification_c.commands = gdbus-codegen --generate-c-code \
-  org.ofono.PushNotification $$PUSH_NOTIFICATION_XML
-org_ofono_pushnotification_c.CONFIG = no_link
-QMAKE_EXTRA_COMPILERS += org_ofono_pushnotification_c
-GENERATED_SOURCES += $$PUSH_NOTIFICATION_C
+PUSH_AGENT_C = org.nemomobile.PushAgent.c
+org_nemomobile_PushAgent_c.input = PUSH_AGENT_XML
+org_nemomobile_PushAgent_c.output = $$PUSH_AGENT_C
+org_nemomobile_PushAgent_c.commands = $$PUSH_AGENT_GENERATE
+org_nemomobile_PushAgent_c.CONFIG = no_link
+QMAKE_EXTRA_COMPILERS += org_nemomobile_PushAgent_c
+GENERATED_SOURCES += $$PUSH_AGENT_C
 
 # org.ofono.PushNotificationAgent
 PUSH_NOTIFICATION_AGENT_XML = $$DBUS_SPEC_DIR/org.ofono.PushNotificationAgent.xml
@@ -108,22 +96,3 @@ org_ofono_pushnotificationagent_c.commands = gdbus-codegen --generate-c-code \
 org_ofono_pushnotificationagent_c.CONFIG = no_link
 QMAKE_EXTRA_COMPILERS += org_ofono_pushnotificationagent_c
 GENERATED_SOURCES += $$PUSH_NOTIFICATION_AGENT_C
-
-# org.ofono.SimManager
-SIM_MANAGER_XML = $$DBUS_SPEC_DIR/org.ofono.SimManager.xml
-SIM_MANAGER_GENERATE = gdbus-codegen --generate-c-code \
-  org.ofono.SimManager $$SIM_MANAGER_XML
-SIM_MANAGER_H = org.ofono.SimManager.h
-org_ofono_SimManager_h.input = SIM_MANAGER_XML
-org_ofono_SimManager_h.output = $$SIM_MANAGER_H
-org_ofono_SimManager_h.commands = $$SIM_MANAGER_GENERATE
-org_ofono_SimManager_h.CONFIG = no_link
-QMAKE_EXTRA_COMPILERS += org_ofono_SimManager_h
-
-SIM_MANAGER_C = org.ofono.SimManager.c
-org_ofono_SimManager_c.input = SIM_MANAGER_XML
-org_ofono_SimManager_c.output = $$SIM_MANAGER_C
-org_ofono_SimManager_c.commands = $$SIM_MANAGER_GENERATE
-org_ofono_SimManager_c.CONFIG = no_link
-QMAKE_EXTRA_COMPILERS += org_ofono_SimManager_c
-GENERATED_SOURCES += $$SIM_MANAGER_C
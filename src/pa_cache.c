@@ -0,0 +1,323 @@
+/*
+ * Copyright (C) 2013-2014 Jolla Ltd.
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License version 2 as
+ * published by the Free Software Foundation.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ */
+
+#include "pa_cache.h"
+#include "pa_table.h"
+#include "pa_log.h"
+
+#include <sys/stat.h>
+#include <string.h>
+
+#define PUSH_CONFIG_CACHE_MAGIC     (0x48434150) /* PACH */
+#define PUSH_CONFIG_CACHE_VERSION   (3)
+
+/* Magic, version, default MaxInFlight, the files and the routes */
+#define PUSH_CONFIG_CACHE_FILE_TYPE "(sxta" PUSH_HANDLER_VARIANT_TYPE ")"
+#define PUSH_CONFIG_CACHE_TYPE      "(uuia" PUSH_CONFIG_CACHE_FILE_TYPE \
+                                    "m" PUSH_HANDLER_TABLE_ROUTES_TYPE ")"
+
+typedef struct push_config_cache_file {
+    PushConfigStamp stamp;
+    GVariant* handlers;
+    gboolean seen;
+} PushConfigCacheFile;
+
+struct push_config_cache {
+    char* path;
+    int max_in_flight;
+    GMappedFile* map;
+    GHashTable* files;
+    GVariant* routes;
+    gboolean dirty;
+};
+
+static
+void
+push_config_cache_file_free(
+    gpointer data)
+{
+    PushConfigCacheFile* file = data;
+    g_variant_unref(file->handlers);
+    g_free(file);
+}
+
+static
+void
+push_config_cache_changed(
+    PushConfigCache* cache)
+{
+    /* The routes are only good for the exact same set of files */
+    cache->dirty = TRUE;
+    if (cache->routes) {
+        g_variant_unref(cache->routes);
+        cache->routes = NULL;
+    }
+}
+
+static
+void
+push_config_cache_load(
+    PushConfigCache* cache,
+    GVariant* root)
+{
+    guint32 magic = 0, version = 0;
+    int max_in_flight = 0;
+    GVariant* files = NULL;
+    GVariant* routes = NULL;
+    g_variant_get(root, "(uui@a" PUSH_CONFIG_CACHE_FILE_TYPE
+        "m@" PUSH_HANDLER_TABLE_ROUTES_TYPE ")", &magic, &version,
+        &max_in_flight, &files, &routes);
+    if (magic == PUSH_CONFIG_CACHE_MAGIC &&
+        version == PUSH_CONFIG_CACHE_VERSION &&
+        max_in_flight == cache->max_in_flight) {
+        GVariantIter it;
+        const char* name;
+        gint64 mtime;
+        guint64 size;
+        GVariant* handlers;
+
+        /* Index the files once, each lookup is then just a hash lookup */
+        g_variant_iter_init(&it, files);
+        while (g_variant_iter_next(&it, "(&sxt@a" PUSH_HANDLER_VARIANT_TYPE
+            ")", &name, &mtime, &size, &handlers)) {
+            PushConfigCacheFile* file = g_new0(PushConfigCacheFile, 1);
+            file->stamp.mtime = mtime;
+            file->stamp.size = size;
+            file->handlers = handlers;
+            g_hash_table_replace(cache->files, g_strdup(name), file);
+        }
+        cache->routes = routes;
+        routes = NULL;
+        PA_DEBUG("Loaded %s (%u file(s))", cache->path,
+            g_hash_table_size(cache->files));
+    } else {
+        PA_DEBUG("Ignoring %s", cache->path);
+    }
+    if (routes) g_variant_unref(routes);
+    g_variant_unref(files);
+}
+
+PushConfigCache*
+push_config_cache_new(
+    const char* path,
+    const PushAgentConfig* config)
+{
+    PushConfigCache* cache = g_new0(PushConfigCache, 1);
+    GError* error = NULL;
+    cache->path = g_strdup(path);
+    cache->max_in_flight = config->max_in_flight;
+    cache->files = g_hash_table_new_full(g_str_hash, g_str_equal, g_free,
+        push_config_cache_file_free);
+    cache->map = g_mapped_file_new(path, FALSE, &error);
+    if (cache->map) {
+        /* The data come from a file, they are not trusted */
+        GBytes* bytes = g_mapped_file_get_bytes(cache->map);
+        GVariant* root = g_variant_ref_sink(g_variant_new_from_bytes(
+            G_VARIANT_TYPE(PUSH_CONFIG_CACHE_TYPE), bytes, FALSE));
+        push_config_cache_load(cache, root);
+        g_variant_unref(root);
+        g_bytes_unref(bytes);
+    } else {
+        if (!g_error_matches(error, G_FILE_ERROR, G_FILE_ERROR_NOENT)) {
+            PA_WARN("%s", error->message);
+        }
+        g_error_free(error);
+    }
+    return cache;
+}
+
+void
+push_config_cache_free(
+    PushConfigCache* cache)
+{
+    if (cache) {
+        g_hash_table_destroy(cache->files);
+        if (cache->routes) g_variant_unref(cache->routes);
+        if (cache->map) g_mapped_file_unref(cache->map);
+        g_free(cache->path);
+        g_free(cache);
+    }
+}
+
+gboolean
+push_config_stamp(
+    const char* path,
+    PushConfigStamp* stamp)
+{
+    struct stat st;
+    if (stat(path, &st) == 0) {
+        stamp->mtime = (gint64)st.st_mtim.tv_sec * G_USEC_PER_SEC +
+            st.st_mtim.tv_nsec / 1000;
+        stamp->size = st.st_size;
+        return TRUE;
+    }
+    return FALSE;
+}
+
+GVariant*
+push_config_cache_lookup(
+    PushConfigCache* cache,
+    const char* name,
+    const PushConfigStamp* stamp)
+{
+    if (cache) {
+        PushConfigCacheFile* file = g_hash_table_lookup(cache->files, name);
+        if (file) {
+            if (file->stamp.mtime == stamp->mtime &&
+                file->stamp.size == stamp->size) {
+                file->seen = TRUE;
+                return g_variant_ref(file->handlers);
+            }
+            PA_DEBUG("%s has changed", name);
+        }
+    }
+    return NULL;
+}
+
+void
+push_config_cache_add(
+    PushConfigCache* cache,
+    const char* name,
+    const PushConfigStamp* stamp,
+    GVariant* handlers)
+{
+    if (cache) {
+        PushConfigCacheFile* file = g_hash_table_lookup(cache->files, name);
+        g_variant_ref_sink(handlers);
+        if (file && file->stamp.mtime == stamp->mtime &&
+            file->stamp.size == stamp->size) {
+            /* Nothing has changed */
+            g_variant_unref(handlers);
+        } else {
+            file = g_new0(PushConfigCacheFile, 1);
+            file->stamp = *stamp;
+            file->handlers = handlers;
+            g_hash_table_replace(cache->files, g_strdup(name), file);
+            push_config_cache_changed(cache);
+        }
+        file->seen = TRUE;
+    }
+}
+
+void
+push_config_cache_remove(
+    PushConfigCache* cache,
+    const char* name)
+{
+    if (cache && g_hash_table_remove(cache->files, name)) {
+        push_config_cache_changed(cache);
+    }
+}
+
+void
+push_config_cache_mark(
+    PushConfigCache* cache)
+{
+    if (cache) {
+        GHashTableIter it;
+        gpointer value;
+        g_hash_table_iter_init(&it, cache->files);
+        while (g_hash_table_iter_next(&it, NULL, &value)) {
+            ((PushConfigCacheFile*)value)->seen = FALSE;
+        }
+    }
+}
+
+void
+push_config_cache_sweep(
+    PushConfigCache* cache)
+{
+    if (cache) {
+        GHashTableIter it;
+        gpointer key, value;
+        g_hash_table_iter_init(&it, cache->files);
+        while (g_hash_table_iter_next(&it, &key, &value)) {
+            if (!((PushConfigCacheFile*)value)->seen) {
+                PA_DEBUG("%s is gone", (char*)key);
+                g_hash_table_iter_remove(&it);
+                push_config_cache_changed(cache);
+            }
+        }
+    }
+}
+
+GVariant*
+push_config_cache_routes(
+    PushConfigCache* cache)
+{
+    return cache ? cache->routes : NULL;
+}
+
+void
+push_config_cache_set_routes(
+    PushConfigCache* cache,
+    GVariant* routes)
+{
+    if (cache) {
+        g_variant_ref_sink(routes);
+        if (cache->routes && g_variant_equal(cache->routes, routes)) {
+            g_variant_unref(routes);
+        } else {
+            if (cache->routes) g_variant_unref(cache->routes);
+            cache->routes = routes;
+            cache->dirty = TRUE;
+        }
+    }
+}
+
+void
+push_config_cache_save(
+    PushConfigCache* cache)
+{
+    if (cache && cache->dirty) {
+        GError* error = NULL;
+        GHashTableIter it;
+        gpointer key, value;
+        GVariantBuilder files;
+        GVariant* root;
+        g_variant_builder_init(&files,
+            G_VARIANT_TYPE("a" PUSH_CONFIG_CACHE_FILE_TYPE));
+        g_hash_table_iter_init(&it, cache->files);
+        while (g_hash_table_iter_next(&it, &key, &value)) {
+            PushConfigCacheFile* file = value;
+            g_variant_builder_add(&files, "(sxt@a"
+                PUSH_HANDLER_VARIANT_TYPE ")", (char*)key, file->stamp.mtime,
+                file->stamp.size, file->handlers);
+        }
+        root = g_variant_ref_sink(g_variant_new("(uui@a"
+            PUSH_CONFIG_CACHE_FILE_TYPE "@m" PUSH_HANDLER_TABLE_ROUTES_TYPE
+            ")", PUSH_CONFIG_CACHE_MAGIC, PUSH_CONFIG_CACHE_VERSION,
+            cache->max_in_flight, g_variant_builder_end(&files),
+            g_variant_new_maybe(G_VARIANT_TYPE(
+            PUSH_HANDLER_TABLE_ROUTES_TYPE), cache->routes)));
+        if (g_file_set_contents(cache->path, g_variant_get_data(root),
+            g_variant_get_size(root), &error)) {
+            PA_DEBUG("Saved %s (%u file(s))", cache->path,
+                g_hash_table_size(cache->files));
+            cache->dirty = FALSE;
+        } else {
+            PA_WARN("%s", error->message);
+            g_error_free(error);
+        }
+        g_variant_unref(root);
+    }
+}
+
+/*
+ * Local Variables:
+ * mode: C
+ * c-basic-offset: 4
+ * indent-tabs-mode: nil
+ * End:
+ */
@@ -0,0 +1,108 @@
+/*
+ * Copyright (C) 2013-2014 Jolla Ltd.
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License version 2 as
+ * published by the Free Software Foundation.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ */
+
+#ifndef JOLLA_PUSH_AGENT_CACHE_H
+#define JOLLA_PUSH_AGENT_CACHE_H
+
+#include "pa_handler.h"
+
+/*
+ * Binary cache of the parsed handler configuration. The cache file is
+ * a serialized GVariant which is mapped into memory and used in place,
+ * without parsing. Each configuration file is identified by its name,
+ * modification time and size. If any of those has changed, the file
+ * has to be parsed again. The files are indexed by name when the cache
+ * is loaded. The cache also keeps the routes compiled for the current
+ * set of files, any change to that set drops them.
+ */
+typedef struct push_config_cache PushConfigCache;
+
+typedef struct push_config_stamp {
+    gint64 mtime;
+    guint64 size;
+} PushConfigStamp;
+
+/* Starts empty if the file doesn't exist or can't be used */
+PushConfigCache*
+push_config_cache_new(
+    const char* path,
+    const PushAgentConfig* config);
+
+void
+push_config_cache_free(
+    PushConfigCache* cache);
+
+gboolean
+push_config_stamp(
+    const char* path,
+    PushConfigStamp* stamp);
+
+/* Returns the array of PUSH_HANDLER_VARIANT_TYPE or NULL. The caller
+ * has to release the reference. */
+GVariant*
+push_config_cache_lookup(
+    PushConfigCache* cache,
+    const char* name,
+    const PushConfigStamp* stamp);
+
+/* Sinks the floating reference if there is one */
+void
+push_config_cache_add(
+    PushConfigCache* cache,
+    const char* name,
+    const PushConfigStamp* stamp,
+    GVariant* handlers);
+
+/* Forgets the file which no longer exists */
+void
+push_config_cache_remove(
+    PushConfigCache* cache,
+    const char* name);
+
+/* A full scan is bracketed by mark and sweep, the files which haven't
+ * been looked up or added in between are removed from the cache */
+void
+push_config_cache_mark(
+    PushConfigCache* cache);
+
+void
+push_config_cache_sweep(
+    PushConfigCache* cache);
+
+/* PUSH_HANDLER_TABLE_ROUTES_TYPE or NULL, the reference isn't passed
+ * to the caller */
+GVariant*
+push_config_cache_routes(
+    PushConfigCache* cache);
+
+/* Sinks the floating reference if there is one */
+void
+push_config_cache_set_routes(
+    PushConfigCache* cache,
+    GVariant* routes);
+
+/* Writes the cache back to disk if anything has changed */
+void
+push_config_cache_save(
+    PushConfigCache* cache);
+
+#endif /* JOLLA_PUSH_AGENT_CACHE_H */
+
+/*
+ * Local Variables:
+ * mode: C
+ * c-basic-offset: 4
+ * indent-tabs-mode: nil
+ * End:
+ */
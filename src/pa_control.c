@@ -0,0 +1,212 @@
+/*
+ * Copyright (C) 2013-2014 Jolla Ltd.
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License version 2 as
+ * published by the Free Software Foundation.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ */
+
+#include "pa_control.h"
+#include "pa_log.h"
+
+#include "org.nemomobile.PushAgent.h"
+
+#define PUSH_CONTROL_SERVICE    "org.nemomobile.PushAgent"
+#define PUSH_CONTROL_PATH       "/"
+
+struct push_control {
+    PushAgent* agent;
+    GDBusConnection* bus;
+    OrgNemomobilePushAgent* skeleton;
+    guint own_name_id;
+    gulong get_handlers_signal_id;
+    gulong get_handler_queues_signal_id;
+    gulong get_dead_letters_signal_id;
+    gulong replay_dead_letter_signal_id;
+    gulong replay_dead_letters_signal_id;
+    gulong get_receive_queues_signal_id;
+};
+
+static
+gboolean /* org.nemomobile.PushAgent.GetHandlers */
+push_control_get_handlers(
+    OrgNemomobilePushAgent* skeleton,
+    GDBusMethodInvocation* call,
+    PushControl* control)
+{
+    org_nemomobile_push_agent_complete_get_handlers(skeleton, call,
+        push_agent_handlers(control->agent));
+    return TRUE;
+}
+
+static
+gboolean /* org.nemomobile.PushAgent.GetHandlerQueues */
+push_control_get_handler_queues(
+    OrgNemomobilePushAgent* skeleton,
+    GDBusMethodInvocation* call,
+    PushControl* control)
+{
+    org_nemomobile_push_agent_complete_get_handler_queues(skeleton, call,
+        push_agent_handler_queues(control->agent));
+    return TRUE;
+}
+
+static
+gboolean /* org.nemomobile.PushAgent.GetDeadLetters */
+push_control_get_dead_letters(
+    OrgNemomobilePushAgent* skeleton,
+    GDBusMethodInvocation* call,
+    PushControl* control)
+{
+    org_nemomobile_push_agent_complete_get_dead_letters(skeleton, call,
+        push_agent_dead_letters(control->agent),
+        push_agent_dead_letters_dropped(control->agent));
+    return TRUE;
+}
+
+static
+gboolean /* org.nemomobile.PushAgent.ReplayDeadLetter */
+push_control_replay_dead_letter(
+    OrgNemomobilePushAgent* skeleton,
+    GDBusMethodInvocation* call,
+    guint64 id,
+    PushControl* control)
+{
+    if (id && push_agent_replay_dead_letters(control->agent, id)) {
+        org_nemomobile_push_agent_complete_replay_dead_letter(skeleton, call);
+    } else {
+        g_dbus_method_invocation_return_error(call, G_DBUS_ERROR,
+            G_DBUS_ERROR_INVALID_ARGS, "Can't replay dead letter %"
+            G_GUINT64_FORMAT, id);
+    }
+    return TRUE;
+}
+
+static
+gboolean /* org.nemomobile.PushAgent.ReplayDeadLetters */
+push_control_replay_dead_letters(
+    OrgNemomobilePushAgent* skeleton,
+    GDBusMethodInvocation* call,
+    PushControl* control)
+{
+    org_nemomobile_push_agent_complete_replay_dead_letters(skeleton, call,
+        push_agent_replay_dead_letters(control->agent, 0));
+    return TRUE;
+}
+
+static
+gboolean /* org.nemomobile.PushAgent.GetReceiveQueues */
+push_control_get_receive_queues(
+    OrgNemomobilePushAgent* skeleton,
+    GDBusMethodInvocation* call,
+    PushControl* control)
+{
+    org_nemomobile_push_agent_complete_get_receive_queues(skeleton, call,
+        push_agent_receive_queues(control->agent));
+    return TRUE;
+}
+
+static
+void
+push_control_name_acquired(
+    GDBusConnection* bus,
+    const char* name,
+    gpointer data)
+{
+    PA_DEBUG("Acquired service name %s", name);
+}
+
+static
+void
+push_control_name_lost(
+    GDBusConnection* bus,
+    const char* name,
+    gpointer data)
+{
+    PA_WARN("Failed to acquire service name %s", name);
+}
+
+PushControl*
+push_control_new(
+    PushAgent* agent,
+    GDBusConnection* bus)
+{
+    GError* error = NULL;
+    PushControl* control = g_new0(PushControl, 1);
+    control->agent = agent;
+    control->skeleton = org_nemomobile_push_agent_skeleton_new();
+    if (g_dbus_interface_skeleton_export(
+        G_DBUS_INTERFACE_SKELETON(control->skeleton), bus,
+        PUSH_CONTROL_PATH, &error)) {
+        control->bus = g_object_ref(bus);
+        control->get_handlers_signal_id = g_signal_connect(
+            control->skeleton, "handle-get-handlers",
+            G_CALLBACK(push_control_get_handlers), control);
+        control->get_handler_queues_signal_id = g_signal_connect(
+            control->skeleton, "handle-get-handler-queues",
+            G_CALLBACK(push_control_get_handler_queues), control);
+        control->get_dead_letters_signal_id = g_signal_connect(
+            control->skeleton, "handle-get-dead-letters",
+            G_CALLBACK(push_control_get_dead_letters), control);
+        control->replay_dead_letter_signal_id = g_signal_connect(
+            control->skeleton, "handle-replay-dead-letter",
+            G_CALLBACK(push_control_replay_dead_letter), control);
+        control->replay_dead_letters_signal_id = g_signal_connect(
+            control->skeleton, "handle-replay-dead-letters",
+            G_CALLBACK(push_control_replay_dead_letters), control);
+        control->get_receive_queues_signal_id = g_signal_connect(
+            control->skeleton, "handle-get-receive-queues",
+            G_CALLBACK(push_control_get_receive_queues), control);
+        control->own_name_id = g_bus_own_name_on_connection(bus,
+            PUSH_CONTROL_SERVICE, G_BUS_NAME_OWNER_FLAGS_NONE,
+            push_control_name_acquired, push_control_name_lost,
+            control, NULL);
+        return control;
+    } else {
+        PA_ERR("%s", PA_ERRMSG(error));
+        g_error_free(error);
+        g_object_unref(control->skeleton);
+        g_free(control);
+        return NULL;
+    }
+}
+
+void
+push_control_free(
+    PushControl* control)
+{
+    if (control) {
+        g_bus_unown_name(control->own_name_id);
+        g_signal_handler_disconnect(control->skeleton,
+            control->get_handlers_signal_id);
+        g_signal_handler_disconnect(control->skeleton,
+            control->get_handler_queues_signal_id);
+        g_signal_handler_disconnect(control->skeleton,
+            control->get_dead_letters_signal_id);
+        g_signal_handler_disconnect(control->skeleton,
+            control->replay_dead_letter_signal_id);
+        g_signal_handler_disconnect(control->skeleton,
+            control->replay_dead_letters_signal_id);
+        g_signal_handler_disconnect(control->skeleton,
+            control->get_receive_queues_signal_id);
+        g_dbus_interface_skeleton_unexport(
+            G_DBUS_INTERFACE_SKELETON(control->skeleton));
+        g_object_unref(control->skeleton);
+        g_object_unref(control->bus);
+        g_free(control);
+    }
+}
+
+/*
+ * Local Variables:
+ * mode: C
+ * c-basic-offset: 4
+ * indent-tabs-mode: nil
+ * End:
+ */
@@ -0,0 +1,42 @@
+/*
+ * Copyright (C) 2013-2014 Jolla Ltd.
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License version 2 as
+ * published by the Free Software Foundation.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ */
+
+#ifndef JOLLA_PUSH_AGENT_CONTROL_H
+#define JOLLA_PUSH_AGENT_CONTROL_H
+
+#include "pa.h"
+
+#include <gio/gio.h>
+
+/* org.nemomobile.PushAgent D-Bus interface */
+typedef struct push_control PushControl;
+
+PushControl*
+push_control_new(
+    PushAgent* agent,
+    GDBusConnection* bus);
+
+void
+push_control_free(
+    PushControl* control);
+
+#endif /* JOLLA_PUSH_AGENT_CONTROL_H */
+
+/*
+ * Local Variables:
+ * mode: C
+ * c-basic-offset: 4
+ * indent-tabs-mode: nil
+ * End:
+ */
@@ -0,0 +1,202 @@
+/*
+ * Copyright (C) 2013-2014 Jolla Ltd.
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License version 2 as
+ * published by the Free Software Foundation.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ */
+
+#include "pa_deadletter.h"
+#include "pa_log.h"
+
+struct push_dead_letters {
+    GQueue queue;
+    guint max_count;
+    guint64 last_id;
+    guint dropped;
+    PushDeadLetterDropFunc drop;
+    void* user_data;
+};
+
+static
+void
+push_dead_letter_free(
+    PushDeadLetter* letter)
+{
+    push_notification_unref(letter->push);
+    g_free(letter->handler);
+    g_free(letter->error);
+    g_free(letter);
+}
+
+PushDeadLetters*
+push_dead_letters_new(
+    guint max_count,
+    PushDeadLetterDropFunc drop,
+    void* user_data)
+{
+    PushDeadLetters* letters = g_new0(PushDeadLetters, 1);
+    g_queue_init(&letters->queue);
+    letters->max_count = MAX(max_count, 1);
+    letters->drop = drop;
+    letters->user_data = user_data;
+    return letters;
+}
+
+void
+push_dead_letters_free(
+    PushDeadLetters* letters)
+{
+    if (letters) {
+        PushDeadLetter* letter;
+        while ((letter = g_queue_pop_head(&letters->queue)) != NULL) {
+            push_dead_letter_free(letter);
+        }
+        g_free(letters);
+    }
+}
+
+/* Drops the oldest letters until there's room for the specified
+ * number of new ones */
+static
+void
+push_dead_letters_trim(
+    PushDeadLetters* letters,
+    guint room)
+{
+    while (letters->queue.length &&
+        letters->queue.length + room > letters->max_count) {
+        /* Shed notifications go first, then the oldest failure */
+        GList* link = letters->queue.head;
+        PushDeadLetter* oldest;
+        while (link && !((PushDeadLetter*)link->data)->shed) {
+            link = link->next;
+        }
+        if (!link) link = letters->queue.head;
+        oldest = link->data;
+        g_queue_delete_link(&letters->queue, link);
+        letters->dropped++;
+        PA_WARN("Dropping dead letter %" G_GUINT64_FORMAT " (%s for %s), "
+            "%u dropped so far", oldest->id, oldest->push->content_type,
+            oldest->handler, letters->dropped);
+        if (letters->drop) letters->drop(oldest, letters->user_data);
+        push_dead_letter_free(oldest);
+    }
+}
+
+guint64
+push_dead_letters_add(
+    PushDeadLetters* letters,
+    const char* handler,
+    PushNotification* push,
+    const GError* error)
+{
+    PushDeadLetter* letter = g_new0(PushDeadLetter, 1);
+    push_dead_letters_trim(letters, 1);
+    letter->id = ++(letters->last_id);
+    letter->handler = g_strdup(handler);
+    letter->error = g_strdup(error ? error->message : "");
+    letter->shed = error && error->domain == PUSH_HANDLER_ERROR;
+    letter->time = g_get_real_time();
+    /* Shares the payload but not the done callback of the original */
+    letter->push = push_notification_new(push->imsi, push->content_type,
+        push->data, 0, g_bytes_get_size(push->data), NULL, NULL);
+    letter->push->spool_id = push->spool_id;
+    if (push->info) letter->push->info = g_variant_ref(push->info);
+    g_queue_push_tail(&letters->queue, letter);
+    PA_DEBUG("Dead letter %" G_GUINT64_FORMAT " for %s", letter->id, handler);
+    return letter->id;
+}
+
+guint
+push_dead_letters_replay(
+    PushDeadLetters* letters,
+    guint64 id,
+    PushDeadLetterReplayFunc fn,
+    void* user_data)
+{
+    guint count = 0;
+    GQueue taken;
+    GList* link = letters->queue.head;
+    PushDeadLetter* letter;
+
+    /* The callback may add new letters and evict the old ones, take
+     * the matching ones out of the store before calling it */
+    g_queue_init(&taken);
+    while (link) {
+        GList* next = link->next;
+        letter = link->data;
+        if (!id || letter->id == id) {
+            g_queue_unlink(&letters->queue, link);
+            g_queue_push_tail_link(&taken, link);
+            if (id) break;
+        }
+        link = next;
+    }
+
+    /* Oldest first, those that haven't been taken care of are kept */
+    link = taken.head;
+    while (link) {
+        GList* next = link->next;
+        letter = link->data;
+        if (fn(letter, user_data)) {
+            g_queue_delete_link(&taken, link);
+            push_dead_letter_free(letter);
+            count++;
+        }
+        link = next;
+    }
+
+    /* They go back ahead of whatever has been added in the meantime */
+    while ((letter = g_queue_pop_tail(&taken)) != NULL) {
+        g_queue_push_head(&letters->queue, letter);
+    }
+    push_dead_letters_trim(letters, 0);
+    return count;
+}
+
+gboolean
+push_dead_letters_full(
+    PushDeadLetters* letters)
+{
+    return letters->queue.length >= letters->max_count;
+}
+
+guint
+push_dead_letters_dropped(
+    PushDeadLetters* letters)
+{
+    return letters->dropped;
+}
+
+GVariant*
+push_dead_letters_to_variant(
+    PushDeadLetters* letters)
+{
+    GList* link;
+    GVariantBuilder builder;
+    g_variant_builder_init(&builder, G_VARIANT_TYPE("a(tssssxay)"));
+    for (link = letters->queue.head; link; link = link->next) {
+        PushDeadLetter* letter = link->data;
+        PushNotification* push = letter->push;
+        g_variant_builder_add(&builder, "(tssssx@ay)", letter->id,
+            letter->handler, push->imsi ? push->imsi : "",
+            push->content_type, letter->error,
+            letter->time / G_USEC_PER_SEC, push->body);
+    }
+    return g_variant_builder_end(&builder);
+}
+
+/*
+ * Local Variables:
+ * mode: C
+ * c-basic-offset: 4
+ * indent-tabs-mode: nil
+ * End:
+ */
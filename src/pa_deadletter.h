@@ -0,0 +1,99 @@
+/*
+ * Copyright (C) 2013-2014 Jolla Ltd.
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License version 2 as
+ * published by the Free Software Foundation.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ */
+
+#ifndef JOLLA_PUSH_AGENT_DEADLETTER_H
+#define JOLLA_PUSH_AGENT_DEADLETTER_H
+
+#include "pa_handler.h"
+#include "pa_notification.h"
+
+/*
+ * Bounded store of notifications which a handler failed to accept
+ * even after retrying, or shed. When the store is full, the oldest
+ * shed letter (or the oldest one, if none of them has been shed) is
+ * dropped to make room for the new one.
+ */
+typedef struct push_dead_letters PushDeadLetters;
+
+typedef struct push_dead_letter {
+    guint64 id;
+    char* handler;
+    char* error;
+    gint64 time;
+    gboolean shed;  /* Shed by the handler rather than failed */
+    PushNotification* push;
+} PushDeadLetter;
+
+typedef void
+(*PushDeadLetterDropFunc)(
+    const PushDeadLetter* letter,
+    void* user_data);
+
+/* Returns TRUE if the letter has been taken care of */
+typedef gboolean
+(*PushDeadLetterReplayFunc)(
+    const PushDeadLetter* letter,
+    void* user_data);
+
+PushDeadLetters*
+push_dead_letters_new(
+    guint max_count,
+    PushDeadLetterDropFunc drop,
+    void* user_data);
+
+void
+push_dead_letters_free(
+    PushDeadLetters* letters);
+
+guint64
+push_dead_letters_add(
+    PushDeadLetters* letters,
+    const char* handler,
+    PushNotification* push,
+    const GError* error);
+
+/* Invokes the callback for the letter with the specified id (or for
+ * all of them if id is zero) and removes the letters for which the
+ * callback returns TRUE. Returns the number of letters removed. */
+guint
+push_dead_letters_replay(
+    PushDeadLetters* letters,
+    guint64 id,
+    PushDeadLetterReplayFunc fn,
+    void* user_data);
+
+/* TRUE if adding a letter would drop the oldest one */
+gboolean
+push_dead_letters_full(
+    PushDeadLetters* letters);
+
+/* Number of letters dropped because the store was full */
+guint
+push_dead_letters_dropped(
+    PushDeadLetters* letters);
+
+/* a(tssssxay) - id, handler, imsi, content type, error, time, data */
+GVariant*
+push_dead_letters_to_variant(
+    PushDeadLetters* letters);
+
+#endif /* JOLLA_PUSH_AGENT_DEADLETTER_H */
+
+/*
+ * Local Variables:
+ * mode: C
+ * c-basic-offset: 4
+ * indent-tabs-mode: nil
+ * End:
+ */
@@ -16,11 +16,20 @@
 #include "pa_log.h"
 
 #include <sys/inotify.h>
-#include <sys/ioctl.h>
 #include <unistd.h>
 #include <string.h>
+#include <limits.h>
 #include <errno.h>
 
+/* Room for a few events with the longest possible names. Events are
+ * never split, a partially read buffer is simply read again. */
+#define PUSH_DIR_EVENT_SIZE (sizeof(struct inotify_event) + NAME_MAX + 1)
+#define PUSH_DIR_BUF_SIZE   (16 * PUSH_DIR_EVENT_SIZE)
+
+/* A steady stream of changes may postpone the flush this many times
+ * the delay, not longer than that */
+#define PUSH_DIR_MAX_DELAY_FACTOR (4)
+
 struct push_dir_watcher {
     PushDirWatchProc proc;
     PushAgent* agent;
@@ -29,8 +38,65 @@ struct push_dir_watcher {
     int watch_fd;
     guint watch_source_id;
     GIOChannel* watch_chan;
+    guint delay;
+    guint delay_id;
+    gint64 delay_start;
+    gboolean overflow;
+    GHashTable* changed;
+    union {
+        struct inotify_event event;
+        char data[PUSH_DIR_BUF_SIZE];
+    } buf;
 };
 
+static
+gboolean
+push_dir_watcher_flush(
+    gpointer data)
+{
+    PushDirWatcher* watcher = data;
+    watcher->delay_id = 0;
+    if (watcher->overflow) {
+        /* We have lost track of what has changed, rescan everything */
+        PA_VERBOSE("Rescanning %s", watcher->dir);
+        watcher->overflow = FALSE;
+        g_hash_table_remove_all(watcher->changed);
+        watcher->proc(watcher->agent, NULL, 0);
+    } else {
+        const guint count = g_hash_table_size(watcher->changed);
+        if (count) {
+            GHashTableIter it;
+            gpointer key;
+            guint i = 0;
+            const char** files = g_new(const char*, count);
+            g_hash_table_iter_init(&it, watcher->changed);
+            while (g_hash_table_iter_next(&it, &key, NULL)) {
+                files[i++] = key;
+            }
+            watcher->proc(watcher->agent, files, count);
+            g_hash_table_remove_all(watcher->changed);
+            g_free(files);
+        }
+    }
+    return FALSE;
+}
+
+static
+void
+push_dir_watcher_event(
+    PushDirWatcher* watcher,
+    const struct inotify_event* event)
+{
+    if (event->mask & IN_Q_OVERFLOW) {
+        PA_WARN("Too many changes in %s", watcher->dir);
+        watcher->overflow = TRUE;
+        g_hash_table_remove_all(watcher->changed);
+    } else if (event->len && !watcher->overflow) {
+        PA_VERBOSE("Notify: %s/%s", watcher->dir, event->name);
+        g_hash_table_add(watcher->changed, g_strdup(event->name));
+    }
+}
+
 static
 gboolean
 push_dir_watcher_notify(
@@ -38,66 +104,82 @@ push_dir_watcher_notify(
     GIOCondition condition,
     gpointer data)
 {
-    gboolean ok = FALSE;
     PushDirWatcher* watcher = data;
-    int avail = 0;
-    if (ioctl(watcher->inotify_fd, FIONREAD, &avail) >= 0) {
-        gsize len = 0;
-        GError* error = NULL;
-        void* buf = g_malloc(avail);
-        if (g_io_channel_read_chars(gio, buf, avail, &len, &error) ==
-            G_IO_STATUS_NORMAL) {
-            GPtrArray* dir = g_ptr_array_new();
-            const guint8* ptr = buf;
-            const struct inotify_event* event = (void*)ptr;
-            while (len >= sizeof(*event)) {
-                gsize eventlen = sizeof(*event) + event->len;
-                PA_ASSERT(len >= eventlen);
-                if (len >= eventlen) {
-                    PA_VERBOSE("Notify: %s/%s", watcher->dir, event->name);
-                    g_ptr_array_add(dir, (char*)event->name);
-                    len -= eventlen;
-                    event = (void*)(ptr += eventlen);
-                } else {
-                    break;
-                }
+    gboolean received = FALSE;
+    for (;;) {
+        ssize_t len = read(watcher->inotify_fd, watcher->buf.data,
+            sizeof(watcher->buf.data));
+        if (len > 0) {
+            const char* ptr = watcher->buf.data;
+            const char* end = ptr + len;
+            received = TRUE;
+            while (ptr + sizeof(struct inotify_event) <= end) {
+                const struct inotify_event* event = (void*)ptr;
+                const gsize eventlen = sizeof(*event) + event->len;
+                if (ptr + eventlen > end) break;
+                push_dir_watcher_event(watcher, event);
+                ptr += eventlen;
             }
-            watcher->proc(watcher->agent, (const char**)dir->pdata, dir->len);
-            g_ptr_array_free(dir, TRUE);
-            ok = TRUE;
+        } else if (len < 0 && errno == EINTR) {
+            continue;
+        } else if (len < 0 && errno == EAGAIN) {
+            break;
         } else {
-            PA_ERR("%s", PA_ERRMSG(error));
-            g_error_free(error);
+            PA_ERR("Directory watch error: %s", len ? strerror(errno) :
+                "end of file");
+            watcher->watch_source_id = 0;
+            /* Nothing else is coming, don't sit on what we have got */
+            if (watcher->delay_id) {
+                g_source_remove(watcher->delay_id);
+                push_dir_watcher_flush(watcher);
+            }
+            return FALSE;
         }
-        g_free(buf);
-    } else {
-        PA_ERR("Directory watch error: %s", strerror(errno));
     }
-    return ok;
+
+    if (received && (watcher->overflow ||
+        g_hash_table_size(watcher->changed))) {
+        /* Each event restarts the window, up to the limit */
+        const gint64 now = g_get_monotonic_time();
+        const gint64 max_delay = (gint64)watcher->delay *
+            PUSH_DIR_MAX_DELAY_FACTOR * 1000;
+        gint64 left;
+        if (watcher->delay_id) {
+            g_source_remove(watcher->delay_id);
+        } else {
+            watcher->delay_start = now;
+        }
+        left = (watcher->delay_start + max_delay - now) / 1000;
+        watcher->delay_id = g_timeout_add((guint)CLAMP(left, 0,
+            (gint64)watcher->delay), push_dir_watcher_flush, watcher);
+    }
+    return TRUE;
 }
 
 PushDirWatcher*
 push_dir_watcher_new(
     const char* dir,
+    guint delay,
     PushDirWatchProc proc,
     PushAgent* agent)
 {
     PushDirWatcher* watcher = g_new0(PushDirWatcher, 1);
-    watcher->inotify_fd = inotify_init();
+    watcher->inotify_fd = inotify_init1(IN_NONBLOCK | IN_CLOEXEC);
     if (watcher->inotify_fd >= 0) {
         watcher->watch_fd = inotify_add_watch(watcher->inotify_fd, dir,
             IN_CLOSE_WRITE | IN_DELETE | IN_MOVE);
         if (watcher->watch_fd >= 0) {
             watcher->watch_chan = g_io_channel_unix_new(watcher->inotify_fd);
             if (watcher->watch_chan) {
-                g_io_channel_set_encoding(watcher->watch_chan, NULL, NULL);
-                g_io_channel_set_buffered(watcher->watch_chan, FALSE);
                 watcher->watch_source_id = g_io_add_watch(watcher->watch_chan,
                     G_IO_IN, push_dir_watcher_notify, watcher);
                 if (watcher->watch_source_id) {
                     watcher->proc = proc;
                     watcher->agent = agent;
                     watcher->dir = g_strdup(dir);
+                    watcher->delay = delay;
+                    watcher->changed = g_hash_table_new_full(g_str_hash,
+                        g_str_equal, g_free, NULL);
                     return watcher;
                 }
                 g_io_channel_unref(watcher->watch_chan);
@@ -127,6 +209,8 @@ push_dir_watcher_free(
             }
             close(watcher->inotify_fd);
         }
+        if (watcher->delay_id) g_source_remove(watcher->delay_id);
+        g_hash_table_destroy(watcher->changed);
         g_free(watcher->dir);
         g_free(watcher);
     }
@@ -17,6 +17,11 @@
 
 #include "pa.h"
 
+/* Changes are collected until nothing has changed for the specified
+ * delay (in milliseconds) but no longer than four times the delay after
+ * the first one, and then reported at once, each file name only once.
+ * NULL file list means that events have been lost and the whole
+ * directory needs to be rescanned. */
 typedef struct push_dir_watcher PushDirWatcher;
 typedef void
 (*PushDirWatchProc)(
@@ -27,6 +32,7 @@ typedef void
 PushDirWatcher*
 push_dir_watcher_new(
     const char* dir,
+    guint delay,
     PushDirWatchProc proc,
     PushAgent* agent);
 
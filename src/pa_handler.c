@@ -0,0 +1,1205 @@
+/*
+ * Copyright (C) 2013-2014 Jolla Ltd.
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License version 2 as
+ * published by the Free Software Foundation.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ */
+
+#include "pa_handler.h"
+#include "pa_log.h"
+#include "pa_service.h"
+#include "pa_wsp.h"
+
+#include <gio/gio.h>
+
+/* Retry policy defaults */
+#define PUSH_HANDLER_RETRY_MAX_ATTEMPTS     (3)
+#define PUSH_HANDLER_RETRY_BACKOFF          (1000)  /* ms */
+#define PUSH_HANDLER_RETRY_BACKOFF_MAX      (60000) /* ms */
+#define PUSH_HANDLER_RETRY_JITTER           (20)    /* percent */
+
+/* Circuit breaker defaults */
+#define PUSH_HANDLER_BREAKER_THRESHOLD      (5)
+#define PUSH_HANDLER_BREAKER_PROBE_INTERVAL (30000) /* ms */
+
+/* Limits the number of notifications waiting for the service */
+#define PUSH_HANDLER_MAX_PARKED             (64)
+
+/* Batching defaults */
+#define PUSH_HANDLER_BATCH_WINDOW           (100)   /* ms */
+#define PUSH_HANDLER_BATCH_MAX_SIZE         (16)
+
+/* Limits the number of notifications waiting to be sent */
+#define PUSH_HANDLER_MAX_QUEUED             (1024)
+
+/* Waiting longer than that takes precedence over the priority */
+#define PUSH_HANDLER_MAX_WAIT               (5000)  /* ms */
+
+/* Share of the calls each priority class gets when all are busy */
+static const int push_handler_weights[PUSH_PRIORITY_COUNT] = { 1, 2, 4 };
+
+static const char* const push_priority_names[PUSH_PRIORITY_COUNT] = {
+    "low", "normal", "high"
+};
+
+typedef struct push_handler_priv {
+    PushHandler pub;
+    gint ref_count;
+    int timeout;
+    int in_flight;
+    GQueue queue[PUSH_PRIORITY_COUNT];
+    int credit[PUSH_PRIORITY_COUNT];
+    guint shed[PUSH_PRIORITY_COUNT];
+    GDBusConnection* bus;
+    GDBusMessage* call_template;
+    GDBusMessage* batch_template;
+    PushService* service;
+    gulong service_changed_id;
+    PushHandlerResultFunc result;
+    void* result_data;
+    PushHandlerBreaker breaker;
+    int failures;
+    guint probe_id;
+    guint batch_id;
+    gboolean batch_expired;
+    gboolean retired;
+    PushHandler* successor;
+} PushHandlerPriv;
+
+/* Deliveries sent in the same batch are linked together */
+typedef struct push_handler_delivery PushHandlerDelivery;
+struct push_handler_delivery {
+    PushHandlerPriv* handler;
+    PushNotification* push;
+    PushHandlerDelivery* next;
+    int attempts;
+    PushPriority priority;
+    gint64 queued;
+};
+
+GQuark
+push_handler_error_quark(void)
+{
+    return g_quark_from_static_string("push-handler-error-quark");
+}
+
+static inline PushHandlerPriv*
+push_handler_cast(PushHandler* handler)
+    { return (PushHandlerPriv*)handler; }
+
+static
+void
+push_handler_dispatch(
+    PushHandlerPriv* priv);
+
+static
+guint
+push_handler_queue_length(
+    PushHandlerPriv* priv)
+{
+    guint i, n = 0;
+    for (i=0; i<PUSH_PRIORITY_COUNT; i++) n += priv->queue[i].length;
+    return n;
+}
+
+static
+PushHandlerDelivery*
+push_handler_pop(
+    PushHandlerPriv* priv)
+{
+    gint64 oldest = g_get_monotonic_time() - PUSH_HANDLER_MAX_WAIT * 1000;
+    int i, pass, pick = -1;
+
+    /* The one that has been waiting for too long goes first */
+    for (i=0; i<PUSH_PRIORITY_COUNT; i++) {
+        PushHandlerDelivery* d = g_queue_peek_head(&priv->queue[i]);
+        if (d && d->queued <= oldest) {
+            oldest = d->queued;
+            pick = i;
+        }
+    }
+
+    /* Otherwise the most urgent class that has some credit left. Once
+     * they all have used up their credit, a new round starts. */
+    for (pass=0; pass<2 && pick < 0; pass++) {
+        for (i=PUSH_PRIORITY_COUNT-1; i>=0 && pick < 0; i--) {
+            if (priv->queue[i].length && priv->credit[i] > 0) pick = i;
+        }
+        if (pick < 0) {
+            for (i=0; i<PUSH_PRIORITY_COUNT; i++) {
+                priv->credit[i] = push_handler_weights[i];
+            }
+        }
+    }
+
+    if (pick >= 0) {
+        if (priv->credit[pick] > 0) priv->credit[pick]--;
+        return g_queue_pop_head(&priv->queue[pick]);
+    }
+    return NULL;
+}
+
+static
+void
+push_handler_delivery_free(
+    PushHandlerDelivery* delivery)
+{
+    PushHandlerPriv* priv = delivery->handler;
+    push_notification_unref(delivery->push);
+    g_free(delivery);
+    push_handler_unref(&priv->pub);
+}
+
+static
+void
+push_handler_result(
+    PushHandlerPriv* priv,
+    PushHandlerDelivery* delivery,
+    const GError* error)
+{
+    if (priv->result) {
+        priv->result(&priv->pub, delivery->push, error, priv->result_data);
+    }
+    push_handler_delivery_free(delivery);
+}
+
+static
+void
+push_handler_shed(
+    PushHandlerPriv* priv,
+    PushHandlerDelivery* delivery,
+    gboolean available)
+{
+    PushHandler* handler = &priv->pub;
+    GError* error = available ?
+        g_error_new(PUSH_HANDLER_ERROR, PUSH_HANDLER_ERROR_OVERLOADED,
+            "%s is overloaded", handler->name) :
+        g_error_new(PUSH_HANDLER_ERROR, PUSH_HANDLER_ERROR_UNAVAILABLE,
+            "%s is not available", handler->service);
+    priv->shed[delivery->priority]++;
+    PA_WARN("%s: shedding %s priority notification (%s)", handler->name,
+        push_priority_names[delivery->priority], error->message);
+    push_handler_result(priv, delivery, error);
+    g_error_free(error);
+}
+
+static
+guint
+push_handler_limit(
+    PushHandlerPriv* priv,
+    gboolean available)
+{
+    /* Until the state of the service is known (e.g. when the spool
+     * is replayed at startup) nothing counts as parked */
+    return (available || !push_service_known(priv->service)) ?
+        (guint)priv->pub.max_queued : (guint)priv->pub.max_parked;
+}
+
+static
+gboolean
+push_handler_make_room(
+    PushHandlerPriv* priv,
+    PushPriority priority,
+    guint limit,
+    gboolean available)
+{
+    /* The queue may be over the limit if the limit has just dropped,
+     * e.g. because the service has gone and MaxParked applies now */
+    while (push_handler_queue_length(priv) >= limit) {
+        int i = 0;
+        /* The oldest one of the lowest class goes */
+        while (i <= (int)priority && !priv->queue[i].length) i++;
+        if (i > (int)priority) return FALSE;
+        push_handler_shed(priv, g_queue_pop_head(&priv->queue[i]),
+            available);
+    }
+    return TRUE;
+}
+
+static
+guint
+push_handler_backoff(
+    PushHandler* handler,
+    int attempts)
+{
+    /* Double the delay after each failed attempt, up to the limit */
+    guint64 delay = handler->retry_backoff;
+    int i;
+    for (i=1; i<attempts && delay < (guint64)handler->retry_backoff_max; i++) {
+        delay *= 2;
+    }
+    if (delay > (guint64)handler->retry_backoff_max) {
+        delay = handler->retry_backoff_max;
+    }
+
+    /* Spread the retries so that handlers don't all get hit at once
+     * when the service comes back */
+    if (handler->retry_jitter > 0) {
+        const guint64 spread = delay * handler->retry_jitter / 100;
+        delay = delay - spread + (guint64)(g_random_double() * 2 * spread);
+    }
+    return (guint)delay;
+}
+
+static
+gboolean
+push_handler_retry(
+    gpointer data)
+{
+    PushHandlerDelivery* delivery = data;
+    PushHandlerPriv* priv = delivery->handler;
+    const gboolean available = push_service_available(priv->service);
+    PA_DEBUG("Retrying %s (attempt %d)", priv->pub.name,
+        delivery->attempts + 1);
+    /* The queue may have filled up while the retry was pending */
+    if (push_handler_make_room(priv, delivery->priority,
+        push_handler_limit(priv, available), available)) {
+        /* Retries go ahead of the notifications that have been waiting */
+        g_queue_push_head(&priv->queue[delivery->priority], delivery);
+        push_handler_dispatch(priv);
+    } else {
+        push_handler_shed(priv, delivery, available);
+    }
+    push_handler_unref(&priv->pub);
+    return G_SOURCE_REMOVE;
+}
+
+const char*
+push_handler_breaker_name(
+    PushHandlerBreaker breaker)
+{
+    switch (breaker) {
+    case PUSH_HANDLER_BREAKER_CLOSED:    return "closed";
+    case PUSH_HANDLER_BREAKER_OPEN:      return "open";
+    case PUSH_HANDLER_BREAKER_HALF_OPEN: return "half-open";
+    }
+    return "unknown";
+}
+
+static
+void
+push_handler_set_breaker(
+    PushHandlerPriv* priv,
+    PushHandlerBreaker breaker)
+{
+    if (priv->breaker != breaker) {
+        PushHandler* handler = &priv->pub;
+        if (breaker == PUSH_HANDLER_BREAKER_OPEN) {
+            PA_WARN("%s: circuit breaker open after %d failure(s), "
+                "%u queued", handler->name, priv->failures,
+                push_handler_queue_length(priv));
+        } else {
+            PA_INFO("%s: circuit breaker %s", handler->name,
+                push_handler_breaker_name(breaker));
+        }
+        priv->breaker = breaker;
+    }
+}
+
+static
+void
+push_handler_cancel_probe(
+    PushHandlerPriv* priv)
+{
+    if (priv->probe_id) {
+        g_source_remove(priv->probe_id);
+        priv->probe_id = 0;
+        push_handler_unref(&priv->pub);
+    }
+}
+
+static
+gboolean
+push_handler_probe(
+    gpointer data)
+{
+    PushHandlerPriv* priv = data;
+    priv->probe_id = 0;
+    /* The next call (if there is one) is the probe */
+    push_handler_set_breaker(priv, PUSH_HANDLER_BREAKER_HALF_OPEN);
+    push_handler_dispatch(priv);
+    push_handler_unref(&priv->pub);
+    return G_SOURCE_REMOVE;
+}
+
+static
+void
+push_handler_call_succeeded(
+    PushHandlerPriv* priv)
+{
+    priv->failures = 0;
+    push_handler_cancel_probe(priv);
+    push_handler_set_breaker(priv, PUSH_HANDLER_BREAKER_CLOSED);
+}
+
+static
+void
+push_handler_call_failed(
+    PushHandlerPriv* priv)
+{
+    PushHandler* handler = &priv->pub;
+    priv->failures++;
+    if (handler->breaker_threshold > 0 && !priv->probe_id &&
+        (priv->breaker == PUSH_HANDLER_BREAKER_HALF_OPEN ||
+         priv->failures >= handler->breaker_threshold)) {
+        push_handler_set_breaker(priv, PUSH_HANDLER_BREAKER_OPEN);
+        /* The timeout holds a reference to the handler */
+        push_handler_ref(handler);
+        priv->probe_id = g_timeout_add(handler->breaker_probe_interval,
+            push_handler_probe, priv);
+    }
+}
+
+static
+void
+push_handler_failed(
+    PushHandlerPriv* priv,
+    PushHandlerDelivery* delivery,
+    const GError* error)
+{
+    PushHandler* handler = &priv->pub;
+    delivery->next = NULL;
+    if (delivery->attempts < handler->retry_max_attempts) {
+        const guint delay = push_handler_backoff(handler, delivery->attempts);
+        PA_DEBUG("%s: retry in %u ms", handler->name, delay);
+        /* The timeout holds a reference to the handler */
+        push_handler_ref(handler);
+        g_timeout_add(delay, push_handler_retry, delivery);
+    } else {
+        PA_WARN("%s: giving up after %d attempt(s)", handler->name,
+            delivery->attempts);
+        push_handler_result(priv, delivery, error);
+    }
+}
+
+static
+void
+push_handler_call_done(
+    GObject* bus,
+    GAsyncResult* result,
+    gpointer data)
+{
+    GError* error = NULL;
+    PushHandlerDelivery* delivery = data;
+    PushHandlerPriv* priv = delivery->handler;
+    PushHandler* handler = &priv->pub;
+    GDBusMessage* reply = g_dbus_connection_send_message_with_reply_finish(
+        G_DBUS_CONNECTION(bus), result, &error);
+    PA_ASSERT(priv->in_flight > 0);
+    priv->in_flight--;
+    if (reply && !g_dbus_message_to_gerror(reply, &error)) {
+        PA_VERBOSE("%s done", handler->name);
+        push_handler_call_succeeded(priv);
+        while (delivery) {
+            PushHandlerDelivery* next = delivery->next;
+            push_handler_result(priv, delivery, NULL);
+            delivery = next;
+        }
+    } else {
+        PA_ERR("%s: %s", handler->name, PA_ERRMSG(error));
+        push_handler_call_failed(priv);
+        while (delivery) {
+            PushHandlerDelivery* next = delivery->next;
+            push_handler_failed(priv, delivery, error);
+            delivery = next;
+        }
+        g_error_free(error);
+    }
+    if (reply) g_object_unref(reply);
+    push_handler_dispatch(priv);
+    push_handler_unref(handler);
+}
+
+static
+GVariant*
+push_handler_args(
+    PushHandler* handler,
+    PushNotification* push)
+{
+    if (handler->extended) {
+        return g_variant_new("(ss@a{sv}@ay)", push->imsi, push->content_type,
+            push->info ? push->info : g_variant_new_array(G_VARIANT_TYPE(
+            "{sv}"), NULL, 0), push->body);
+    } else {
+        return g_variant_new("(ss@ay)", push->imsi, push->content_type,
+            push->body);
+    }
+}
+
+static
+void
+push_handler_call(
+    PushHandlerPriv* priv,
+    PushHandlerDelivery* delivery)
+{
+    GError* error = NULL;
+    PushHandler* handler = &priv->pub;
+    PushHandlerDelivery* d;
+    /* Copying the template only references the prebuilt header values */
+    GDBusMessage* msg = g_dbus_message_copy(delivery->next ?
+        priv->batch_template : priv->call_template, &error);
+    for (d = delivery; d; d = d->next) d->attempts++;
+    if (msg) {
+        if (delivery->next) {
+            guint n = 0;
+            GVariant* batch;
+            GVariantBuilder builder;
+            g_variant_builder_init(&builder, G_VARIANT_TYPE(handler->extended ?
+                "a(ssa{sv}ay)" : "a(ssay)"));
+            for (d = delivery; d; d = d->next, n++) {
+                g_variant_builder_add_value(&builder,
+                    push_handler_args(handler, d->push));
+            }
+            batch = g_variant_builder_end(&builder);
+            g_dbus_message_set_body(msg, g_variant_new_tuple(&batch, 1));
+            PA_INFO("Notifying %s (%u)", handler->name, n);
+        } else {
+            g_dbus_message_set_body(msg, push_handler_args(handler,
+                delivery->push));
+            PA_INFO("Notifying %s", handler->name);
+        }
+        priv->in_flight++;
+        push_handler_ref(handler);
+        g_dbus_connection_send_message_with_reply(priv->bus, msg,
+            G_DBUS_SEND_MESSAGE_FLAGS_NONE, priv->timeout, NULL, NULL,
+            push_handler_call_done, delivery);
+        g_object_unref(msg);
+    } else {
+        /* Retrying won't help here */
+        PA_ERR("%s: %s", handler->name, PA_ERRMSG(error));
+        while (delivery) {
+            PushHandlerDelivery* next = delivery->next;
+            push_handler_result(priv, delivery, error);
+            delivery = next;
+        }
+        g_error_free(error);
+    }
+}
+
+static
+int
+push_handler_max_in_flight(
+    PushHandlerPriv* priv)
+{
+    /* Calling a name that's neither owned nor activatable is futile */
+    if (!push_service_available(priv->service)) return 0;
+    switch (priv->breaker) {
+    case PUSH_HANDLER_BREAKER_OPEN:      return 0;
+    case PUSH_HANDLER_BREAKER_HALF_OPEN: return 1;
+    case PUSH_HANDLER_BREAKER_CLOSED:    break;
+    }
+    return priv->pub.max_in_flight;
+}
+
+static
+gboolean
+push_handler_batch_timeout(
+    gpointer data)
+{
+    PushHandlerPriv* priv = data;
+    priv->batch_id = 0;
+    priv->batch_expired = TRUE;
+    push_handler_dispatch(priv);
+    push_handler_unref(&priv->pub);
+    return G_SOURCE_REMOVE;
+}
+
+static
+gboolean
+push_handler_batch_ready(
+    PushHandlerPriv* priv)
+{
+    PushHandler* handler = &priv->pub;
+    if (!handler->batch_method || priv->batch_expired ||
+        push_handler_queue_length(priv) >= (guint)handler->batch_max_size) {
+        return TRUE;
+    }
+    /* Give the burst some time to arrive */
+    if (!priv->batch_id) {
+        push_handler_ref(handler);
+        priv->batch_id = g_timeout_add(handler->batch_window,
+            push_handler_batch_timeout, priv);
+    }
+    return FALSE;
+}
+
+static
+PushHandlerDelivery*
+push_handler_take_batch(
+    PushHandlerPriv* priv)
+{
+    PushHandlerDelivery* first = push_handler_pop(priv);
+    if (priv->pub.batch_method) {
+        PushHandlerDelivery* last = first;
+        int n = 1;
+        while (n < priv->pub.batch_max_size &&
+               (last->next = push_handler_pop(priv)) != NULL) {
+            last = last->next;
+            n++;
+        }
+    }
+    return first;
+}
+
+static
+void
+push_handler_drain_retired(
+    PushHandlerPriv* priv)
+{
+    PushHandler* handler = &priv->pub;
+    PushHandlerDelivery* delivery;
+    if (priv->successor) {
+        /* Same name, so the spool and the dead letters don't care */
+        while ((delivery = push_handler_pop(priv)) != NULL) {
+            push_handler_deliver(priv->successor, delivery->push);
+            push_handler_delivery_free(delivery);
+        }
+    } else if (push_service_known(priv->service) &&
+        !push_service_available(priv->service)) {
+        /* Nothing is going to flush the parked ones anymore */
+        GError* error = g_error_new(G_DBUS_ERROR,
+            G_DBUS_ERROR_SERVICE_UNKNOWN, "%s has been removed",
+            handler->name);
+        while ((delivery = push_handler_pop(priv)) != NULL) {
+            push_handler_result(priv, delivery, error);
+        }
+        g_error_free(error);
+    }
+}
+
+static
+void
+push_handler_dispatch(
+    PushHandlerPriv* priv)
+{
+    if (priv->retired) {
+        push_handler_drain_retired(priv);
+    }
+    while (priv->in_flight < push_handler_max_in_flight(priv) &&
+           push_handler_queue_length(priv) > 0 &&
+           push_handler_batch_ready(priv)) {
+        push_handler_call(priv, push_handler_take_batch(priv));
+    }
+    if (!push_handler_queue_length(priv)) {
+        priv->batch_expired = FALSE;
+    }
+}
+
+/* If the queue is full, either an older notification of the same or
+ * lower class or the new one is shed, and reported to the result
+ * callback as failed */
+void
+push_handler_deliver(
+    PushHandler* handler,
+    PushNotification* push)
+{
+    if (handler && push) {
+        PushHandlerPriv* priv = push_handler_cast(handler);
+        PushHandlerDelivery* delivery = g_new0(PushHandlerDelivery, 1);
+        const gboolean available = push_service_available(priv->service);
+        /* Each delivery keeps its handler alive, even if the handler
+         * is removed from the configuration before it's delivered */
+        delivery->handler = priv;
+        push_handler_ref(handler);
+        delivery->push = push_notification_ref(push);
+        delivery->priority = push_handler_priority(handler,
+            push->content_type);
+        delivery->queued = g_get_monotonic_time();
+        if (!push_handler_make_room(priv, delivery->priority,
+            push_handler_limit(priv, available), available)) {
+            push_handler_shed(priv, delivery, available);
+        } else if (!available) {
+            /* Park it until the service shows up */
+            g_queue_push_tail(&priv->queue[delivery->priority], delivery);
+            PA_DEBUG("%s is not available, %u parked", handler->service,
+                push_handler_queue_length(priv));
+            if (priv->retired) push_handler_drain_retired(priv);
+        } else {
+            g_queue_push_tail(&priv->queue[delivery->priority], delivery);
+            if (priv->in_flight >= push_handler_max_in_flight(priv)) {
+                PA_DEBUG("%s busy, %u queued", handler->name,
+                    push_handler_queue_length(priv));
+            }
+            push_handler_dispatch(priv);
+        }
+    }
+}
+
+void
+push_handler_retire(
+    PushHandler* handler,
+    PushHandler* successor)
+{
+    if (handler) {
+        PushHandlerPriv* priv = push_handler_cast(handler);
+        if (!priv->retired) {
+            const guint queued = push_handler_queue_length(priv);
+            if (queued) {
+                PA_DEBUG("%s: removed with %u queued%s", handler->name,
+                    queued, successor ? ", handing them over" : "");
+            }
+            priv->retired = TRUE;
+            priv->successor = push_handler_ref(successor);
+            /* The last delivery may be holding the last reference */
+            push_handler_ref(handler);
+            push_handler_dispatch(priv);
+            push_handler_unref(handler);
+        }
+    }
+}
+
+PushHandlerBreaker
+push_handler_breaker(
+    PushHandler* handler)
+{
+    return push_handler_cast(handler)->breaker;
+}
+
+guint
+push_handler_queued(
+    PushHandler* handler)
+{
+    return push_handler_queue_length(push_handler_cast(handler));
+}
+
+PushPriority
+push_handler_priority(
+    PushHandler* handler,
+    const char* content_type)
+{
+    gpointer value;
+    if (handler->type_priority && content_type &&
+        g_hash_table_lookup_extended(handler->type_priority, content_type,
+        NULL, &value)) {
+        return GPOINTER_TO_INT(value);
+    }
+    return handler->priority;
+}
+
+guint
+push_handler_queued_priority(
+    PushHandler* handler,
+    PushPriority priority)
+{
+    return push_handler_cast(handler)->queue[priority].length;
+}
+
+guint
+push_handler_shed_count(
+    PushHandler* handler,
+    PushPriority priority)
+{
+    return push_handler_cast(handler)->shed[priority];
+}
+
+static
+void
+push_handler_service_changed(
+    PushService* service,
+    void* data)
+{
+    PushHandlerPriv* priv = data;
+    PushHandler* handler = &priv->pub;
+
+    /* Address the owner directly, if there is one. Otherwise let
+     * the bus daemon resolve (and possibly activate) the service */
+    const char* dest = service->owner ? service->owner : handler->service;
+    if (priv->call_template) g_object_unref(priv->call_template);
+    priv->call_template = g_dbus_message_new_method_call(dest,
+        handler->path, handler->interface, handler->method);
+    if (handler->batch_method) {
+        if (priv->batch_template) g_object_unref(priv->batch_template);
+        priv->batch_template = g_dbus_message_new_method_call(dest,
+            handler->path, handler->interface, handler->batch_method);
+    }
+
+    if (push_service_available(service)) {
+        if (service->owner && priv->breaker == PUSH_HANDLER_BREAKER_OPEN) {
+            /* Don't wait for the probe timer if the service has just
+             * (re)appeared on the bus */
+            push_handler_ref(handler);
+            push_handler_cancel_probe(priv);
+            push_handler_probe(priv);
+        } else {
+            /* Flush whatever has been parked. The last delivery may
+             * be holding the last reference */
+            push_handler_ref(handler);
+            push_handler_dispatch(priv);
+            push_handler_unref(handler);
+        }
+    }
+}
+
+static
+gboolean
+push_handler_parse_match(
+    PushHandler* h,
+    GKeyFile* conf,
+    const char* g)
+{
+    static const char prefix[] = "Header.";
+    gboolean ok = TRUE;
+    gsize i, n = 0;
+    char** keys = g_key_file_get_keys(conf, g, &n, NULL);
+    char* app_id = g_key_file_get_string(conf, g, "ApplicationId", NULL);
+
+    /* Numeric application ids are converted into URIs */
+    if (app_id) {
+        h->app_id = push_wsp_app_id(app_id);
+        if (!h->app_id) {
+            PA_WARN("%s: invalid application id '%s'", h->name, app_id);
+            ok = FALSE;
+        }
+        g_free(app_id);
+    }
+
+    /* Header.<name> keys, all of them have to match */
+    for (i=0; i<n; i++) {
+        if (g_str_has_prefix(keys[i], prefix) && keys[i][sizeof(prefix)-1]) {
+            const char* name = keys[i] + (sizeof(prefix)-1);
+            const char* known = push_wsp_header_name(name);
+            guint count = h->header_names ? g_strv_length(h->header_names) : 0;
+            h->header_names = g_renew(char*, h->header_names, count + 2);
+            h->header_values = g_renew(char*, h->header_values, count + 2);
+            h->header_names[count] = g_strdup(known ? known : name);
+            h->header_values[count] = g_key_file_get_string(conf, g,
+                keys[i], NULL);
+            h->header_names[count + 1] = NULL;
+            h->header_values[count + 1] = NULL;
+        }
+    }
+    g_strfreev(keys);
+    return ok;
+}
+
+static
+gboolean
+push_handler_parse_priority_value(
+    PushHandler* h,
+    const char* value,
+    int* priority)
+{
+    int i;
+    for (i=0; i<PUSH_PRIORITY_COUNT; i++) {
+        if (!g_ascii_strcasecmp(value, push_priority_names[i])) {
+            *priority = i;
+            return TRUE;
+        }
+    }
+    PA_WARN("%s: invalid priority '%s'", h->name, value);
+    return FALSE;
+}
+
+static
+void
+push_handler_parse_priority(
+    PushHandler* h,
+    GKeyFile* conf,
+    const char* g)
+{
+    static const char prefix[] = "Priority.";
+    gsize i, n = 0;
+    char** keys = g_key_file_get_keys(conf, g, &n, NULL);
+    char* value = g_key_file_get_string(conf, g, "Priority", NULL);
+
+    /* Invalid values are ignored, the default is normal */
+    h->priority = PUSH_PRIORITY_NORMAL;
+    if (value) {
+        push_handler_parse_priority_value(h, g_strstrip(value),
+            &h->priority);
+        g_free(value);
+    }
+
+    /* Priority.<content type> keys override it */
+    for (i=0; i<n; i++) {
+        if (g_str_has_prefix(keys[i], prefix) && keys[i][sizeof(prefix)-1]) {
+            int priority;
+            value = g_key_file_get_string(conf, g, keys[i], NULL);
+            if (value && push_handler_parse_priority_value(h,
+                g_strstrip(value), &priority)) {
+                if (!h->type_priority) {
+                    h->type_priority = g_hash_table_new_full(g_str_hash,
+                        g_str_equal, g_free, NULL);
+                }
+                g_hash_table_replace(h->type_priority,
+                    g_strdup(keys[i] + (sizeof(prefix)-1)),
+                    GINT_TO_POINTER(priority));
+            }
+            g_free(value);
+        }
+    }
+    g_strfreev(keys);
+}
+
+static
+gboolean
+push_handler_validate(
+    PushHandler* h)
+{
+    if (!g_dbus_is_name(h->service)) {
+        PA_WARN("%s: invalid service name '%s'", h->name, h->service);
+    } else if (!g_variant_is_object_path(h->path)) {
+        PA_WARN("%s: invalid object path '%s'", h->name, h->path);
+    } else if (!g_dbus_is_interface_name(h->interface)) {
+        PA_WARN("%s: invalid interface name '%s'", h->name, h->interface);
+    } else if (!g_dbus_is_member_name(h->method)) {
+        PA_WARN("%s: invalid method name '%s'", h->name, h->method);
+    } else if (h->batch_method && !g_dbus_is_member_name(h->batch_method)) {
+        PA_WARN("%s: invalid method name '%s'", h->name, h->batch_method);
+    } else {
+        return TRUE;
+    }
+    return FALSE;
+}
+
+static
+int
+push_handler_get_int(
+    GKeyFile* conf,
+    const char* group,
+    const char* key,
+    int defval)
+{
+    GError* error = NULL;
+    int value = g_key_file_get_integer(conf, group, key, &error);
+    if (error) {
+        g_error_free(error);
+        return defval;
+    }
+    return value;
+}
+
+static
+PushHandlerPriv*
+push_handler_alloc(
+    const char* name,
+    const PushAgentConfig* config,
+    PushHandlerResultFunc result,
+    void* user_data)
+{
+    PushHandlerPriv* priv = g_new0(PushHandlerPriv, 1);
+    int i;
+    priv->ref_count = 1;
+    priv->timeout = config->dbus_timeout;
+    priv->result = result;
+    priv->result_data = user_data;
+    for (i=0; i<PUSH_PRIORITY_COUNT; i++) {
+        g_queue_init(&priv->queue[i]);
+        priv->credit[i] = push_handler_weights[i];
+    }
+    priv->pub.name = g_strdup(name);
+    return priv;
+}
+
+static
+PushHandler*
+push_handler_register(
+    PushHandlerPriv* priv,
+    gboolean valid,
+    GDBusConnection* bus)
+{
+    PushHandler* h = &priv->pub;
+    PA_INFO("Registered %s", h->name);
+    if (h->content_type) PA_DEBUG("  ContentType: %s", h->content_type);
+    if (h->app_id) PA_DEBUG("  ApplicationId: %s", h->app_id);
+    if (h->header_names) {
+        guint i;
+        for (i=0; h->header_names[i]; i++) {
+            PA_DEBUG("  %s: %s", h->header_names[i], h->header_values[i]);
+        }
+    }
+    PA_DEBUG("  Interface: %s", h->interface);
+    PA_DEBUG("  Service: %s", h->service);
+    PA_DEBUG("  Method: %s", h->method);
+    PA_DEBUG("  Path: %s", h->path);
+    PA_DEBUG("  MaxInFlight: %d", h->max_in_flight);
+    PA_DEBUG("  RetryMaxAttempts: %d", h->retry_max_attempts);
+    PA_DEBUG("  RetryBackoff: %d..%d ms (+/-%d%%)", h->retry_backoff,
+        h->retry_backoff_max, h->retry_jitter);
+    if (h->breaker_threshold > 0) {
+        PA_DEBUG("  BreakerThreshold: %d", h->breaker_threshold);
+        PA_DEBUG("  BreakerProbeInterval: %d ms", h->breaker_probe_interval);
+    }
+    PA_DEBUG("  MaxParked: %d", h->max_parked);
+    PA_DEBUG("  MaxQueued: %d", h->max_queued);
+    PA_DEBUG("  Priority: %s", push_priority_names[h->priority]);
+    if (h->type_priority) {
+        GHashTableIter it;
+        gpointer key, value;
+        g_hash_table_iter_init(&it, h->type_priority);
+        while (g_hash_table_iter_next(&it, &key, &value)) {
+            PA_DEBUG("  Priority.%s: %s", (char*)key,
+                push_priority_names[GPOINTER_TO_INT(value)]);
+        }
+    }
+    if (h->extended) PA_DEBUG("  ExtendedSignature: true");
+    if (h->batch_method) {
+        PA_DEBUG("  BatchMethod: %s", h->batch_method);
+        PA_DEBUG("  BatchWindow: %d ms", h->batch_window);
+        PA_DEBUG("  BatchMaxSize: %d", h->batch_max_size);
+    }
+
+    if (valid && push_handler_validate(h)) {
+        /* Track the owner of the service name. The service may
+         * already be known, if it's shared with other handlers */
+        priv->bus = g_object_ref(bus);
+        priv->service = push_service_get(bus, h->service);
+        priv->service_changed_id = push_service_add_changed_handler(
+            priv->service, push_handler_service_changed, priv);
+        push_handler_service_changed(priv->service, priv);
+        return h;
+    }
+    push_handler_unref(h);
+    return NULL;
+}
+
+PushHandler*
+push_handler_new(
+    GKeyFile* conf,
+    const char* g,
+    const PushAgentConfig* config,
+    GDBusConnection* bus,
+    PushHandlerResultFunc result,
+    void* user_data)
+{
+    /* These are required */
+    char* interface = g_key_file_get_string(conf, g, "Interface", NULL);
+    char* service = g_key_file_get_string(conf, g, "Service", NULL);
+    char* method = g_key_file_get_string(conf, g, "Method", NULL);
+    char* path = g_key_file_get_string(conf, g, "Path", NULL);
+    if (interface && service && method && path) {
+        PushHandlerPriv* priv = push_handler_alloc(g, config, result,
+            user_data);
+        PushHandler* h = &priv->pub;
+        gboolean valid;
+        h->interface = interface;
+        h->service = service;
+        h->method = method;
+        h->path = path;
+
+        /* Content type is optional, and so are the other criteria */
+        h->content_type = g_key_file_get_string(conf, g, "ContentType", NULL);
+        valid = push_handler_parse_match(h, conf, g);
+
+        /* So is the limit on the number of pending calls */
+        h->max_in_flight = push_handler_get_int(conf, g, "MaxInFlight",
+            config->max_in_flight);
+        if (h->max_in_flight < 1) h->max_in_flight = 1;
+
+        /* And the retry policy */
+        h->retry_max_attempts = push_handler_get_int(conf, g,
+            "RetryMaxAttempts", PUSH_HANDLER_RETRY_MAX_ATTEMPTS);
+        h->retry_backoff = push_handler_get_int(conf, g,
+            "RetryBackoff", PUSH_HANDLER_RETRY_BACKOFF);
+        h->retry_backoff_max = push_handler_get_int(conf, g,
+            "RetryBackoffMax", PUSH_HANDLER_RETRY_BACKOFF_MAX);
+        h->retry_jitter = push_handler_get_int(conf, g,
+            "RetryJitter", PUSH_HANDLER_RETRY_JITTER);
+        if (h->retry_max_attempts < 1) h->retry_max_attempts = 1;
+        if (h->retry_backoff < 0) h->retry_backoff = 0;
+        if (h->retry_backoff_max < h->retry_backoff) {
+            h->retry_backoff_max = h->retry_backoff;
+        }
+        h->retry_jitter = CLAMP(h->retry_jitter, 0, 100);
+
+        /* Zero threshold disables the circuit breaker */
+        h->breaker_threshold = push_handler_get_int(conf, g,
+            "BreakerThreshold", PUSH_HANDLER_BREAKER_THRESHOLD);
+        h->breaker_probe_interval = push_handler_get_int(conf, g,
+            "BreakerProbeInterval", PUSH_HANDLER_BREAKER_PROBE_INTERVAL);
+        if (h->breaker_threshold < 0) h->breaker_threshold = 0;
+        if (h->breaker_probe_interval < 1) h->breaker_probe_interval = 1;
+
+        /* Notifications waiting for the service to appear */
+        h->max_parked = push_handler_get_int(conf, g, "MaxParked",
+            PUSH_HANDLER_MAX_PARKED);
+        if (h->max_parked < 1) h->max_parked = 1;
+
+        /* Notifications waiting to be sent, beyond that they are shed */
+        h->max_queued = push_handler_get_int(conf, g, "MaxQueued",
+            PUSH_HANDLER_MAX_QUEUED);
+        if (h->max_queued < 1) h->max_queued = 1;
+
+        /* Priority class, possibly depending on the content type */
+        push_handler_parse_priority(h, conf, g);
+
+        /* (ssa{sv}ay) instead of (ssay) */
+        h->extended = g_key_file_get_boolean(conf, g, "ExtendedSignature",
+            NULL);
+
+        /* Batching is optional, Method is used for single notifications */
+        h->batch_method = g_key_file_get_string(conf, g, "BatchMethod", NULL);
+        h->batch_window = push_handler_get_int(conf, g, "BatchWindow",
+            PUSH_HANDLER_BATCH_WINDOW);
+        h->batch_max_size = push_handler_get_int(conf, g, "BatchMaxSize",
+            PUSH_HANDLER_BATCH_MAX_SIZE);
+        if (h->batch_window < 0) h->batch_window = 0;
+        if (h->batch_max_size < 1) h->batch_max_size = 1;
+
+        return push_handler_register(priv, valid, bus);
+    } else {
+        g_free(interface);
+        g_free(service);
+        g_free(method);
+        g_free(path);
+        return NULL;
+    }
+}
+
+static
+char**
+push_handler_strv(
+    char** strv)
+{
+    /* Empty arrays are stored as NULL */
+    if (strv && !strv[0]) {
+        g_strfreev(strv);
+        return NULL;
+    }
+    return strv;
+}
+
+PushHandler*
+push_handler_new_from_variant(
+    GVariant* var,
+    const PushAgentConfig* config,
+    GDBusConnection* bus,
+    PushHandlerResultFunc result,
+    void* user_data)
+{
+    if (g_variant_is_of_type(var, G_VARIANT_TYPE(PUSH_HANDLER_VARIANT_TYPE))) {
+        const char* name = NULL;
+        PushHandlerPriv* priv;
+        PushHandler* h;
+        GVariant* types = NULL;
+        GVariantIter it;
+        const char* type;
+        int priority;
+        g_variant_get_child(var, 0, "&s", &name);
+        priv = push_handler_alloc(name, config, result, user_data);
+        h = &priv->pub;
+        g_variant_get(var, "(&sssssmsmsms^as^asiiiiiiiibiiii@a{si})", NULL,
+            &h->interface, &h->service, &h->method, &h->path,
+            &h->content_type, &h->app_id, &h->batch_method,
+            &h->header_names, &h->header_values, &h->max_in_flight,
+            &h->retry_max_attempts, &h->retry_backoff,
+            &h->retry_backoff_max, &h->retry_jitter, &h->breaker_threshold,
+            &h->breaker_probe_interval, &h->max_parked, &h->extended,
+            &h->batch_window, &h->batch_max_size, &h->priority,
+            &h->max_queued, &types);
+        h->priority = CLAMP(h->priority, 0, PUSH_PRIORITY_COUNT - 1);
+        g_variant_iter_init(&it, types);
+        while (g_variant_iter_next(&it, "{&si}", &type, &priority)) {
+            if (!h->type_priority) {
+                h->type_priority = g_hash_table_new_full(g_str_hash,
+                    g_str_equal, g_free, NULL);
+            }
+            g_hash_table_replace(h->type_priority, g_strdup(type),
+                GINT_TO_POINTER(CLAMP(priority, 0, PUSH_PRIORITY_COUNT - 1)));
+        }
+        g_variant_unref(types);
+        h->header_names = push_handler_strv(h->header_names);
+        h->header_values = push_handler_strv(h->header_values);
+        if (!h->header_names != !h->header_values || (h->header_names &&
+            g_strv_length(h->header_names) !=
+            g_strv_length(h->header_values))) {
+            PA_WARN("%s: broken header match", h->name);
+            push_handler_unref(h);
+            return NULL;
+        }
+        return push_handler_register(priv, TRUE, bus);
+    }
+    return NULL;
+}
+
+GVariant*
+push_handler_to_variant(
+    PushHandler* h)
+{
+    static const char* const none[] = { NULL };
+    GVariantBuilder types;
+    g_variant_builder_init(&types, G_VARIANT_TYPE("a{si}"));
+    if (h->type_priority) {
+        GHashTableIter it;
+        gpointer key, value;
+        g_hash_table_iter_init(&it, h->type_priority);
+        while (g_hash_table_iter_next(&it, &key, &value)) {
+            g_variant_builder_add(&types, "{si}", key,
+                GPOINTER_TO_INT(value));
+        }
+    }
+    return g_variant_new("(sssssmsmsms^as^asiiiiiiiibiiiia{si})", h->name,
+        h->interface, h->service, h->method, h->path, h->content_type,
+        h->app_id, h->batch_method, h->header_names ?
+        (const char* const*)h->header_names : none, h->header_values ?
+        (const char* const*)h->header_values : none, h->max_in_flight,
+        h->retry_max_attempts, h->retry_backoff, h->retry_backoff_max,
+        h->retry_jitter, h->breaker_threshold, h->breaker_probe_interval,
+        h->max_parked, h->extended, h->batch_window, h->batch_max_size,
+        h->priority, h->max_queued, &types);
+}
+
+PushHandler*
+push_handler_ref(
+    PushHandler* handler)
+{
+    if (handler) {
+        PushHandlerPriv* priv = push_handler_cast(handler);
+        PA_ASSERT(priv->ref_count > 0);
+        g_atomic_int_inc(&priv->ref_count);
+    }
+    return handler;
+}
+
+void
+push_handler_unref(
+    PushHandler* handler)
+{
+    if (handler) {
+        PushHandlerPriv* priv = push_handler_cast(handler);
+        PA_ASSERT(priv->ref_count > 0);
+        if (g_atomic_int_dec_and_test(&priv->ref_count)) {
+            /* Deliveries hold references, the queue must be empty */
+            PA_ASSERT(!priv->in_flight);
+            PA_ASSERT(!push_handler_queue_length(priv));
+            if (priv->service) {
+                push_service_remove_handler(priv->service,
+                    priv->service_changed_id);
+                push_service_unref(priv->service);
+            }
+            push_handler_unref(priv->successor);
+            if (priv->call_template) g_object_unref(priv->call_template);
+            if (priv->batch_template) g_object_unref(priv->batch_template);
+            if (priv->bus) g_object_unref(priv->bus);
+            g_free(handler->content_type);
+            g_free(handler->app_id);
+            g_strfreev(handler->header_names);
+            g_strfreev(handler->header_values);
+            if (handler->type_priority) {
+                g_hash_table_destroy(handler->type_priority);
+            }
+            g_free(handler->interface);
+            g_free(handler->service);
+            g_free(handler->method);
+            g_free(handler->batch_method);
+            g_free(handler->path);
+            g_free(handler->name);
+            g_free(priv);
+        }
+    }
+}
+
+/*
+ * Local Variables:
+ * mode: C
+ * c-basic-offset: 4
+ * indent-tabs-mode: nil
+ * End:
+ */
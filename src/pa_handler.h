@@ -0,0 +1,195 @@
+/*
+ * Copyright (C) 2013-2014 Jolla Ltd.
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License version 2 as
+ * published by the Free Software Foundation.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ */
+
+#ifndef JOLLA_PUSH_AGENT_HANDLER_H
+#define JOLLA_PUSH_AGENT_HANDLER_H
+
+#include "pa.h"
+#include "pa_notification.h"
+
+#include <gio/gio.h>
+
+/* Delivery priority classes, from the least to the most urgent */
+typedef enum push_priority {
+    PUSH_PRIORITY_LOW,
+    PUSH_PRIORITY_NORMAL,
+    PUSH_PRIORITY_HIGH,
+    PUSH_PRIORITY_COUNT
+} PushPriority;
+
+/* Handler configuration, read-only after the handler has been created */
+typedef struct push_handler {
+    char* name;
+    char* content_type;
+    char* app_id;
+    char** header_names;
+    char** header_values;
+    char* interface;
+    char* service;
+    char* method;
+    char* batch_method;
+    char* path;
+    int max_in_flight;
+    int retry_max_attempts;
+    int retry_backoff;
+    int retry_backoff_max;
+    int retry_jitter;
+    int breaker_threshold;
+    int breaker_probe_interval;
+    int max_parked;
+    gboolean extended;
+    int batch_window;
+    int batch_max_size;
+    int priority;
+    int max_queued;
+    GHashTable* type_priority;
+} PushHandler;
+
+/* Circuit breaker state */
+typedef enum push_handler_breaker {
+    PUSH_HANDLER_BREAKER_CLOSED,    /* Calls go through */
+    PUSH_HANDLER_BREAKER_OPEN,      /* Calls are held in the queue */
+    PUSH_HANDLER_BREAKER_HALF_OPEN  /* Probing the service */
+} PushHandlerBreaker;
+
+/* Notifications which the handler has shed, rather than failed to
+ * deliver, are reported with errors from this domain */
+#define PUSH_HANDLER_ERROR (push_handler_error_quark())
+typedef enum push_handler_error {
+    PUSH_HANDLER_ERROR_OVERLOADED,  /* The queue is full */
+    PUSH_HANDLER_ERROR_UNAVAILABLE  /* Too many parked */
+} PushHandlerError;
+
+GQuark
+push_handler_error_quark(void);
+
+/* Invoked when the handler is done with the notification, either
+ * successfully (error is NULL) or after it has run out of retries
+ * or has been shed */
+typedef void
+(*PushHandlerResultFunc)(
+    PushHandler* handler,
+    PushNotification* push,
+    const GError* error,
+    void* user_data);
+
+PushHandler*
+push_handler_new(
+    GKeyFile* conf,
+    const char* group,
+    const PushAgentConfig* config,
+    GDBusConnection* bus,
+    PushHandlerResultFunc result,
+    void* user_data);
+
+/* Serialized form of the parsed handler configuration: name, interface,
+ * service, method, path, content type, application id, batch method,
+ * header names and values, the numeric parameters in the same order
+ * as they appear in PushHandler, and finally the content type specific
+ * priorities */
+#define PUSH_HANDLER_VARIANT_TYPE "(sssssmsmsmsasasiiiiiiiibiiiia{si})"
+
+PushHandler*
+push_handler_new_from_variant(
+    GVariant* var,
+    const PushAgentConfig* config,
+    GDBusConnection* bus,
+    PushHandlerResultFunc result,
+    void* user_data);
+
+GVariant*
+push_handler_to_variant(
+    PushHandler* handler);
+
+PushHandler*
+push_handler_ref(
+    PushHandler* handler);
+
+void
+push_handler_unref(
+    PushHandler* handler);
+
+/* Queues the notification and returns immediately. Notifications are
+ * sent to the handler in the order they were queued, with no more than
+ * max_in_flight calls pending at any time. Failed calls are retried
+ * after an exponentially growing (and randomized) delay, up to
+ * retry_max_attempts times in total. After breaker_threshold failures
+ * in a row the handler stops making calls until a probe succeeds.
+ * While the service is neither running nor activatable, up to
+ * max_parked notifications are held until it appears. Handlers with
+ * batch_method get notifications queued within batch_window in a single
+ * a(ssay) call, up to batch_max_size at a time. Extended handlers get
+ * (ssa{sv}ay) with decoded headers, modem path etc. in the dictionary.
+ *
+ * Each priority class has its own queue. The queues are served in
+ * a weighted round robin fashion, except that a notification which
+ * has been waiting for too long goes next regardless of its class.
+ * Beyond max_queued (or max_parked) notifications, the oldest one of
+ * the lowest class is shed, unless the new one is of an even lower
+ * class, in which case the new one is shed. */
+void
+push_handler_deliver(
+    PushHandler* handler,
+    PushNotification* push);
+
+/* Called when the handler is no longer in the configuration. What is
+ * queued (or later retried) goes to the successor, i.e. the handler
+ * with the same name in the new configuration. Without a successor,
+ * the queue is still flushed as long as the service is available, but
+ * nothing gets parked anymore, it fails instead. */
+void
+push_handler_retire(
+    PushHandler* handler,
+    PushHandler* successor);
+
+PushHandlerBreaker
+push_handler_breaker(
+    PushHandler* handler);
+
+const char*
+push_handler_breaker_name(
+    PushHandlerBreaker breaker);
+
+/* Number of notifications waiting to be sent */
+guint
+push_handler_queued(
+    PushHandler* handler);
+
+/* Priority of the notification of this content type */
+PushPriority
+push_handler_priority(
+    PushHandler* handler,
+    const char* content_type);
+
+/* Number of notifications of the priority class waiting to be sent */
+guint
+push_handler_queued_priority(
+    PushHandler* handler,
+    PushPriority priority);
+
+/* Number of notifications of the priority class shed so far */
+guint
+push_handler_shed_count(
+    PushHandler* handler,
+    PushPriority priority);
+
+#endif /* JOLLA_PUSH_AGENT_HANDLER_H */
+
+/*
+ * Local Variables:
+ * mode: C
+ * c-basic-offset: 4
+ * indent-tabs-mode: nil
+ * End:
+ */
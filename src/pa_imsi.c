@@ -0,0 +1,112 @@
+/*
+ * Copyright (C) 2013-2014 Jolla Ltd.
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License version 2 as
+ * published by the Free Software Foundation.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ */
+
+#include "pa_imsi.h"
+#include "pa_log.h"
+
+/*
+ * The file looks like this:
+ *
+ * [/ril_0]
+ * 8935806130123456789=244051234567890
+ *
+ * Only one card is remembered per modem.
+ */
+struct push_imsi_cache {
+    char* file;
+    GKeyFile* keys;
+    char* imsi;
+};
+
+PushImsiCache*
+push_imsi_cache_new(
+    const char* file)
+{
+    PushImsiCache* cache = g_new0(PushImsiCache, 1);
+    cache->keys = g_key_file_new();
+    if (file) {
+        GError* error = NULL;
+        cache->file = g_strdup(file);
+        if (!g_key_file_load_from_file(cache->keys, file, 0, &error)) {
+            if (!g_error_matches(error, G_FILE_ERROR, G_FILE_ERROR_NOENT)) {
+                PA_WARN("%s", error->message);
+            }
+            g_error_free(error);
+        }
+    }
+    return cache;
+}
+
+void
+push_imsi_cache_free(
+    PushImsiCache* cache)
+{
+    if (cache) {
+        g_key_file_free(cache->keys);
+        g_free(cache->imsi);
+        g_free(cache->file);
+        g_free(cache);
+    }
+}
+
+const char*
+push_imsi_cache_lookup(
+    PushImsiCache* cache,
+    const char* modem,
+    const char* iccid)
+{
+    if (cache && modem && iccid) {
+        /* The returned string stays valid until the next lookup */
+        g_free(cache->imsi);
+        cache->imsi = g_key_file_get_string(cache->keys, modem, iccid, NULL);
+        return cache->imsi;
+    }
+    return NULL;
+}
+
+void
+push_imsi_cache_store(
+    PushImsiCache* cache,
+    const char* modem,
+    const char* iccid,
+    const char* imsi)
+{
+    if (cache && modem && iccid && imsi) {
+        char* known = g_key_file_get_string(cache->keys, modem, iccid, NULL);
+        if (g_strcmp0(known, imsi)) {
+            /* Forget the previous card */
+            g_key_file_remove_group(cache->keys, modem, NULL);
+            g_key_file_set_string(cache->keys, modem, iccid, imsi);
+            if (cache->file) {
+                GError* error = NULL;
+                gsize len = 0;
+                char* data = g_key_file_to_data(cache->keys, &len, NULL);
+                if (!g_file_set_contents(cache->file, data, len, &error)) {
+                    PA_WARN("%s", error->message);
+                    g_error_free(error);
+                }
+                g_free(data);
+            }
+        }
+        g_free(known);
+    }
+}
+
+/*
+ * Local Variables:
+ * mode: C
+ * c-basic-offset: 4
+ * indent-tabs-mode: nil
+ * End:
+ */
@@ -0,0 +1,59 @@
+/*
+ * Copyright (C) 2013-2014 Jolla Ltd.
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License version 2 as
+ * published by the Free Software Foundation.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ */
+
+#ifndef JOLLA_PUSH_AGENT_IMSI_H
+#define JOLLA_PUSH_AGENT_IMSI_H
+
+#include <glib.h>
+
+/*
+ * Persistent cache of the last known IMSI for each modem, valid as
+ * long as the same SIM card (identified by ICCID) is in there. The
+ * ICCID is readable long before the IMSI is (e.g. before the PIN is
+ * entered), so the IMSI may be known right after a restart.
+ */
+typedef struct push_imsi_cache PushImsiCache;
+
+/* NULL file makes it a memory-only cache */
+PushImsiCache*
+push_imsi_cache_new(
+    const char* file);
+
+void
+push_imsi_cache_free(
+    PushImsiCache* cache);
+
+const char*
+push_imsi_cache_lookup(
+    PushImsiCache* cache,
+    const char* modem,
+    const char* iccid);
+
+/* Writes the file if anything has changed */
+void
+push_imsi_cache_store(
+    PushImsiCache* cache,
+    const char* modem,
+    const char* iccid,
+    const char* imsi);
+
+#endif /* JOLLA_PUSH_AGENT_IMSI_H */
+
+/*
+ * Local Variables:
+ * mode: C
+ * c-basic-offset: 4
+ * indent-tabs-mode: nil
+ * End:
+ */
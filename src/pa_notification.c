@@ -0,0 +1,89 @@
+/*
+ * Copyright (C) 2013-2014 Jolla Ltd.
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License version 2 as
+ * published by the Free Software Foundation.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ */
+
+#include "pa_notification.h"
+#include "pa_log.h"
+
+typedef struct push_notification_priv {
+    PushNotification pub;
+    gint ref_count;
+    GDestroyNotify done;
+    void* done_data;
+} PushNotificationPriv;
+
+static inline PushNotificationPriv*
+push_notification_cast(PushNotification* push)
+    { return (PushNotificationPriv*)push; }
+
+PushNotification*
+push_notification_new(
+    const char* imsi,
+    const char* content_type,
+    GBytes* pdu,
+    gsize offset,
+    gsize len,
+    GDestroyNotify done,
+    void* done_data)
+{
+    PushNotificationPriv* priv = g_new0(PushNotificationPriv, 1);
+    PushNotification* push = &priv->pub;
+    priv->ref_count = 1;
+    priv->done = done;
+    priv->done_data = done_data;
+    push->imsi = g_strdup(imsi);
+    push->content_type = g_strdup(content_type);
+    push->data = g_bytes_new_from_bytes(pdu, offset, len);
+    push->body = g_variant_ref_sink(g_variant_new_from_bytes(
+        G_VARIANT_TYPE_BYTESTRING, push->data, TRUE));
+    return push;
+}
+
+PushNotification*
+push_notification_ref(
+    PushNotification* push)
+{
+    if (push) {
+        PushNotificationPriv* priv = push_notification_cast(push);
+        PA_ASSERT(priv->ref_count > 0);
+        g_atomic_int_inc(&priv->ref_count);
+    }
+    return push;
+}
+
+void
+push_notification_unref(
+    PushNotification* push)
+{
+    if (push) {
+        PushNotificationPriv* priv = push_notification_cast(push);
+        PA_ASSERT(priv->ref_count > 0);
+        if (g_atomic_int_dec_and_test(&priv->ref_count)) {
+            if (priv->done) priv->done(priv->done_data);
+            if (push->info) g_variant_unref(push->info);
+            g_variant_unref(push->body);
+            g_bytes_unref(push->data);
+            g_free(push->content_type);
+            g_free(push->imsi);
+            g_free(priv);
+        }
+    }
+}
+
+/*
+ * Local Variables:
+ * mode: C
+ * c-basic-offset: 4
+ * indent-tabs-mode: nil
+ * End:
+ */
@@ -0,0 +1,61 @@
+/*
+ * Copyright (C) 2013-2014 Jolla Ltd.
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License version 2 as
+ * published by the Free Software Foundation.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ */
+
+#ifndef JOLLA_PUSH_AGENT_NOTIFICATION_H
+#define JOLLA_PUSH_AGENT_NOTIFICATION_H
+
+#include <glib.h>
+
+/* Reference counted push notification, shared by all handlers it's
+ * delivered to. The done callback is invoked when the last reference
+ * is dropped, i.e. when every handler is done with it. The payload
+ * is never copied, both data and body refer to the original PDU.
+ * The optional info dictionary (a{sv}) is built once and passed as is
+ * to the handlers that use the extended call signature. */
+typedef struct push_notification {
+    char* imsi;
+    char* content_type;
+    GBytes* data;
+    GVariant* body;
+    GVariant* info;
+    guint64 spool_id;
+} PushNotification;
+
+PushNotification*
+push_notification_new(
+    const char* imsi,
+    const char* content_type,
+    GBytes* pdu,
+    gsize offset,
+    gsize len,
+    GDestroyNotify done,
+    void* done_data);
+
+PushNotification*
+push_notification_ref(
+    PushNotification* push);
+
+void
+push_notification_unref(
+    PushNotification* push);
+
+#endif /* JOLLA_PUSH_AGENT_NOTIFICATION_H */
+
+/*
+ * Local Variables:
+ * mode: C
+ * c-basic-offset: 4
+ * indent-tabs-mode: nil
+ * End:
+ */
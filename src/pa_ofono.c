@@ -13,42 +13,87 @@
  */
 
 #include "pa.h"
+#include "pa_imsi.h"
 #include "pa_log.h"
 #include "pa_ofono.h"
+#include "pa_ring.h"
 
 #include <string.h>
 
 /* Generated headers */
-#include "org.ofono.Manager.h"
-#include "org.ofono.Modem.h"
-#include "org.ofono.PushNotification.h"
 #include "org.ofono.PushNotificationAgent.h"
-#include "org.ofono.SimManager.h"
 
 #define OFONO_BUS               G_BUS_TYPE_SYSTEM
 
 #define OFONO_SERVICE           "org.ofono"
+#define OFONO_MANAGER_INTERFACE OFONO_SERVICE   ".Manager"
+#define OFONO_MODEM_INTERFACE   OFONO_SERVICE   ".Modem"
 #define OFONO_SIM_INTERFACE     OFONO_SERVICE   ".SimManager"
 #define OFONO_PUSH_INTERFACE    OFONO_SERVICE   ".PushNotification"
 
+#define OFONO_SIGNAL_MODEM_ADDED        "ModemAdded"
+#define OFONO_SIGNAL_MODEM_REMOVED      "ModemRemoved"
+#define OFONO_SIGNAL_PROPERTY_CHANGED   "PropertyChanged"
+
 #define OFONO_MODEM_PROPERTY_INTERFACES         "Interfaces"
 #define OFONO_SIM_PROPERTY_SUBSCRIBER_IDENTITY  "SubscriberIdentity"
+#define OFONO_SIM_PROPERTY_CARD_IDENTIFIER      "CardIdentifier"
+
+/* Limits for notifications waiting for the IMSI, per modem. The age
+ * limit is below the default D-Bus timeout, oFono is waiting for the
+ * reply in the meantime. */
+#define PUSH_MODEM_PENDING_MAX_BYTES    (64*1024)
+#define PUSH_MODEM_PENDING_MAX_AGE      (20) /* seconds */
+
+/* Notifications received by a worker and not yet picked up by the main
+ * thread. Beyond that, they are rejected rather than delaying oFono. */
+#define PUSH_OFONO_WORKER_RING_SIZE     (256)
 
 typedef struct push_ofono PushOfono;
 typedef struct push_modem PushModem;
+typedef struct push_modem_shard PushModemShard;
 
+/*
+ * Nothing here blocks. Every modem goes through its setup steps on its
+ * own, and the SIM and PushNotification steps run in parallel:
+ *
+ *   SimManager.GetProperties --> IMSI
+ *   PushNotification.RegisterAgent --> registered
+ *
+ * Each step has its own GCancellable, so that it can be abandoned
+ * when the interface goes away or the modem is removed.
+ *
+ * There are no proxies. Signals are subscribed to once for all modems
+ * (so the number of match rules doesn't depend on the number of modems)
+ * and dispatched by object path.
+ *
+ * With worker threads, the agent skeleton of each modem is exported
+ * on the worker which owns the modem's shard. The worker receives the
+ * notification and decodes it, then pushes it to its ring, which is
+ * drained by the main thread. The modem state is only ever touched by
+ * the main thread. Without worker threads, there's a single worker
+ * without a thread of its own. Notifications are received and decoded
+ * on the main thread, but still go through the ring, so that replying
+ * to oFono doesn't wait for the routing, and the backlog is bounded
+ * and visible in the same way.
+ */
 struct push_modem {
     char* path;
     PushOfono* ofono;
-
-    OrgOfonoModem* modem_proxy;
-    gulong property_change_signal_id;
+    PushModemShard* shard;
 
     char* imsi;
-    OrgOfonoSimManager* sim_proxy;
-    gulong sim_property_change_signal_id;
+    char* iccid;
+    gboolean sim_present;
+    GCancellable* sim_cancel;
+
+    GQueue pending;
+    gsize pending_bytes;
+    guint pending_timer_id;
 
-    OrgOfonoPushNotification* push_proxy;
+    gboolean push_present;
+    GCancellable* push_cancel;
+    gboolean registered;
     GDBusInterfaceSkeleton* push_agent_skeleton;
     gulong agent_receive_notification_signal_id;
     gulong agent_release_signal_id;
@@ -57,36 +102,389 @@ struct push_modem {
 struct push_ofono {
     PushOfonoWatcher* watcher;
     GHashTable* modems;
-    OrgOfonoManager* manager_proxy;
-    gulong modem_added_signal_id;
-    gulong modem_removed_signal_id;
+    GCancellable* cancel;
+    guint modem_added_id;
+    guint modem_removed_id;
+    guint modem_changed_id;
+    guint sim_changed_id;
+    guint iccid_changed_id;
 };
 
 struct push_ofono_watcher {
     GDBusConnection* bus;
     PushOfono* ofono;
     guint ofono_watch_id;
+    PushNotificationDecodeProc decode_proc;
+    GDestroyNotify decoded_free;
     PushNotificationProc notification_proc;
     PushAgent* agent;
+    PushImsiCache* imsi_cache;
+    gboolean ack_first;
+    GMainContext* context;
+    GPtrArray* workers;
 };
 
+/* Worker thread running its own main context, or the main thread if
+ * thread is NULL. The worker is the only producer and the main thread
+ * is the only consumer of its ring. */
+typedef struct push_ofono_worker {
+    PushOfonoWatcher* watcher;
+    GThread* thread;
+    GMainContext* context;
+    GMainLoop* loop;
+    PushRing* ring;
+    gint dispatch_scheduled;
+    guint dispatch_id;
+} PushOfonoWorker;
+
+/* User data of the skeleton signal handlers, which run on the worker
+ * thread. The modem itself may be gone by then. */
+struct push_modem_shard {
+    gint ref_count;
+    char* path;
+    PushOfonoWatcher* watcher;
+    PushOfonoWorker* worker;
+};
+
+/* Completion of an asynchronous call. The object that has started
+ * the call may be gone by the time it completes. */
+typedef struct push_ofono_call {
+    gpointer target;
+    GCancellable* cancel;
+} PushOfonoCall;
+
+typedef struct push_agent_call {
+    OrgOfonoPushNotificationAgent* proxy;
+    GDBusMethodInvocation* call;
+} PushAgentCall;
+
+/* Notification on its way from the worker to the main thread */
+typedef struct push_modem_received {
+    PushModemShard* shard;
+    GBytes* pdu;
+    GVariant* info;
+    gpointer decoded;
+    PushAgentCall* done;
+} PushModemReceived;
+
+/* Skeleton export, done by the worker thread */
+typedef struct push_modem_export {
+    PushModem* modem;
+    GMutex mutex;
+    GCond cond;
+    gboolean done;
+    gboolean exported;
+    GError* error;
+} PushModemExport;
+
+/* Notification waiting for the IMSI */
+typedef struct push_modem_pending {
+    GBytes* pdu;
+    GVariant* info;
+    gpointer decoded;
+    PushAgentCall* done;
+    gint64 expires;
+} PushModemPending;
+
+static
+void
+push_notification_agent_receive_done(
+    gpointer data)
+{
+    PushAgentCall* call = data;
+    org_ofono_push_notification_agent_complete_receive_notification(
+        call->proxy, call->call);
+    g_object_unref(call->proxy);
+    g_free(call);
+}
+
+static
+void
+push_notification_agent_receive_failed(
+    PushAgentCall* call,
+    const char* message)
+{
+    g_dbus_method_invocation_return_error_literal(call->call, G_DBUS_ERROR,
+        G_DBUS_ERROR_LIMITS_EXCEEDED, message);
+    g_object_unref(call->proxy);
+    g_free(call);
+}
+
+static
+void
+push_modem_pending_free(
+    PushModemPending* pending,
+    PushModem* modem)
+{
+    modem->pending_bytes -= g_bytes_get_size(pending->pdu);
+    if (pending->done) push_notification_agent_receive_done(pending->done);
+    if (pending->decoded) {
+        modem->ofono->watcher->decoded_free(pending->decoded);
+    }
+    g_bytes_unref(pending->pdu);
+    g_variant_unref(pending->info);
+    g_free(pending);
+}
+
+static
+void
+push_modem_pending_drop(
+    PushModem* modem,
+    const char* reason)
+{
+    PushModemPending* pending = g_queue_pop_head(&modem->pending);
+    PA_WARN("%s: dropping notification (%s)", modem->path, reason);
+    push_modem_pending_free(pending, modem);
+}
+
+static
+void
+push_modem_pending_schedule(
+    PushModem* modem);
+
+static
+gboolean
+push_modem_pending_expire(
+    gpointer data)
+{
+    PushModem* modem = data;
+    const gint64 now = g_get_monotonic_time();
+    PushModemPending* pending;
+    modem->pending_timer_id = 0;
+    while ((pending = g_queue_peek_head(&modem->pending)) != NULL &&
+        pending->expires <= now) {
+        push_modem_pending_drop(modem, "no IMSI");
+    }
+    push_modem_pending_schedule(modem);
+    return G_SOURCE_REMOVE;
+}
+
+static
+void
+push_modem_pending_schedule(
+    PushModem* modem)
+{
+    /* The timer is for the oldest notification */
+    PushModemPending* pending = g_queue_peek_head(&modem->pending);
+    if (pending && !modem->pending_timer_id) {
+        const gint64 left = pending->expires - g_get_monotonic_time();
+        modem->pending_timer_id = g_timeout_add(left > 0 ?
+            (guint)((left + 999) / 1000) : 0, push_modem_pending_expire,
+            modem);
+    } else if (!pending && modem->pending_timer_id) {
+        g_source_remove(modem->pending_timer_id);
+        modem->pending_timer_id = 0;
+    }
+}
+
+static
+void
+push_modem_pending_add(
+    PushModem* modem,
+    GBytes* pdu,
+    GVariant* info,
+    gpointer decoded,
+    PushAgentCall* done)
+{
+    PushModemPending* pending = g_new(PushModemPending, 1);
+    const gsize size = g_bytes_get_size(pdu);
+    pending->pdu = g_bytes_ref(pdu);
+    pending->info = g_variant_ref(info);
+    pending->decoded = decoded;
+    pending->done = done;
+    pending->expires = g_get_monotonic_time() +
+        PUSH_MODEM_PENDING_MAX_AGE * G_USEC_PER_SEC;
+
+    /* Make room for the new one, oldest go first */
+    while (modem->pending.length > 0 &&
+        modem->pending_bytes + size > PUSH_MODEM_PENDING_MAX_BYTES) {
+        push_modem_pending_drop(modem, "too much pending");
+    }
+    g_queue_push_tail(&modem->pending, pending);
+    modem->pending_bytes += size;
+    PA_DEBUG("%s: IMSI unknown, %u notification(s) pending", modem->path,
+        modem->pending.length);
+    push_modem_pending_schedule(modem);
+}
+
+static
+void
+push_modem_pending_flush(
+    PushModem* modem)
+{
+    PushOfonoWatcher* watcher = modem->ofono->watcher;
+    PushModemPending* pending;
+    if (modem->pending.length) {
+        PA_DEBUG("%s: delivering %u pending notification(s)", modem->path,
+            modem->pending.length);
+    }
+    while (modem->imsi &&
+        (pending = g_queue_pop_head(&modem->pending)) != NULL) {
+        PushAgentCall* done = pending->done;
+        gpointer decoded = pending->decoded;
+        pending->done = NULL;
+        pending->decoded = NULL;
+        watcher->notification_proc(watcher->agent, modem->imsi, modem->path,
+            pending->pdu, pending->info, decoded, done ?
+            push_notification_agent_receive_done : NULL, done);
+        push_modem_pending_free(pending, modem);
+    }
+    push_modem_pending_schedule(modem);
+}
+
+static
+PushModemShard*
+push_modem_shard_ref(
+    PushModemShard* shard)
+{
+    g_atomic_int_inc(&shard->ref_count);
+    return shard;
+}
+
+static
+void
+push_modem_shard_unref(
+    gpointer data,
+    GClosure* closure)
+{
+    PushModemShard* shard = data;
+    if (g_atomic_int_dec_and_test(&shard->ref_count)) {
+        g_free(shard->path);
+        g_free(shard);
+    }
+}
+
+static
+void
+push_modem_received_free(
+    PushOfonoWatcher* watcher,
+    PushModemReceived* rx)
+{
+    if (rx->done) push_notification_agent_receive_done(rx->done);
+    if (rx->decoded) watcher->decoded_free(rx->decoded);
+    push_modem_shard_unref(rx->shard, NULL);
+    g_bytes_unref(rx->pdu);
+    g_variant_unref(rx->info);
+    g_free(rx);
+}
+
+static
+void
+push_modem_received(
+    PushOfonoWatcher* watcher,
+    PushModemReceived* rx)
+{
+    PushModemShard* shard = rx->shard;
+    PushModem* modem = watcher->ofono ?
+        g_hash_table_lookup(watcher->ofono->modems, shard->path) : NULL;
+    if (modem && modem->shard == shard) {
+        if (modem->imsi) {
+            watcher->notification_proc(watcher->agent, modem->imsi,
+                modem->path, rx->pdu, rx->info, rx->decoded, rx->done ?
+                push_notification_agent_receive_done : NULL, rx->done);
+        } else {
+            push_modem_pending_add(modem, rx->pdu, rx->info, rx->decoded,
+                rx->done);
+        }
+        rx->decoded = NULL;
+        rx->done = NULL;
+    } else {
+        PA_WARN("%s: dropping notification (modem is gone)", shard->path);
+    }
+    push_modem_received_free(watcher, rx);
+}
+
+static
+gboolean
+push_ofono_worker_dispatch(
+    gpointer data)
+{
+    PushOfonoWorker* worker = data;
+    PushModemReceived* rx;
+
+    /* Anything pushed after the flag is cleared schedules another run */
+    g_atomic_int_set(&worker->dispatch_scheduled, FALSE);
+    while ((rx = push_ring_pop(worker->ring)) != NULL) {
+        push_modem_received(worker->watcher, rx);
+    }
+    return G_SOURCE_REMOVE;
+}
+
+static
+gboolean
+push_ofono_worker_post(
+    PushOfonoWorker* worker,
+    PushModemReceived* rx)
+{
+    if (push_ring_push(worker->ring, rx)) {
+        if (g_atomic_int_compare_and_exchange(&worker->dispatch_scheduled,
+            FALSE, TRUE)) {
+            GSource* source = g_idle_source_new();
+            g_source_set_callback(source, push_ofono_worker_dispatch,
+                worker, NULL);
+            worker->dispatch_id = g_source_attach(source,
+                worker->watcher->context);
+            g_source_unref(source);
+        }
+        return TRUE;
+    }
+    return FALSE;
+}
+
 static
 gboolean /* org.ofono.PushNotificationAgent.ReceiveNotification */
 push_notification_agent_receive_notification(
     OrgOfonoPushNotificationAgent* proxy,
     GDBusMethodInvocation* call,
     GVariant* data,
-    GHashTable* dict,
-    PushModem* modem)
+    GVariant* info,
+    PushModemShard* shard)
 {
-    gsize len = 0;
-    const guint8* bytes = g_variant_get_fixed_array(data, &len, 1);
-    PushOfonoWatcher* watcher = modem->ofono->watcher;
-    PA_VERBOSE_("%s %d bytes", modem->path, (int)len);
+    PushOfonoWatcher* watcher = shard->watcher;
+    PA_VERBOSE_("%s %d bytes", shard->path, (int)g_variant_get_size(data));
     if (watcher->notification_proc) {
-        watcher->notification_proc(watcher->agent, modem->imsi, bytes, len);
+        /* This doesn't copy the data, just references the message */
+        GBytes* pdu = g_variant_get_data_as_bytes(data);
+        gpointer decoded = watcher->decode_proc(pdu);
+        if (decoded) {
+            PushModemReceived* rx = g_new(PushModemReceived, 1);
+            PushAgentCall* ack = NULL;
+            rx->shard = push_modem_shard_ref(shard);
+            rx->pdu = pdu;
+            rx->info = g_variant_ref(info);
+            rx->decoded = decoded;
+            /* Reply is sent when all handlers are done with it */
+            rx->done = g_new(PushAgentCall, 1);
+            rx->done->proxy = g_object_ref(proxy);
+            rx->done->call = call;
+            if (watcher->ack_first) {
+                /*
+                 * Nothing down the road blocks, notifications wait in
+                 * the handler queues (and in the spool, if there is one).
+                 * Reply to oFono as soon as it's queued rather than when
+                 * the last handler is done.
+                 */
+                ack = rx->done;
+                rx->done = NULL;
+            }
+            if (push_ofono_worker_post(shard->worker, rx)) {
+                /* The main thread owns rx now */
+                if (ack) push_notification_agent_receive_done(ack);
+            } else {
+                PA_WARN("%s: rejecting notification (queue is full)",
+                    shard->path);
+                push_notification_agent_receive_failed(ack ? ack :
+                    rx->done, "Too many notifications");
+                rx->done = NULL;
+                push_modem_received_free(watcher, rx);
+            }
+            return TRUE;
+        }
+        PA_WARN("%s: invalid push PDU", shard->path);
+        g_bytes_unref(pdu);
     }
-    org_ofono_push_notification_agent_complete_receive_notification(proxy,call);
+    org_ofono_push_notification_agent_complete_receive_notification(
+        proxy, call);
     return TRUE;
 }
 
@@ -95,13 +493,73 @@ gboolean /* org.ofono.PushNotificationAgent.Release */
 push_notification_agent_release(
     OrgOfonoPushNotificationAgent* proxy,
     GDBusMethodInvocation* call,
-    PushModem* modem)
+    PushModemShard* shard)
 {
-    PA_INFO("Release %s", modem->path);
+    PA_INFO("Release %s", shard->path);
     org_ofono_push_notification_agent_complete_release(proxy, call);
     return TRUE;
 }
 
+static
+PushOfonoCall*
+push_ofono_call_new(
+    gpointer target,
+    GCancellable* cancel)
+{
+    PushOfonoCall* call = g_new(PushOfonoCall, 1);
+    call->target = target;
+    call->cancel = g_object_ref(cancel);
+    return call;
+}
+
+/* Returns NULL if the call has been cancelled */
+static
+gpointer
+push_ofono_call_finish(
+    PushOfonoCall* call)
+{
+    gpointer target = g_cancellable_is_cancelled(call->cancel) ? NULL :
+        call->target;
+    g_object_unref(call->cancel);
+    g_free(call);
+    return target;
+}
+
+static
+void
+push_ofono_cancel(
+    GCancellable** cancel)
+{
+    if (*cancel) {
+        g_cancellable_cancel(*cancel);
+        g_object_unref(*cancel);
+        *cancel = NULL;
+    }
+}
+
+static
+void
+push_modem_drop_sim(
+    PushModem* modem)
+{
+    push_ofono_cancel(&modem->sim_cancel);
+    modem->sim_present = FALSE;
+    g_free(modem->iccid);
+    g_free(modem->imsi);
+    modem->iccid = NULL;
+    modem->imsi = NULL;
+}
+
+static
+void
+push_modem_drop_push(
+    PushModem* modem)
+{
+    push_ofono_cancel(&modem->push_cancel);
+    modem->push_present = FALSE;
+    modem->registered = FALSE;
+}
+
 static
 void
 push_modem_free(
@@ -109,89 +567,167 @@ push_modem_free(
 {
     if (modem) {
         PA_VERBOSE_("%p '%s'", modem, modem->path);
-        if (modem->sim_proxy) {
-            g_signal_handler_disconnect(modem->sim_proxy,
-                modem->sim_property_change_signal_id);
-            g_object_unref(modem->sim_proxy);
+        if (modem->registered) {
+            /* Nobody is waiting for the reply. At exit, the watcher
+             * makes sure that the call actually gets sent */
+            g_dbus_connection_call(modem->ofono->watcher->bus,
+                OFONO_SERVICE, modem->path, OFONO_PUSH_INTERFACE,
+                "UnregisterAgent", g_variant_new("(o)", modem->path), NULL,
+                G_DBUS_CALL_FLAGS_NONE, -1, NULL, NULL, NULL);
         }
-        if (modem->push_proxy) {
-            GError* error = NULL;
-            if (!org_ofono_push_notification_call_unregister_agent_sync(
-                modem->push_proxy, modem->path, NULL, &error)) {
-                PA_ERR("%s: %s", modem->path, PA_ERRMSG(error));
-                g_error_free(error);
-            }
-            g_object_unref(modem->push_proxy);
+        push_modem_drop_sim(modem);
+        push_modem_drop_push(modem);
+        while (modem->pending.length) {
+            push_modem_pending_drop(modem, "modem is gone");
         }
+        push_modem_pending_schedule(modem);
 
-        g_signal_handler_disconnect(modem->modem_proxy,
-            modem->property_change_signal_id);
         g_signal_handler_disconnect(modem->push_agent_skeleton,
             modem->agent_receive_notification_signal_id);
-        g_object_unref(modem->modem_proxy);
-
         g_signal_handler_disconnect(modem->push_agent_skeleton,
             modem->agent_release_signal_id);
         g_dbus_interface_skeleton_unexport(modem->push_agent_skeleton);
         g_object_unref(modem->push_agent_skeleton);
+        push_modem_shard_unref(modem->shard, NULL);
 
         g_free(modem->path);
         g_free(modem->imsi);
+        g_free(modem->iccid);
         g_free(modem);
     }
 }
 
 static
-char*
-push_modem_query_imsi(
-    OrgOfonoSimManager* proxy)
+void
+push_modem_set_imsi(
+    PushModem* modem,
+    const char* imsi)
+{
+    g_free(modem->imsi);
+    modem->imsi = g_strdup(imsi);
+    PA_VERBOSE("IMSI: %s", imsi);
+    if (imsi) {
+        push_imsi_cache_store(modem->ofono->watcher->imsi_cache,
+            modem->path, modem->iccid, imsi);
+        push_modem_pending_flush(modem);
+    }
+}
+
+static
+void
+push_modem_set_iccid(
+    PushModem* modem,
+    const char* iccid)
+{
+    if (g_strcmp0(modem->iccid, iccid)) {
+        g_free(modem->iccid);
+        modem->iccid = g_strdup(iccid);
+        PA_VERBOSE("ICCID: %s", iccid);
+        if (!modem->imsi) {
+            /* The SIM may not be ready to tell its IMSI yet */
+            const char* imsi = push_imsi_cache_lookup(
+                modem->ofono->watcher->imsi_cache, modem->path, iccid);
+            if (imsi) {
+                PA_DEBUG("%s: cached IMSI %s", modem->path, imsi);
+                push_modem_set_imsi(modem, imsi);
+            }
+        }
+    }
+}
+
+static
+void /* org.ofono.SimManager.GetProperties */
+push_modem_sim_properties(
+    GObject* bus,
+    GAsyncResult* result,
+    gpointer data)
 {
-    char* imsi = NULL;
     GError* error = NULL;
-    GVariant* properties = NULL;
-    if (org_ofono_sim_manager_call_get_properties_sync(proxy, &properties,
-        NULL, &error)) {
-        GVariant* imsi_value = g_variant_lookup_value(properties,
-            OFONO_SIM_PROPERTY_SUBSCRIBER_IDENTITY, G_VARIANT_TYPE_STRING);
-        if (imsi_value) {
-            imsi = g_strdup(g_variant_get_string(imsi_value, NULL));
-            g_variant_unref(imsi_value);
-            PA_VERBOSE("IMSI: %s", imsi);
+    GVariant* ret = g_dbus_connection_call_finish(G_DBUS_CONNECTION(bus),
+        result, &error);
+    PushModem* modem = push_ofono_call_finish(data);
+    if (ret) {
+        if (modem) {
+            GVariant* properties = g_variant_get_child_value(ret, 0);
+            GVariant* iccid_value = g_variant_lookup_value(properties,
+                OFONO_SIM_PROPERTY_CARD_IDENTIFIER, G_VARIANT_TYPE_STRING);
+            GVariant* imsi_value = g_variant_lookup_value(properties,
+                OFONO_SIM_PROPERTY_SUBSCRIBER_IDENTITY, G_VARIANT_TYPE_STRING);
+            if (iccid_value) {
+                push_modem_set_iccid(modem,
+                    g_variant_get_string(iccid_value, NULL));
+                g_variant_unref(iccid_value);
+            }
+            if (imsi_value) {
+                push_modem_set_imsi(modem,
+                    g_variant_get_string(imsi_value, NULL));
+                g_variant_unref(imsi_value);
+            }
+            g_variant_unref(properties);
         }
-        g_variant_unref(properties);
+        g_variant_unref(ret);
     } else {
-        PA_ERR("%s", PA_ERRMSG(error));
+        if (modem) PA_ERR("%s: %s", modem->path, PA_ERRMSG(error));
         g_error_free(error);
     }
-    return imsi;
 }
 
 static
-void /* org.ofono.SimManager.PropertyChanged */
-push_modem_sim_property_changed(
-    OrgOfonoSimManager* proxy,
-    const char* key,
-    GVariant* value,
+void
+push_modem_query_imsi(
     PushModem* modem)
 {
-    PA_VERBOSE_("%p %s", modem->path, key);
-    PA_ASSERT(proxy == modem->sim_proxy);
-    if (!strcmp(key, OFONO_SIM_PROPERTY_SUBSCRIBER_IDENTITY)) {
-        GVariant* variant = g_variant_get_variant(value);
-        g_free(modem->imsi);
-        modem->imsi = g_strdup(g_variant_get_string(variant, NULL));
-        g_variant_unref(variant);
-        PA_VERBOSE("IMSI: %s", modem->imsi);
+    PA_ASSERT(!modem->sim_cancel);
+    modem->sim_cancel = g_cancellable_new();
+    g_dbus_connection_call(modem->ofono->watcher->bus, OFONO_SERVICE,
+        modem->path, OFONO_SIM_INTERFACE, "GetProperties", NULL,
+        G_VARIANT_TYPE("(a{sv})"), G_DBUS_CALL_FLAGS_NONE, -1,
+        modem->sim_cancel, push_modem_sim_properties,
+        push_ofono_call_new(modem, modem->sim_cancel));
+}
+
+static
+void /* org.ofono.PushNotification.RegisterAgent */
+push_modem_agent_registered(
+    GObject* bus,
+    GAsyncResult* result,
+    gpointer data)
+{
+    GError* error = NULL;
+    GVariant* ret = g_dbus_connection_call_finish(G_DBUS_CONNECTION(bus),
+        result, &error);
+    PushModem* modem = push_ofono_call_finish(data);
+    if (ret) {
+        if (modem) {
+            PA_DEBUG("Registered with %s", modem->path);
+            modem->registered = TRUE;
+        }
+        g_variant_unref(ret);
+    } else {
+        if (modem) PA_ERR("%s: %s", modem->path, PA_ERRMSG(error));
+        g_error_free(error);
     }
 }
 
+static
+void
+push_modem_register_agent(
+    PushModem* modem)
+{
+    modem->push_cancel = g_cancellable_new();
+    g_dbus_connection_call(modem->ofono->watcher->bus, OFONO_SERVICE,
+        modem->path, OFONO_PUSH_INTERFACE, "RegisterAgent",
+        g_variant_new("(o)", modem->path), NULL, G_DBUS_CALL_FLAGS_NONE,
+        -1, modem->push_cancel, push_modem_agent_registered,
+        push_ofono_call_new(modem, modem->push_cancel));
+}
+
 static
 void
 push_modem_scan_interfaces(
     PushModem* modem,
     GVariant* ifs)
 {
-    GError* error = NULL;
     gboolean sim_interface = FALSE;
     gboolean push_interface = FALSE;
 
@@ -216,82 +752,90 @@ push_modem_scan_interfaces(
         }
     }
 
+    /*
+     * Interfaces change many times in a row while the modem is being
+     * powered up, mostly because of the interfaces we don't care about.
+     * Only the actual appearance and disappearance of these two matter.
+     * In between, the IMSI is kept up to date by PropertyChanged.
+     */
+
     /* org.ofono.SimManager */
-    if (modem->imsi) {
-        g_free(modem->imsi);
-        modem->imsi = NULL;
-    }
     if (sim_interface) {
-        if (!modem->sim_proxy) {
-            modem->sim_proxy = org_ofono_sim_manager_proxy_new_sync(
-                modem->ofono->watcher->bus, G_DBUS_PROXY_FLAGS_NONE,
-                OFONO_SERVICE, modem->path, NULL, &error);
-            if (modem->sim_proxy) {
-                /* Subscribe for PropertyChanged notifications */
-                modem->sim_property_change_signal_id = g_signal_connect(
-                    modem->sim_proxy, "property-changed",
-                    G_CALLBACK(push_modem_sim_property_changed),
-                    modem);
-            } else {
-                PA_ERR("%s: %s", modem->path, PA_ERRMSG(error));
-                g_error_free(error);
-                error = NULL;
-            }
+        if (!modem->sim_present) {
+            PA_DEBUG("%s: %s appeared", modem->path, OFONO_SIM_INTERFACE);
+            modem->sim_present = TRUE;
+            push_modem_query_imsi(modem);
         }
-        if (modem->sim_proxy) {
-            modem->imsi = push_modem_query_imsi(modem->sim_proxy);
-        }
-    } else if (modem->sim_proxy) {
-        g_signal_handler_disconnect(modem->sim_proxy,
-            modem->sim_property_change_signal_id);
-        g_object_unref(modem->sim_proxy);
-        modem->sim_proxy = NULL;
+    } else if (modem->sim_present) {
+        PA_DEBUG("%s: %s disappeared", modem->path, OFONO_SIM_INTERFACE);
+        push_modem_drop_sim(modem);
     }
 
     /* org.ofono.PushNotification */
     if (push_interface) {
-        if (!modem->push_proxy) {
-            modem->push_proxy = org_ofono_push_notification_proxy_new_sync(
-                modem->ofono->watcher->bus, G_DBUS_PROXY_FLAGS_NONE,
-                OFONO_SERVICE, modem->path, NULL, &error);
-            if (modem->push_proxy) {
-                if (org_ofono_push_notification_call_register_agent_sync(
-                    modem->push_proxy, modem->path, NULL, &error)) {
-                    PA_DEBUG("Registered with %s", modem->path);
-                } else {
-                    PA_ERR("%s: %s", modem->path, PA_ERRMSG(error));
-                    g_error_free(error);
-                    error = NULL;
-                    g_object_unref(modem->push_proxy);
-                    modem->push_proxy = NULL;
-                }
-            } else {
-                PA_ERR("%s: %s", modem->path, PA_ERRMSG(error));
-                g_error_free(error);
-                error = NULL;
-            }
+        if (!modem->push_present) {
+            PA_DEBUG("%s: %s appeared", modem->path, OFONO_PUSH_INTERFACE);
+            modem->push_present = TRUE;
+            push_modem_register_agent(modem);
         }
-    } else if (modem->push_proxy) {
-        g_object_unref(modem->push_proxy);
-        modem->push_proxy = NULL;
+    } else if (modem->push_present) {
+        PA_DEBUG("%s: %s disappeared", modem->path, OFONO_PUSH_INTERFACE);
+        push_modem_drop_push(modem);
     }
 }
 
 static
-void /* org.ofono.Modem.PropertyChanged */
-push_modem_property_changed(
-    OrgOfonoModem* proxy,
-    const char* key,
-    GVariant* variant,
-    PushModem* modem)
+PushModemShard*
+push_modem_shard_new(
+    PushOfonoWatcher* watcher,
+    const char* path)
 {
-    PA_VERBOSE_("%s %s", modem->path, key);
-    PA_ASSERT(proxy == modem->modem_proxy);
-    if (!strcmp(key, OFONO_MODEM_PROPERTY_INTERFACES)) {
-        GVariant* value = g_variant_get_variant(variant);
-        push_modem_scan_interfaces(modem, value);
-        g_variant_unref(value);
+    PushModemShard* shard = g_new0(PushModemShard, 1);
+    shard->ref_count = 1;
+    shard->path = g_strdup(path);
+    shard->watcher = watcher;
+    /* The same modem always ends up on the same worker */
+    shard->worker = watcher->workers->pdata[g_str_hash(path) %
+        watcher->workers->len];
+    return shard;
+}
+
+/* The skeleton dispatches incoming calls to the thread default context
+ * at the time it's created and exported, so that has to happen on the
+ * thread of the worker which owns the modem's shard. */
+static
+gboolean
+push_modem_export(
+    gpointer data)
+{
+    PushModemExport* job = data;
+    PushModem* modem = job->modem;
+    PushModemShard* shard = modem->shard;
+    GDBusInterfaceSkeleton* skeleton = G_DBUS_INTERFACE_SKELETON(
+        org_ofono_push_notification_agent_skeleton_new());
+
+    /* Connect the signals before the calls start to arrive */
+    modem->push_agent_skeleton = skeleton;
+    modem->agent_receive_notification_signal_id = g_signal_connect_data(
+        skeleton, "handle-receive-notification",
+        G_CALLBACK(push_notification_agent_receive_notification),
+        push_modem_shard_ref(shard), push_modem_shard_unref, 0);
+    modem->agent_release_signal_id = g_signal_connect_data(
+        skeleton, "handle-release",
+        G_CALLBACK(push_notification_agent_release),
+        push_modem_shard_ref(shard), push_modem_shard_unref, 0);
+
+    /* Make interface available, that doesn't involve any round trips */
+    job->exported = g_dbus_interface_skeleton_export(skeleton,
+        modem->ofono->watcher->bus, shard->path, &job->error);
+
+    if (shard->worker->thread) {
+        g_mutex_lock(&job->mutex);
+        job->done = TRUE;
+        g_cond_signal(&job->cond);
+        g_mutex_unlock(&job->mutex);
     }
+    return G_SOURCE_REMOVE;
 }
 
 static
@@ -301,94 +845,163 @@ push_modem_new(
     const char* path,
     GVariant* properties)
 {
-    GError* error = NULL;
     PushModem* modem = g_new0(PushModem, 1);
+    PushModemShard* shard = push_modem_shard_new(ofono->watcher, path);
+    PushModemExport job;
     PA_DEBUG("Modem path %s", path);
     modem->ofono = ofono;
-    modem->modem_proxy = org_ofono_modem_proxy_new_sync(
-        modem->ofono->watcher->bus, G_DBUS_PROXY_FLAGS_NONE,
-        OFONO_SERVICE, path, NULL, &error);
-    if (modem->modem_proxy) {
-        modem->push_agent_skeleton = G_DBUS_INTERFACE_SKELETON(
-            org_ofono_push_notification_agent_skeleton_new());
-
-        /* Make interface available */
-        if (g_dbus_interface_skeleton_export(modem->push_agent_skeleton,
-            modem->ofono->watcher->bus, path, &error)) {
-
-            GVariant* interfaces = g_variant_lookup_value(properties,
-                OFONO_MODEM_PROPERTY_INTERFACES, G_VARIANT_TYPE_STRING_ARRAY);
-
-            modem->path = g_strdup(path);
-
-            /* Check what we currently have */
-            push_modem_scan_interfaces(modem, interfaces);
-            g_variant_unref(interfaces);
-
-            /* Register to receive PropertyChanged notifications */
-            modem->property_change_signal_id = g_signal_connect(
-                modem->modem_proxy, "property-changed",
-                G_CALLBACK(push_modem_property_changed), modem);
-
-            /* Connect the signals */
-            modem->agent_receive_notification_signal_id = g_signal_connect(
-                modem->push_agent_skeleton, "handle-receive-notification",
-                G_CALLBACK(push_notification_agent_receive_notification),
-                modem);
-
-            modem->agent_release_signal_id = g_signal_connect(
-                modem->push_agent_skeleton, "handle-release",
-                G_CALLBACK(push_notification_agent_release),
-                modem);
-
-            return modem;
-        } else {
-            PA_ERR("%s: %s", path, PA_ERRMSG(error));
-            g_error_free(error);
-        }
-        g_object_unref(modem->modem_proxy);
+    modem->shard = shard;
+
+    memset(&job, 0, sizeof(job));
+    job.modem = modem;
+    if (shard->worker->thread) {
+        /* The worker owns its context, let it do the job and wait */
+        g_mutex_init(&job.mutex);
+        g_cond_init(&job.cond);
+        g_main_context_invoke(shard->worker->context, push_modem_export,
+            &job);
+        g_mutex_lock(&job.mutex);
+        while (!job.done) g_cond_wait(&job.cond, &job.mutex);
+        g_mutex_unlock(&job.mutex);
+        g_cond_clear(&job.cond);
+        g_mutex_clear(&job.mutex);
     } else {
-        PA_ERR("%s: %s", path, PA_ERRMSG(error));
-        g_error_free(error);
+        push_modem_export(&job);
+    }
+    if (job.exported) {
+        GVariant* interfaces = g_variant_lookup_value(properties,
+            OFONO_MODEM_PROPERTY_INTERFACES, G_VARIANT_TYPE_STRING_ARRAY);
+
+        modem->path = g_strdup(path);
+
+        /* Start all the setup steps at once */
+        push_modem_scan_interfaces(modem, interfaces);
+        if (interfaces) g_variant_unref(interfaces);
+        return modem;
+    } else {
+        PA_ERR("%s: %s", path, PA_ERRMSG(job.error));
+        g_error_free(job.error);
     }
+    g_object_unref(modem->push_agent_skeleton);
+    push_modem_shard_unref(shard, NULL);
     g_free(modem);
     return NULL;
 }
 
+static
+void
+push_ofono_add_modem(
+    PushOfono* ofono,
+    const char* path,
+    GVariant* properties)
+{
+    PushModem* modem = push_modem_new(ofono, path, properties);
+    if (modem) g_hash_table_replace(ofono->modems, modem->path, modem);
+}
+
 static
 void /* org.ofono.Manager.ModemAdded */
 push_ofono_modem_added(
-    OrgOfonoManager* proxy,
+    GDBusConnection* bus,
+    const char* sender,
     const char* path,
-    GVariant* properties,
-    PushOfono* ofono)
+    const char* iface,
+    const char* name,
+    GVariant* args,
+    gpointer data)
 {
-    PushModem* modem;
-    PA_VERBOSE_("%s", path);
-    PA_ASSERT(proxy == ofono->manager_proxy);
-    g_hash_table_remove(ofono->modems, path);
-    modem = push_modem_new(ofono, path, properties);
-    if (modem) g_hash_table_replace(ofono->modems, modem->path, modem);
+    PushOfono* ofono = data;
+    if (g_variant_is_of_type(args, G_VARIANT_TYPE("(oa{sv})"))) {
+        const char* modem_path = NULL;
+        GVariant* properties = NULL;
+        g_variant_get(args, "(&o@a{sv})", &modem_path, &properties);
+        PA_VERBOSE_("%s", modem_path);
+        g_hash_table_remove(ofono->modems, modem_path);
+        push_ofono_add_modem(ofono, modem_path, properties);
+        g_variant_unref(properties);
+    }
 }
 
 static
 void /* org.ofono.Manager.ModemRemoved */
 push_ofono_modem_removed(
-    OrgOfonoManager* proxy,
+    GDBusConnection* bus,
+    const char* sender,
     const char* path,
-    PushOfono* ofono)
+    const char* iface,
+    const char* name,
+    GVariant* args,
+    gpointer data)
 {
-    PA_VERBOSE_("%s", path);
-    PA_ASSERT(proxy == ofono->manager_proxy);
-    PushModem* modem = g_hash_table_lookup(ofono->modems, path);
-    PA_ASSERT(modem);
-    if (modem) {
-        if (modem->push_proxy) {
+    PushOfono* ofono = data;
+    if (g_variant_is_of_type(args, G_VARIANT_TYPE("(o)"))) {
+        const char* modem_path = NULL;
+        PushModem* modem;
+        g_variant_get(args, "(&o)", &modem_path);
+        PA_VERBOSE_("%s", modem_path);
+        modem = g_hash_table_lookup(ofono->modems, modem_path);
+        if (modem) {
             /* So that push_modem_free does't try to unregister */
-            g_object_unref(modem->push_proxy);
-            modem->push_proxy = NULL;
+            modem->registered = FALSE;
+            g_hash_table_remove(ofono->modems, modem_path);
+        }
+    }
+}
+
+static
+void /* org.ofono.Modem.PropertyChanged */
+push_ofono_modem_changed(
+    GDBusConnection* bus,
+    const char* sender,
+    const char* path,
+    const char* iface,
+    const char* name,
+    GVariant* args,
+    gpointer data)
+{
+    PushOfono* ofono = data;
+    PushModem* modem = g_hash_table_lookup(ofono->modems, path);
+    if (modem && g_variant_is_of_type(args, G_VARIANT_TYPE("(sv)"))) {
+        const char* key = NULL;
+        GVariant* value = NULL;
+        g_variant_get(args, "(&sv)", &key, &value);
+        PA_VERBOSE_("%s %s", path, key);
+        if (!strcmp(key, OFONO_MODEM_PROPERTY_INTERFACES) &&
+            g_variant_is_of_type(value, G_VARIANT_TYPE_STRING_ARRAY)) {
+            push_modem_scan_interfaces(modem, value);
         }
-        g_hash_table_remove(ofono->modems, path);
+        g_variant_unref(value);
+    }
+}
+
+static
+void /* org.ofono.SimManager.PropertyChanged */
+push_ofono_sim_changed(
+    GDBusConnection* bus,
+    const char* sender,
+    const char* path,
+    const char* iface,
+    const char* name,
+    GVariant* args,
+    gpointer data)
+{
+    PushOfono* ofono = data;
+    PushModem* modem = g_hash_table_lookup(ofono->modems, path);
+    if (modem && modem->sim_present &&
+        g_variant_is_of_type(args, G_VARIANT_TYPE("(sv)"))) {
+        const char* key = NULL;
+        GVariant* value = NULL;
+        g_variant_get(args, "(&sv)", &key, &value);
+        PA_VERBOSE_("%s %s", path, key);
+        if (g_variant_is_of_type(value, G_VARIANT_TYPE_STRING)) {
+            const char* str = g_variant_get_string(value, NULL);
+            if (!strcmp(key, OFONO_SIM_PROPERTY_SUBSCRIBER_IDENTITY)) {
+                push_modem_set_imsi(modem, str);
+            } else if (!strcmp(key, OFONO_SIM_PROPERTY_CARD_IDENTIFIER)) {
+                push_modem_set_iccid(modem, str);
+            }
+        }
+        g_variant_unref(value);
     }
 }
 
@@ -401,68 +1014,94 @@ push_ofono_modem_free_proc(
 }
 
 static
-PushOfono*
-push_ofono_new(
-    PushOfonoWatcher* watcher)
+void /* org.ofono.Manager.GetModems */
+push_ofono_modems_ready(
+    GObject* bus,
+    GAsyncResult* result,
+    gpointer data)
 {
     GError* error = NULL;
-    PushOfono* ofono = g_new0(PushOfono, 1);
-    ofono->watcher = watcher;
-    ofono->manager_proxy = org_ofono_manager_proxy_new_sync(watcher->bus,
-        G_DBUS_PROXY_FLAGS_NONE, OFONO_SERVICE, "/", NULL, &error);
-    if (ofono->manager_proxy) {
-
-        /* Fetch current list of modems */
-        GVariant* modems = NULL;
-        if (org_ofono_manager_call_get_modems_sync(ofono->manager_proxy,
-            &modems, NULL, &error)) {
-
+    GVariant* ret = g_dbus_connection_call_finish(G_DBUS_CONNECTION(bus),
+        result, &error);
+    PushOfono* ofono = push_ofono_call_finish(data);
+    if (ret) {
+        if (ofono) {
+            GVariant* modems = g_variant_get_child_value(ret, 0);
             GVariantIter iter;
             GVariant* child;
-
-            ofono->modems = g_hash_table_new_full(g_str_hash, g_str_equal,
-                NULL, push_ofono_modem_free_proc);
-
             PA_DEBUG("%d modem(s) found", (int)g_variant_n_children(modems));
             for (g_variant_iter_init(&iter, modems);
                  (child = g_variant_iter_next_value(&iter)) != NULL;
                  g_variant_unref(child)) {
-
-                PushModem* modem;
                 const char* path = NULL;
                 GVariant* properties = NULL;
-
                 g_variant_get(child, "(&o@a{sv})", &path, &properties);
-                PA_ASSERT(path);
-                PA_ASSERT(properties);
-
-                modem = push_modem_new(ofono, path, properties);
-                g_hash_table_replace(ofono->modems, modem->path, modem);
+                /* ModemAdded may have arrived first */
+                if (!g_hash_table_contains(ofono->modems, path)) {
+                    push_ofono_add_modem(ofono, path, properties);
+                }
                 g_variant_unref(properties);
             }
-
-            /* Subscribe for ModemAdded/Removed notifications */
-            ofono->modem_added_signal_id = g_signal_connect(
-                ofono->manager_proxy, "modem-added",
-                G_CALLBACK(push_ofono_modem_added), ofono);
-            ofono->modem_removed_signal_id = g_signal_connect(
-                ofono->manager_proxy, "modem-removed",
-                G_CALLBACK(push_ofono_modem_removed), ofono);
-
             g_variant_unref(modems);
-            return ofono;
-        } else {
-            PA_ERR("%s", PA_ERRMSG(error));
-            g_error_free(error);
         }
-
-        g_object_unref(ofono->manager_proxy);
+        g_variant_unref(ret);
     } else {
-        PA_ERR("%s", PA_ERRMSG(error));
+        if (ofono) PA_ERR("%s", PA_ERRMSG(error));
         g_error_free(error);
     }
-    g_free(ofono);
-    return NULL;
+}
+
+static
+guint
+push_ofono_subscribe(
+    PushOfono* ofono,
+    const char* iface,
+    const char* signal,
+    const char* path,
+    const char* arg0,
+    GDBusSignalCallback callback)
+{
+    return g_dbus_connection_signal_subscribe(ofono->watcher->bus,
+        OFONO_SERVICE, iface, signal, path, arg0,
+        G_DBUS_SIGNAL_FLAGS_NONE, callback, ofono, NULL);
+}
+
+static
+PushOfono*
+push_ofono_new(
+    PushOfonoWatcher* watcher)
+{
+    PushOfono* ofono = g_new0(PushOfono, 1);
+    ofono->watcher = watcher;
+    ofono->modems = g_hash_table_new_full(g_str_hash, g_str_equal,
+        NULL, push_ofono_modem_free_proc);
+    ofono->cancel = g_cancellable_new();
+
+    /* Subscribe for the signals first, so that nothing falls between
+     * the cracks. The same subscriptions serve all the modems. */
+    ofono->modem_added_id = push_ofono_subscribe(ofono,
+        OFONO_MANAGER_INTERFACE, OFONO_SIGNAL_MODEM_ADDED, "/", NULL,
+        push_ofono_modem_added);
+    ofono->modem_removed_id = push_ofono_subscribe(ofono,
+        OFONO_MANAGER_INTERFACE, OFONO_SIGNAL_MODEM_REMOVED, "/", NULL,
+        push_ofono_modem_removed);
+    ofono->modem_changed_id = push_ofono_subscribe(ofono,
+        OFONO_MODEM_INTERFACE, OFONO_SIGNAL_PROPERTY_CHANGED, NULL,
+        OFONO_MODEM_PROPERTY_INTERFACES, push_ofono_modem_changed);
+    ofono->sim_changed_id = push_ofono_subscribe(ofono,
+        OFONO_SIM_INTERFACE, OFONO_SIGNAL_PROPERTY_CHANGED, NULL,
+        OFONO_SIM_PROPERTY_SUBSCRIBER_IDENTITY, push_ofono_sim_changed);
+    ofono->iccid_changed_id = push_ofono_subscribe(ofono,
+        OFONO_SIM_INTERFACE, OFONO_SIGNAL_PROPERTY_CHANGED, NULL,
+        OFONO_SIM_PROPERTY_CARD_IDENTIFIER, push_ofono_sim_changed);
+
+    /* Fetch current list of modems */
+    g_dbus_connection_call(watcher->bus, OFONO_SERVICE, "/",
+        OFONO_MANAGER_INTERFACE, "GetModems", NULL,
+        G_VARIANT_TYPE("(a(oa{sv}))"), G_DBUS_CALL_FLAGS_NONE, -1,
+        ofono->cancel, push_ofono_modems_ready,
+        push_ofono_call_new(ofono, ofono->cancel));
+    return ofono;
 }
 
 static
@@ -471,12 +1110,14 @@ push_ofono_free(
     PushOfono* ofono)
 {
     if (ofono) {
+        GDBusConnection* bus = ofono->watcher->bus;
+        push_ofono_cancel(&ofono->cancel);
+        g_dbus_connection_signal_unsubscribe(bus, ofono->modem_added_id);
+        g_dbus_connection_signal_unsubscribe(bus, ofono->modem_removed_id);
+        g_dbus_connection_signal_unsubscribe(bus, ofono->modem_changed_id);
+        g_dbus_connection_signal_unsubscribe(bus, ofono->sim_changed_id);
+        g_dbus_connection_signal_unsubscribe(bus, ofono->iccid_changed_id);
         g_hash_table_destroy(ofono->modems);
-        g_signal_handler_disconnect(ofono->manager_proxy,
-            ofono->modem_added_signal_id);
-        g_signal_handler_disconnect(ofono->manager_proxy,
-            ofono->modem_removed_signal_id);
-        g_object_unref(ofono->manager_proxy);
         g_free(ofono);
     }
 }
@@ -489,11 +1130,8 @@ push_ofono_gone(
     gpointer user_data)
 {
     PushModem* modem = value;
-    if (modem->push_proxy) {
-        /* So that push_modem_free does't try to unregister */
-        g_object_unref(modem->push_proxy);
-        modem->push_proxy = NULL;
-    }
+    /* So that push_modem_free does't try to unregister */
+    modem->registered = FALSE;
 }
 
 static
@@ -527,8 +1165,81 @@ push_ofono_appeared(
     watcher->ofono = push_ofono_new(watcher);
 }
 
+static
+gpointer
+push_ofono_worker_run(
+    gpointer data)
+{
+    PushOfonoWorker* worker = data;
+    g_main_context_push_thread_default(worker->context);
+    g_main_loop_run(worker->loop);
+    g_main_context_pop_thread_default(worker->context);
+    return NULL;
+}
+
+static
+gboolean
+push_ofono_worker_quit(
+    gpointer loop)
+{
+    g_main_loop_quit(loop);
+    return G_SOURCE_REMOVE;
+}
+
+/* Negative index means no thread, everything runs on the main thread */
+static
+PushOfonoWorker*
+push_ofono_worker_new(
+    PushOfonoWatcher* watcher,
+    int index)
+{
+    PushOfonoWorker* worker = g_new0(PushOfonoWorker, 1);
+    worker->watcher = watcher;
+    worker->ring = push_ring_new(PUSH_OFONO_WORKER_RING_SIZE);
+    if (index >= 0) {
+        char* name = g_strdup_printf("push-worker-%d", index);
+        worker->context = g_main_context_new();
+        worker->loop = g_main_loop_new(worker->context, FALSE);
+        worker->thread = g_thread_new(name, push_ofono_worker_run, worker);
+        g_free(name);
+    }
+    return worker;
+}
+
+static
+void
+push_ofono_worker_free(
+    gpointer data)
+{
+    PushOfonoWorker* worker = data;
+    if (worker->thread) {
+        /* Quitting from within the loop works even if it hasn't started
+         * running yet */
+        g_main_context_invoke(worker->context, push_ofono_worker_quit,
+            worker->loop);
+        g_thread_join(worker->thread);
+    }
+
+    /* Nothing can get pushed anymore. Whatever is left gets dropped
+     * (and replied to), as the modems are already gone. */
+    if (worker->dispatch_scheduled) {
+        g_source_destroy(g_main_context_find_source_by_id(
+            worker->watcher->context, worker->dispatch_id));
+    }
+    push_ofono_worker_dispatch(worker);
+    push_ring_free(worker->ring);
+    if (worker->thread) {
+        g_main_loop_unref(worker->loop);
+        g_main_context_unref(worker->context);
+    }
+    g_free(worker);
+}
+
 PushOfonoWatcher*
 push_ofono_watcher_new(
+    const PushAgentConfig* config,
+    PushNotificationDecodeProc decode,
+    GDestroyNotify decoded_free,
     PushNotificationProc proc,
     PushAgent* agent)
 {
@@ -536,12 +1247,30 @@ push_ofono_watcher_new(
     PushOfonoWatcher* watcher = g_new0(PushOfonoWatcher, 1);
     watcher->bus = g_bus_get_sync(OFONO_BUS, NULL, &error);
     if (watcher->bus) {
+        int i;
+        watcher->imsi_cache = push_imsi_cache_new(config->imsi_cache);
+        watcher->context = g_main_context_ref_thread_default();
+        watcher->ack_first = config->ack_first;
+        watcher->workers = g_ptr_array_new_with_free_func(
+            push_ofono_worker_free);
+        for (i=0; i<config->decode_workers; i++) {
+            g_ptr_array_add(watcher->workers,
+                push_ofono_worker_new(watcher, i));
+        }
+        if (watcher->workers->len > 0) {
+            PA_DEBUG("%u decode worker(s)", watcher->workers->len);
+        } else {
+            g_ptr_array_add(watcher->workers,
+                push_ofono_worker_new(watcher, -1));
+        }
+        watcher->decode_proc = decode;
+        watcher->decoded_free = decoded_free;
+        watcher->notification_proc = proc;
+        watcher->agent = agent;
         watcher->ofono_watch_id = g_bus_watch_name_on_connection(watcher->bus,
             OFONO_SERVICE, G_BUS_NAME_WATCHER_FLAGS_NONE, push_ofono_appeared,
             push_ofono_vanished, watcher, NULL);
         PA_ASSERT(watcher->ofono_watch_id);
-        watcher->notification_proc = proc;
-        watcher->agent = agent;
         return watcher;
     } else {
         PA_ERR("%s", PA_ERRMSG(error));
@@ -551,6 +1280,30 @@ push_ofono_watcher_new(
     return NULL;
 }
 
+GVariant*
+push_ofono_watcher_queues(
+    PushOfonoWatcher* watcher)
+{
+    guint i;
+    GVariantBuilder builder;
+    g_variant_builder_init(&builder, G_VARIANT_TYPE("a(uuuu)"));
+    for (i=0; watcher && i<watcher->workers->len; i++) {
+        PushOfonoWorker* worker = watcher->workers->pdata[i];
+        PushRingStats stats;
+        push_ring_stats(worker->ring, &stats);
+        g_variant_builder_add(&builder, "(uuuu)", stats.size, stats.depth,
+            stats.high_water, stats.dropped);
+    }
+    return g_variant_builder_end(&builder);
+}
+
+GDBusConnection*
+push_ofono_watcher_bus(
+    PushOfonoWatcher* watcher)
+{
+    return watcher ? watcher->bus : NULL;
+}
+
 void
 push_ofono_watcher_free(
     PushOfonoWatcher* watcher)
@@ -558,6 +1311,15 @@ push_ofono_watcher_free(
     if (watcher) {
         g_bus_unwatch_name(watcher->ofono_watch_id);
         push_ofono_free(watcher->ofono);
+        watcher->ofono = NULL;
+
+        /* Flush the outgoing UnregisterAgent calls, if there are any.
+         * That doesn't wait for the replies. */
+        g_dbus_connection_flush_sync(watcher->bus, NULL, NULL);
+
+        g_ptr_array_unref(watcher->workers);
+        g_main_context_unref(watcher->context);
+        push_imsi_cache_free(watcher->imsi_cache);
         g_object_unref(watcher->bus);
         g_free(watcher);
     }
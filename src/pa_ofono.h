@@ -17,16 +17,44 @@
 
 #include "pa.h"
 
+#include <gio/gio.h>
+
+/* Notifications arriving before the IMSI is known are held for a while,
+ * until it becomes known. The last known IMSI of each modem and SIM
+ * card is remembered in the imsi_cache file, if there is one.
+ *
+ * With config->decode_workers > 0, modems are sharded by path across
+ * that many worker threads. Only ReceiveNotification calls are handled,
+ * and the PDUs decoded by PushNotificationDecodeProc, on the worker
+ * thread of the modem. PDUs which can't be decoded (NULL) are rejected
+ * right there. Everything else (routing, filling the handler templates
+ * and delivery) happens on the thread which has created the watcher,
+ * including PushNotificationProc, which takes ownership of
+ * whatever the decode function has returned. Each worker hands the
+ * notifications over through a bounded queue. Without decode workers,
+ * everything happens on that thread but notifications still go
+ * through a single queue of the same kind. When the queue is full,
+ * the ReceiveNotification call fails with LimitsExceeded. */
 typedef struct push_ofono_watcher PushOfonoWatcher;
+typedef gpointer
+(*PushNotificationDecodeProc)(
+    GBytes* pdu);
 typedef void
 (*PushNotificationProc)(
     PushAgent* agent,
     const char* imsi,
-    const guint8* data,
-    gsize len);
+    const char* modem,
+    GBytes* pdu,
+    GVariant* info,
+    gpointer decoded,
+    GDestroyNotify done,
+    void* done_data);
 
 PushOfonoWatcher*
 push_ofono_watcher_new(
+    const PushAgentConfig* config,
+    PushNotificationDecodeProc decode,
+    GDestroyNotify decoded_free,
     PushNotificationProc proc,
     PushAgent* agent);
 
@@ -34,6 +62,15 @@ void
 push_ofono_watcher_free(
     PushOfonoWatcher* watcher);
 
+/* Worker queues, as a(uuuu) */
+GVariant*
+push_ofono_watcher_queues(
+    PushOfonoWatcher* watcher);
+
+GDBusConnection*
+push_ofono_watcher_bus(
+    PushOfonoWatcher* watcher);
+
 #endif /* JOLLA_PUSH_AGENT_OFONO_H */
 
 /*
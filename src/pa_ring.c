@@ -0,0 +1,105 @@
+/*
+ * Copyright (C) 2013-2014 Jolla Ltd.
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License version 2 as
+ * published by the Free Software Foundation.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ */
+
+#include "pa_ring.h"
+#include "pa_log.h"
+
+/*
+ * Head and tail are free running counters, only the consumer moves
+ * the head and only the producer moves the tail. The atomic set of
+ * either one publishes the slot it has just filled or emptied.
+ */
+struct push_ring {
+    guint mask;
+    gint head;
+    gint tail;
+    gint high_water;
+    gint dropped;
+    gpointer* items;
+};
+
+PushRing*
+push_ring_new(
+    guint size)
+{
+    PushRing* ring = g_new0(PushRing, 1);
+    guint n = 1;
+    while (n < size) n <<= 1;
+    ring->mask = n - 1;
+    ring->items = g_new0(gpointer, n);
+    return ring;
+}
+
+void
+push_ring_free(
+    PushRing* ring)
+{
+    if (ring) {
+        PA_ASSERT(ring->head == ring->tail);
+        g_free(ring->items);
+        g_free(ring);
+    }
+}
+
+gboolean
+push_ring_push(
+    PushRing* ring,
+    gpointer item)
+{
+    const guint tail = (guint)ring->tail;
+    const guint depth = tail - (guint)g_atomic_int_get(&ring->head);
+    if (depth > ring->mask) {
+        g_atomic_int_inc(&ring->dropped);
+        return FALSE;
+    }
+    ring->items[tail & ring->mask] = item;
+    g_atomic_int_set(&ring->tail, (gint)(tail + 1));
+    if (depth + 1 > (guint)ring->high_water) {
+        g_atomic_int_set(&ring->high_water, (gint)(depth + 1));
+    }
+    return TRUE;
+}
+
+gpointer
+push_ring_pop(
+    PushRing* ring)
+{
+    const guint head = (guint)ring->head;
+    if (head != (guint)g_atomic_int_get(&ring->tail)) {
+        gpointer item = ring->items[head & ring->mask];
+        g_atomic_int_set(&ring->head, (gint)(head + 1));
+        return item;
+    }
+    return NULL;
+}
+
+void
+push_ring_stats(
+    PushRing* ring,
+    PushRingStats* stats)
+{
+    const guint head = (guint)g_atomic_int_get(&ring->head);
+    stats->size = ring->mask + 1;
+    stats->depth = (guint)g_atomic_int_get(&ring->tail) - head;
+    stats->high_water = (guint)g_atomic_int_get(&ring->high_water);
+    stats->dropped = (guint)g_atomic_int_get(&ring->dropped);
+}
+
+/*
+ * Local Variables:
+ * mode: C
+ * c-basic-offset: 4
+ * indent-tabs-mode: nil
+ * End:
+ */
@@ -0,0 +1,66 @@
+/*
+ * Copyright (C) 2013-2014 Jolla Ltd.
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License version 2 as
+ * published by the Free Software Foundation.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ */
+
+#ifndef JOLLA_PUSH_AGENT_RING_H
+#define JOLLA_PUSH_AGENT_RING_H
+
+#include <glib.h>
+
+/* Bounded single producer, single consumer queue. Neither side takes
+ * locks or blocks, as long as only one thread pushes and only one
+ * thread pops. The size is rounded up to a power of two. */
+typedef struct push_ring PushRing;
+
+typedef struct push_ring_stats {
+    guint size;
+    guint depth;
+    guint high_water;
+    guint dropped;
+} PushRingStats;
+
+PushRing*
+push_ring_new(
+    guint size);
+
+/* The ring has to be empty */
+void
+push_ring_free(
+    PushRing* ring);
+
+/* Producer side. Returns FALSE and counts a drop if the ring is full */
+gboolean
+push_ring_push(
+    PushRing* ring,
+    gpointer item);
+
+/* Consumer side. Returns NULL if the ring is empty */
+gpointer
+push_ring_pop(
+    PushRing* ring);
+
+/* May be called from any thread, the numbers are approximate */
+void
+push_ring_stats(
+    PushRing* ring,
+    PushRingStats* stats);
+
+#endif /* JOLLA_PUSH_AGENT_RING_H */
+
+/*
+ * Local Variables:
+ * mode: C
+ * c-basic-offset: 4
+ * indent-tabs-mode: nil
+ * End:
+ */
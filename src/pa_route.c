@@ -0,0 +1,493 @@
+/*
+ * Copyright (C) 2013-2014 Jolla Ltd.
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License version 2 as
+ * published by the Free Software Foundation.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ */
+
+#include "pa_route.h"
+#include "pa_log.h"
+
+#include <string.h>
+
+/* Limits the number of routes cached for unknown content types */
+#define PUSH_ROUTER_MAX_CACHED  (64)
+
+typedef struct push_route_entry {
+    PushHandler* handler;
+    guint index;
+} PushRouteEntry;
+
+/* Prefix trie node, children are linked through the sibling pointer */
+typedef struct push_route_node PushRouteNode;
+struct push_route_node {
+    char c;
+    PushRouteNode* child;
+    PushRouteNode* sibling;
+    GArray* entries;
+};
+
+struct push_router {
+    guint count;
+    GHashTable* exact;
+    PushRouteNode root;
+    GArray* catch_all;
+    GPtrArray* header_names;
+    GHashTable* cache;
+    guint cached;
+    GPtrArray* scratch;
+};
+
+static
+void
+push_route_entries_free(
+    gpointer data)
+{
+    g_array_free(data, TRUE);
+}
+
+static
+void
+push_route_node_clear(
+    PushRouteNode* node)
+{
+    PushRouteNode* child = node->child;
+    while (child) {
+        PushRouteNode* next = child->sibling;
+        push_route_node_clear(child);
+        g_free(child);
+        child = next;
+    }
+    if (node->entries) g_array_free(node->entries, TRUE);
+    node->child = NULL;
+    node->entries = NULL;
+}
+
+static
+PushRouteNode*
+push_route_node_child(
+    PushRouteNode* node,
+    char c)
+{
+    PushRouteNode* child = node->child;
+    while (child && child->c != c) child = child->sibling;
+    return child;
+}
+
+static
+void
+push_route_append(
+    GArray* entries,
+    PushHandler* handler,
+    guint index)
+{
+    PushRouteEntry entry;
+    entry.handler = handler;
+    entry.index = index;
+    g_array_append_val(entries, entry);
+}
+
+static
+void
+push_route_merge(
+    GArray* dest,
+    GArray* src)
+{
+    if (src) g_array_append_vals(dest, src->data, src->len);
+}
+
+static
+gint
+push_route_entry_compare(
+    gconstpointer a,
+    gconstpointer b)
+{
+    const PushRouteEntry* e1 = a;
+    const PushRouteEntry* e2 = b;
+    return (e1->index < e2->index) ? (-1) : (e1->index > e2->index);
+}
+
+static
+gboolean
+push_route_match(
+    PushHandler* handler,
+    const PushWsp* wsp)
+{
+    if (handler->app_id && g_strcmp0(handler->app_id, wsp->app_id)) {
+        return FALSE;
+    }
+    if (handler->header_names) {
+        guint i;
+        for (i=0; handler->header_names[i]; i++) {
+            if (g_strcmp0(handler->header_values[i],
+                push_wsp_header(wsp, handler->header_names[i]))) {
+                return FALSE;
+            }
+        }
+    }
+    return TRUE;
+}
+
+static
+GPtrArray*
+push_router_resolve(
+    PushRouter* router,
+    const PushWsp* wsp)
+{
+    guint i;
+    const char* type = wsp->content_type;
+    const char* ptr = type;
+    PushRouteNode* node = &router->root;
+    GPtrArray* route = g_ptr_array_new();
+    GArray* entries = g_array_new(FALSE, FALSE, sizeof(PushRouteEntry));
+
+    /* Exact matches, patterns and catch-all handlers, in that order */
+    push_route_merge(entries, g_hash_table_lookup(router->exact, type));
+    while (node) {
+        push_route_merge(entries, node->entries);
+        node = *ptr ? push_route_node_child(node, *ptr++) : NULL;
+    }
+    push_route_merge(entries, router->catch_all);
+
+    /* Restore the configuration order */
+    g_array_sort(entries, push_route_entry_compare);
+    for (i=0; i<entries->len; i++) {
+        PushHandler* h = g_array_index(entries, PushRouteEntry, i).handler;
+        if (push_route_match(h, wsp)) {
+            g_ptr_array_add(route, h);
+        }
+    }
+    g_array_free(entries, TRUE);
+    return route;
+}
+
+static
+void
+push_router_key_append(
+    GString* key,
+    const char* value)
+{
+    if (value) {
+        g_string_append_printf(key, "\n%u:%s", (guint)strlen(value), value);
+    } else {
+        g_string_append(key, "\n-");
+    }
+}
+
+static
+char*
+push_router_key(
+    PushRouter* router,
+    const PushWsp* wsp)
+{
+    /* Only the things that may affect the route make up the key.
+     * Values are prefixed with their length to keep keys unambiguous */
+    GString* key = g_string_new(NULL);
+    guint i;
+    push_router_key_append(key, wsp->content_type);
+    push_router_key_append(key, wsp->app_id);
+    for (i=0; i<router->header_names->len; i++) {
+        push_router_key_append(key, push_wsp_header(wsp,
+            router->header_names->pdata[i]));
+    }
+    return g_string_free(key, FALSE);
+}
+
+static
+const GPtrArray*
+push_router_lookup_key(
+    PushRouter* router,
+    const PushWsp* wsp,
+    gboolean compiled)
+{
+    char* key = push_router_key(router, wsp);
+    GPtrArray* route = g_hash_table_lookup(router->cache, key);
+    if (route) {
+        g_free(key);
+    } else {
+        route = push_router_resolve(router, wsp);
+        if (compiled || router->cached < PUSH_ROUTER_MAX_CACHED) {
+            if (!compiled) router->cached++;
+            g_hash_table_insert(router->cache, key, route);
+        } else {
+            /* Don't let random content types eat up all the memory */
+            if (router->scratch) g_ptr_array_unref(router->scratch);
+            router->scratch = route;
+            g_free(key);
+        }
+    }
+    return route;
+}
+
+const GPtrArray*
+push_router_lookup(
+    PushRouter* router,
+    const PushWsp* wsp)
+{
+    return push_router_lookup_key(router, wsp, FALSE);
+}
+
+static
+void
+push_router_clear_cache(
+    PushRouter* router)
+{
+    g_hash_table_remove_all(router->cache);
+    router->cached = 0;
+    if (router->scratch) {
+        g_ptr_array_unref(router->scratch);
+        router->scratch = NULL;
+    }
+}
+
+void
+push_router_compile(
+    PushRouter* router)
+{
+    GHashTableIter it;
+    gpointer key;
+    PushWsp wsp;
+    memset(&wsp, 0, sizeof(wsp));
+    push_router_clear_cache(router);
+    g_hash_table_iter_init(&it, router->exact);
+    while (g_hash_table_iter_next(&it, &key, NULL)) {
+        wsp.content_type = key;
+        push_router_lookup_key(router, &wsp, TRUE);
+    }
+}
+
+static
+const char*
+push_router_compiled_key(
+    PushRouter* router,
+    const char* type,
+    char** key)
+{
+    PushWsp wsp;
+    memset(&wsp, 0, sizeof(wsp));
+    wsp.content_type = type;
+    return (*key = push_router_key(router, &wsp));
+}
+
+GVariant*
+push_router_export(
+    PushRouter* router,
+    const GPtrArray* handlers)
+{
+    GHashTableIter it;
+    gpointer type;
+    GVariantBuilder builder;
+    GHashTable* index = g_hash_table_new(g_direct_hash, g_direct_equal);
+    guint i;
+    for (i=0; i<handlers->len; i++) {
+        g_hash_table_insert(index, handlers->pdata[i], GUINT_TO_POINTER(i));
+    }
+    g_variant_builder_init(&builder, G_VARIANT_TYPE(PUSH_ROUTER_VARIANT_TYPE));
+    g_hash_table_iter_init(&it, router->exact);
+    while (g_hash_table_iter_next(&it, &type, NULL)) {
+        char* key;
+        const GPtrArray* route = g_hash_table_lookup(router->cache,
+            push_router_compiled_key(router, type, &key));
+        if (route) {
+            GVariantBuilder indices;
+            g_variant_builder_init(&indices, G_VARIANT_TYPE("au"));
+            for (i=0; i<route->len; i++) {
+                g_variant_builder_add(&indices, "u", GPOINTER_TO_UINT(
+                    g_hash_table_lookup(index, route->pdata[i])));
+            }
+            g_variant_builder_add(&builder, "{sau}", type, &indices);
+        }
+        g_free(key);
+    }
+    g_hash_table_destroy(index);
+    return g_variant_builder_end(&builder);
+}
+
+gboolean
+push_router_import(
+    PushRouter* router,
+    const GPtrArray* handlers,
+    GVariant* routes)
+{
+    /* The data may come from a file, they are not trusted */
+    GVariantIter it;
+    const char* type;
+    GVariant* indices;
+    guint count = 0;
+    gboolean ok = TRUE;
+    push_router_clear_cache(router);
+    g_variant_iter_init(&it, routes);
+    while (ok && g_variant_iter_next(&it, "{&s@au}", &type, &indices)) {
+        const gsize n = g_variant_n_children(indices);
+        if (g_hash_table_contains(router->exact, type)) {
+            GPtrArray* route = g_ptr_array_sized_new(n);
+            gsize i;
+            for (i=0; i<n && ok; i++) {
+                guint32 k;
+                g_variant_get_child(indices, i, "u", &k);
+                if (k < handlers->len) {
+                    g_ptr_array_add(route, handlers->pdata[k]);
+                } else {
+                    ok = FALSE;
+                }
+            }
+            if (ok) {
+                char* key;
+                push_router_compiled_key(router, type, &key);
+                g_hash_table_insert(router->cache, key, route);
+                count++;
+            } else {
+                g_ptr_array_unref(route);
+            }
+        } else {
+            ok = FALSE;
+        }
+        g_variant_unref(indices);
+    }
+    if (ok && count == g_hash_table_size(router->exact)) {
+        return TRUE;
+    }
+    push_router_clear_cache(router);
+    return FALSE;
+}
+
+gboolean
+push_router_add(
+    PushRouter* router,
+    PushHandler* handler)
+{
+    const char* type = handler->content_type;
+    const char* star = type ? strchr(type, '*') : NULL;
+    GArray* entries;
+
+    if (star) {
+        gsize len = star - type;
+        if (star[1] && strcmp(type, "*/*")) {
+            PA_WARN("%s: unsupported pattern '%s'", handler->name, type);
+            return FALSE;
+        } else {
+            /* Find or create the trie node */
+            PushRouteNode* node = &router->root;
+            gsize i;
+            if (star[1]) len = 0; /* any/any */
+            for (i=0; i<len; i++) {
+                PushRouteNode* child = push_route_node_child(node, type[i]);
+                if (!child) {
+                    child = g_new0(PushRouteNode, 1);
+                    child->c = type[i];
+                    child->sibling = node->child;
+                    node->child = child;
+                }
+                node = child;
+            }
+            if (!node->entries) {
+                node->entries = g_array_new(FALSE, FALSE,
+                    sizeof(PushRouteEntry));
+            }
+            entries = node->entries;
+        }
+    } else if (type) {
+        entries = g_hash_table_lookup(router->exact, type);
+        if (!entries) {
+            entries = g_array_new(FALSE, FALSE, sizeof(PushRouteEntry));
+            g_hash_table_insert(router->exact, g_strdup(type), entries);
+        }
+    } else {
+        entries = router->catch_all;
+    }
+
+    /* Remember which headers matter for routing */
+    if (handler->header_names) {
+        guint i, k;
+        for (i=0; handler->header_names[i]; i++) {
+            const char* name = handler->header_names[i];
+            for (k=0; k<router->header_names->len; k++) {
+                if (!g_ascii_strcasecmp(router->header_names->pdata[k],
+                    name)) {
+                    break;
+                }
+            }
+            if (k == router->header_names->len) {
+                g_ptr_array_add(router->header_names, g_strdup(name));
+            }
+        }
+    }
+
+    push_route_append(entries, push_handler_ref(handler), router->count++);
+    push_router_clear_cache(router);
+    return TRUE;
+}
+
+PushRouter*
+push_router_new()
+{
+    PushRouter* router = g_new0(PushRouter, 1);
+    router->exact = g_hash_table_new_full(g_str_hash, g_str_equal,
+        g_free, push_route_entries_free);
+    router->catch_all = g_array_new(FALSE, FALSE, sizeof(PushRouteEntry));
+    router->header_names = g_ptr_array_new_with_free_func(g_free);
+    router->cache = g_hash_table_new_full(g_str_hash, g_str_equal,
+        g_free, (GDestroyNotify)g_ptr_array_unref);
+    return router;
+}
+
+static
+void
+push_route_entries_unref(
+    GArray* entries)
+{
+    guint i;
+    for (i=0; i<entries->len; i++) {
+        push_handler_unref(g_array_index(entries, PushRouteEntry, i).handler);
+    }
+}
+
+static
+void
+push_route_node_unref(
+    PushRouteNode* node)
+{
+    PushRouteNode* child;
+    if (node->entries) push_route_entries_unref(node->entries);
+    for (child = node->child; child; child = child->sibling) {
+        push_route_node_unref(child);
+    }
+}
+
+void
+push_router_free(
+    PushRouter* router)
+{
+    if (router) {
+        GHashTableIter it;
+        gpointer value;
+        push_router_clear_cache(router);
+        g_hash_table_iter_init(&it, router->exact);
+        while (g_hash_table_iter_next(&it, NULL, &value)) {
+            push_route_entries_unref(value);
+        }
+        push_route_entries_unref(router->catch_all);
+        push_route_node_unref(&router->root);
+        push_route_node_clear(&router->root);
+        g_hash_table_destroy(router->cache);
+        g_hash_table_destroy(router->exact);
+        g_array_free(router->catch_all, TRUE);
+        g_ptr_array_unref(router->header_names);
+        g_free(router);
+    }
+}
+
+/*
+ * Local Variables:
+ * mode: C
+ * c-basic-offset: 4
+ * indent-tabs-mode: nil
+ * End:
+ */
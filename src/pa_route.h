@@ -0,0 +1,86 @@
+/*
+ * Copyright (C) 2013-2014 Jolla Ltd.
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License version 2 as
+ * published by the Free Software Foundation.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ */
+
+#ifndef JOLLA_PUSH_AGENT_ROUTE_H
+#define JOLLA_PUSH_AGENT_ROUTE_H
+
+#include "pa_handler.h"
+#include "pa_wsp.h"
+
+/*
+ * Maps content types to the lists of handlers. ContentType can be
+ * either an exact type or a prefix pattern ending with an asterisk,
+ * e.g. "application/vnd.wap.*". A lone asterisk and the any/any type
+ * match any content type. Handlers without ContentType receive all
+ * notifications. On top of that, handlers can be restricted to the
+ * specific application id and header values. Routes are memoized by
+ * content type, application id and the values of the headers that
+ * any of the handlers is interested in.
+ */
+typedef struct push_router PushRouter;
+
+PushRouter*
+push_router_new(void);
+
+void
+push_router_free(
+    PushRouter* router);
+
+/* Handlers must be added in the order they are supposed to be notified */
+gboolean
+push_router_add(
+    PushRouter* router,
+    PushHandler* handler);
+
+/* Precomputes the routes for all known exact types with no headers */
+void
+push_router_compile(
+    PushRouter* router);
+
+/* Compiled routes as a{sau}, content type and handler indices in the
+ * handlers array, which must contain all the handlers in the order
+ * they were added. */
+#define PUSH_ROUTER_VARIANT_TYPE "a{sau}"
+
+GVariant*
+push_router_export(
+    PushRouter* router,
+    const GPtrArray* handlers);
+
+/* Same as push_router_compile() but takes the routes from the output
+ * of push_router_export() for the same set of handlers. Returns FALSE
+ * if they don't fit, and then the router has to be compiled. */
+gboolean
+push_router_import(
+    PushRouter* router,
+    const GPtrArray* handlers,
+    GVariant* routes);
+
+/* Returns the handlers (PushHandler*) in the order they were added.
+ * The array remains valid until the next call to push_router_lookup()
+ * or until the router is modified. */
+const GPtrArray*
+push_router_lookup(
+    PushRouter* router,
+    const PushWsp* wsp);
+
+#endif /* JOLLA_PUSH_AGENT_ROUTE_H */
+
+/*
+ * Local Variables:
+ * mode: C
+ * c-basic-offset: 4
+ * indent-tabs-mode: nil
+ * End:
+ */
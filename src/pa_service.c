@@ -0,0 +1,370 @@
+/*
+ * Copyright (C) 2013-2014 Jolla Ltd.
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License version 2 as
+ * published by the Free Software Foundation.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ */
+
+#include "pa_service.h"
+#include "pa_log.h"
+
+#define DBUS_SERVICE            "org.freedesktop.DBus"
+#define DBUS_PATH               "/org/freedesktop/DBus"
+#define DBUS_INTERFACE          DBUS_SERVICE
+
+/* All services live on the same bus */
+typedef struct push_service_registry {
+    GDBusConnection* bus;
+    GHashTable* services;
+    GHashTable* activatable;
+    GCancellable* cancel;
+    gboolean listing;
+    gboolean list_again;
+} PushServiceRegistry;
+
+typedef struct push_service_listener {
+    gulong id;
+    PushServiceChangedFunc fn;
+    void* user_data;
+} PushServiceListener;
+
+typedef struct push_service_priv {
+    PushService pub;
+    gint ref_count;
+    PushServiceRegistry* registry;
+    char* name;
+    char* owner;
+    gboolean known;
+    guint watch_id;
+    GSList* listeners;
+    gulong last_listener_id;
+} PushServicePriv;
+
+static PushServiceRegistry* push_service_registry = NULL;
+
+static inline PushServicePriv*
+push_service_cast(PushService* service)
+    { return (PushServicePriv*)service; }
+
+static
+void
+push_service_changed(
+    PushServicePriv* priv)
+{
+    GSList* link = priv->listeners;
+    push_service_ref(&priv->pub);
+    while (link) {
+        /* The listener may remove itself */
+        GSList* next = link->next;
+        PushServiceListener* listener = link->data;
+        listener->fn(&priv->pub, listener->user_data);
+        link = next;
+    }
+    push_service_unref(&priv->pub);
+}
+
+static
+void
+push_service_set_owner(
+    PushServicePriv* priv,
+    const char* owner)
+{
+    if (!priv->known || g_strcmp0(priv->owner, owner)) {
+        g_free(priv->owner);
+        priv->pub.owner = priv->owner = g_strdup(owner);
+        priv->known = TRUE;
+        if (owner) {
+            PA_DEBUG("%s is owned by %s", priv->name, owner);
+        } else {
+            PA_DEBUG("%s has no owner", priv->name);
+        }
+        push_service_changed(priv);
+    }
+}
+
+static
+void
+push_service_appeared(
+    GDBusConnection* bus,
+    const char* name,
+    const char* owner,
+    gpointer data)
+{
+    push_service_set_owner(data, owner);
+}
+
+static
+void
+push_service_vanished(
+    GDBusConnection* bus,
+    const char* name,
+    gpointer data)
+{
+    push_service_set_owner(data, NULL);
+}
+
+static
+void
+push_service_list_activatable(
+    PushServiceRegistry* registry);
+
+static
+void
+push_service_update_activatable(
+    PushServiceRegistry* registry,
+    gboolean notify_all)
+{
+    /* Listeners may drop services, iterate over a copy */
+    GList* services = g_hash_table_get_values(registry->services);
+    GList* l;
+    for (l = services; l; l = l->next) push_service_ref(l->data);
+    for (l = services; l; l = l->next) {
+        PushServicePriv* priv = l->data;
+        const gboolean was = priv->pub.activatable;
+        priv->pub.activatable = g_hash_table_contains(registry->activatable,
+            priv->name);
+        if (notify_all || was != priv->pub.activatable) {
+            push_service_changed(priv);
+        }
+    }
+    g_list_free_full(services, (GDestroyNotify)push_service_unref);
+}
+
+static
+void
+push_service_list_activatable_done(
+    GObject* bus,
+    GAsyncResult* result,
+    gpointer data)
+{
+    GError* error = NULL;
+    GVariant* ret = g_dbus_connection_call_finish(G_DBUS_CONNECTION(bus),
+        result, &error);
+    if (g_error_matches(error, G_IO_ERROR, G_IO_ERROR_CANCELLED)) {
+        /* The registry is gone */
+        g_error_free(error);
+    } else {
+        PushServiceRegistry* registry = data;
+        const gboolean first = !registry->activatable;
+        const gboolean again = registry->list_again;
+        registry->listing = FALSE;
+        registry->list_again = FALSE;
+        if (ret) {
+            GVariantIter* names = NULL;
+            const char* name;
+            if (first) {
+                registry->activatable = g_hash_table_new_full(g_str_hash,
+                    g_str_equal, g_free, NULL);
+            } else {
+                g_hash_table_remove_all(registry->activatable);
+            }
+            g_variant_get(ret, "(as)", &names);
+            while (g_variant_iter_next(names, "&s", &name)) {
+                g_hash_table_add(registry->activatable, g_strdup(name));
+            }
+            g_variant_iter_free(names);
+        } else {
+            PA_WARN("%s", PA_ERRMSG(error));
+            g_error_free(error);
+            /* Keep what we had, if anything */
+            if (first) {
+                registry->activatable = g_hash_table_new_full(g_str_hash,
+                    g_str_equal, g_free, NULL);
+            }
+        }
+        PA_DEBUG("%u activatable service(s)",
+            g_hash_table_size(registry->activatable));
+        /* The registry may be gone after that */
+        push_service_update_activatable(registry, first);
+        if (again) push_service_refresh();
+    }
+    if (ret) g_variant_unref(ret);
+}
+
+static
+void
+push_service_list_activatable(
+    PushServiceRegistry* registry)
+{
+    if (registry->listing) {
+        /* The answer may be older than whatever prompted the request */
+        registry->list_again = TRUE;
+    } else {
+        registry->listing = TRUE;
+        g_dbus_connection_call(registry->bus, DBUS_SERVICE, DBUS_PATH,
+            DBUS_INTERFACE, "ListActivatableNames", NULL,
+            G_VARIANT_TYPE("(as)"), G_DBUS_CALL_FLAGS_NONE, -1,
+            registry->cancel, push_service_list_activatable_done,
+            registry);
+    }
+}
+
+static
+PushServiceRegistry*
+push_service_registry_new(
+    GDBusConnection* bus)
+{
+    PushServiceRegistry* registry = g_new0(PushServiceRegistry, 1);
+    registry->bus = g_object_ref(bus);
+    registry->services = g_hash_table_new(g_str_hash, g_str_equal);
+    registry->cancel = g_cancellable_new();
+    push_service_list_activatable(registry);
+    return registry;
+}
+
+static
+void
+push_service_registry_free(
+    PushServiceRegistry* registry)
+{
+    PA_ASSERT(!g_hash_table_size(registry->services));
+    g_cancellable_cancel(registry->cancel);
+    g_object_unref(registry->cancel);
+    g_hash_table_destroy(registry->services);
+    if (registry->activatable) g_hash_table_destroy(registry->activatable);
+    g_object_unref(registry->bus);
+    g_free(registry);
+}
+
+PushService*
+push_service_get(
+    GDBusConnection* bus,
+    const char* name)
+{
+    PushServiceRegistry* registry = push_service_registry;
+    PushServicePriv* priv;
+    if (!registry) {
+        push_service_registry = registry = push_service_registry_new(bus);
+    }
+    PA_ASSERT(registry->bus == bus);
+    priv = g_hash_table_lookup(registry->services, name);
+    if (priv) {
+        push_service_ref(&priv->pub);
+    } else {
+        priv = g_new0(PushServicePriv, 1);
+        priv->ref_count = 1;
+        priv->registry = registry;
+        priv->pub.name = priv->name = g_strdup(name);
+        if (registry->activatable) {
+            priv->pub.activatable = g_hash_table_contains(
+                registry->activatable, name);
+            if (!priv->pub.activatable) {
+                /* It may have been installed since the list was fetched */
+                push_service_list_activatable(registry);
+            }
+        }
+        g_hash_table_insert(registry->services, priv->name, priv);
+        priv->watch_id = g_bus_watch_name_on_connection(bus, name,
+            G_BUS_NAME_WATCHER_FLAGS_NONE, push_service_appeared,
+            push_service_vanished, priv, NULL);
+    }
+    return &priv->pub;
+}
+
+PushService*
+push_service_ref(
+    PushService* service)
+{
+    if (service) {
+        PushServicePriv* priv = push_service_cast(service);
+        PA_ASSERT(priv->ref_count > 0);
+        g_atomic_int_inc(&priv->ref_count);
+    }
+    return service;
+}
+
+void
+push_service_unref(
+    PushService* service)
+{
+    if (service) {
+        PushServicePriv* priv = push_service_cast(service);
+        PA_ASSERT(priv->ref_count > 0);
+        if (g_atomic_int_dec_and_test(&priv->ref_count)) {
+            PushServiceRegistry* registry = priv->registry;
+            PA_ASSERT(!priv->listeners);
+            g_bus_unwatch_name(priv->watch_id);
+            g_hash_table_remove(registry->services, priv->name);
+            if (!g_hash_table_size(registry->services)) {
+                PA_ASSERT(push_service_registry == registry);
+                push_service_registry_free(registry);
+                push_service_registry = NULL;
+            }
+            g_free(priv->owner);
+            g_free(priv->name);
+            g_free(priv);
+        }
+    }
+}
+
+gboolean
+push_service_available(
+    PushService* service)
+{
+    PushServicePriv* priv = push_service_cast(service);
+    return service->owner || (priv->registry->activatable &&
+        service->activatable);
+}
+
+gboolean
+push_service_known(
+    PushService* service)
+{
+    PushServicePriv* priv = push_service_cast(service);
+    return priv->known && priv->registry->activatable;
+}
+
+void
+push_service_refresh(void)
+{
+    if (push_service_registry) {
+        push_service_list_activatable(push_service_registry);
+    }
+}
+
+gulong
+push_service_add_changed_handler(
+    PushService* service,
+    PushServiceChangedFunc fn,
+    void* user_data)
+{
+    PushServicePriv* priv = push_service_cast(service);
+    PushServiceListener* listener = g_new(PushServiceListener, 1);
+    listener->id = ++(priv->last_listener_id);
+    listener->fn = fn;
+    listener->user_data = user_data;
+    priv->listeners = g_slist_append(priv->listeners, listener);
+    return listener->id;
+}
+
+void
+push_service_remove_handler(
+    PushService* service,
+    gulong id)
+{
+    PushServicePriv* priv = push_service_cast(service);
+    GSList* link;
+    for (link = priv->listeners; link; link = link->next) {
+        PushServiceListener* listener = link->data;
+        if (listener->id == id) {
+            priv->listeners = g_slist_delete_link(priv->listeners, link);
+            g_free(listener);
+            break;
+        }
+    }
+}
+
+/*
+ * Local Variables:
+ * mode: C
+ * c-basic-offset: 4
+ * indent-tabs-mode: nil
+ * End:
+ */
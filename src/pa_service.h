@@ -0,0 +1,88 @@
+/*
+ * Copyright (C) 2013-2014 Jolla Ltd.
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License version 2 as
+ * published by the Free Software Foundation.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ */
+
+#ifndef JOLLA_PUSH_AGENT_SERVICE_H
+#define JOLLA_PUSH_AGENT_SERVICE_H
+
+#include <gio/gio.h>
+
+/*
+ * Tracks the owner of a D-Bus service name. There's only one instance
+ * per name, shared by all the handlers talking to the same service,
+ * so the bus daemon sees one name watch per service no matter how many
+ * handlers there are. Names of activatable services are shared as well.
+ * They are fetched at startup and again whenever an unknown name shows
+ * up or push_service_refresh() is called.
+ */
+typedef struct push_service {
+    const char* name;
+    const char* owner;
+    gboolean activatable;
+} PushService;
+
+typedef void
+(*PushServiceChangedFunc)(
+    PushService* service,
+    void* user_data);
+
+PushService*
+push_service_get(
+    GDBusConnection* bus,
+    const char* name);
+
+PushService*
+push_service_ref(
+    PushService* service);
+
+void
+push_service_unref(
+    PushService* service);
+
+/* TRUE if a call to the service has a chance to succeed, i.e. the name
+ * is either owned or activatable. FALSE until that becomes known. */
+gboolean
+push_service_available(
+    PushService* service);
+
+/* TRUE once both the owner and the activatable names are known */
+gboolean
+push_service_known(
+    PushService* service);
+
+/* Fetches the names of activatable services again, e.g. after new ones
+ * may have been installed. Services that become activatable notify
+ * their listeners. */
+void
+push_service_refresh(void);
+
+gulong
+push_service_add_changed_handler(
+    PushService* service,
+    PushServiceChangedFunc fn,
+    void* user_data);
+
+void
+push_service_remove_handler(
+    PushService* service,
+    gulong id);
+
+#endif /* JOLLA_PUSH_AGENT_SERVICE_H */
+
+/*
+ * Local Variables:
+ * mode: C
+ * c-basic-offset: 4
+ * indent-tabs-mode: nil
+ * End:
+ */
@@ -0,0 +1,896 @@
+/*
+ * Copyright (C) 2013-2014 Jolla Ltd.
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License version 2 as
+ * published by the Free Software Foundation.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ */
+
+#include "pa_spool.h"
+#include "pa_log.h"
+
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <stdio.h>
+#include <string.h>
+#include <errno.h>
+
+#define PUSH_SPOOL_FILE             "journal"
+#define PUSH_SPOOL_FILE_MAGIC       (0x4c4f4f50) /* POOL */
+#define PUSH_SPOOL_RECORD_MAGIC     (0x44434552) /* RECD */
+#define PUSH_SPOOL_VERSION          (1)
+#define PUSH_SPOOL_CHUNK            (64*1024)
+#define PUSH_SPOOL_COMMIT_MS        (20)
+#define PUSH_SPOOL_COMPACT_MIN      (1024*1024)
+#define PUSH_SPOOL_COMPACT_RATIO    (4) /* dead space vs. live records */
+
+#define PUSH_SPOOL_ALIGN(x)         (((x) + 7) & ~((gsize)7))
+#define PUSH_SPOOL_CHUNK_ALIGN(x)   (((x) + PUSH_SPOOL_CHUNK - 1) & \
+                                    ~((gsize)PUSH_SPOOL_CHUNK - 1))
+
+typedef enum push_spool_record_type {
+    PUSH_SPOOL_RECORD_NOTIFY = 1,
+    PUSH_SPOOL_RECORD_DONE = 2
+} PUSH_SPOOL_RECORD_TYPE;
+
+typedef struct push_spool_file_header {
+    guint32 magic;
+    guint32 version;
+    guint32 generation;
+    guint32 reserved;
+} PushSpoolFileHeader;
+
+/*
+ * The checksum covers the header fields, the payload and the file
+ * generation. Records written before the file was last reset belong
+ * to the previous generation and fail the check.
+ */
+typedef struct push_spool_record_header {
+    guint32 magic;
+    guint32 type;
+    guint32 size;
+    guint32 checksum;
+    guint64 seq;
+} PushSpoolRecordHeader;
+
+/*
+ * NOTIFY payload:
+ *
+ *   guint32 handler count
+ *   guint32 data size
+ *   IMSI, content type and handler names, NULL terminated
+ *   data
+ *
+ * DONE payload:
+ *
+ *   guint64 id (seq of the NOTIFY record)
+ *   handler name, NULL terminated
+ */
+
+typedef struct push_spool_entry {
+    guint64 id;
+    gsize offset;
+    gsize size;
+    GPtrArray* handlers;
+} PushSpoolEntry;
+
+/*
+ * Periodic commits don't wait for the disk. The dirty pages are handed
+ * over to a thread which calls fdatasync() on a duplicate of the file
+ * descriptor, so the main loop is never blocked by a flush. Only the
+ * explicit push_spool_commit() (and compaction, which is rare) waits.
+ */
+struct push_spool {
+    char* path;
+    int fd;
+    guint8* map;
+    gsize size;
+    gsize offset;
+    gsize synced;
+    gsize live;
+    guint32 generation;
+    guint64 seq;
+    GHashTable* entries;
+    guint commit_id;
+    GThreadPool* sync_pool;
+};
+
+static
+guint32
+push_spool_hash(
+    guint32 hash,
+    const void* data,
+    gsize len)
+{
+    /* FNV-1a */
+    const guint8* ptr = data;
+    const guint8* end = ptr + len;
+    while (ptr < end) {
+        hash ^= *ptr++;
+        hash *= 16777619;
+    }
+    return hash;
+}
+
+static
+guint32
+push_spool_checksum(
+    guint32 generation,
+    const PushSpoolRecordHeader* hdr,
+    const void* payload)
+{
+    guint32 hash = 2166136261u;
+    hash = push_spool_hash(hash, &generation, 4);
+    hash = push_spool_hash(hash, &hdr->type, 4);
+    hash = push_spool_hash(hash, &hdr->size, 4);
+    hash = push_spool_hash(hash, &hdr->seq, 8);
+    return push_spool_hash(hash, payload, hdr->size);
+}
+
+static
+void
+push_spool_entry_free(
+    gpointer data)
+{
+    PushSpoolEntry* entry = data;
+    g_ptr_array_free(entry->handlers, TRUE);
+    g_free(entry);
+}
+
+static
+void
+push_spool_entry_insert(
+    PushSpool* spool,
+    PushSpoolEntry* entry)
+{
+    spool->live += entry->size;
+    g_hash_table_insert(spool->entries, &entry->id, entry);
+}
+
+static
+void
+push_spool_entry_remove(
+    PushSpool* spool,
+    PushSpoolEntry* entry)
+{
+    spool->live -= entry->size;
+    g_hash_table_remove(spool->entries, &entry->id);
+}
+
+static
+gsize
+push_spool_notify_size(
+    const char* imsi,
+    const char* content_type,
+    const char* const* handlers,
+    guint count,
+    gsize datalen)
+{
+    gsize size = 8 + strlen(imsi) + 1 + strlen(content_type) + 1 + datalen;
+    guint i;
+    for (i=0; i<count; i++) size += strlen(handlers[i]) + 1;
+    return size;
+}
+
+static
+void
+push_spool_notify_write(
+    guint8* ptr,
+    const char* imsi,
+    const char* content_type,
+    const char* const* handlers,
+    guint count,
+    const void* data,
+    gsize datalen)
+{
+    const guint32 n = count;
+    const guint32 len = datalen;
+    const gsize imsi_len = strlen(imsi) + 1;
+    const gsize type_len = strlen(content_type) + 1;
+    guint i;
+    memcpy(ptr, &n, 4); ptr += 4;
+    memcpy(ptr, &len, 4); ptr += 4;
+    memcpy(ptr, imsi, imsi_len); ptr += imsi_len;
+    memcpy(ptr, content_type, type_len); ptr += type_len;
+    for (i=0; i<count; i++) {
+        const gsize name_len = strlen(handlers[i]) + 1;
+        memcpy(ptr, handlers[i], name_len); ptr += name_len;
+    }
+    memcpy(ptr, data, datalen);
+}
+
+static
+gboolean
+push_spool_map(
+    PushSpool* spool,
+    gsize size)
+{
+    struct stat st;
+    if (fstat(spool->fd, &st) == 0) {
+        int err = 0;
+        if ((gsize)st.st_size > size) {
+            if (ftruncate(spool->fd, size) < 0) err = errno;
+        } else if ((gsize)st.st_size < size) {
+            /* Actually allocate the blocks, so that running out of disk
+             * space doesn't turn into SIGBUS when we touch the pages */
+            err = posix_fallocate(spool->fd, 0, size);
+            if (err == EINVAL || err == EOPNOTSUPP) {
+                err = (ftruncate(spool->fd, size) < 0) ? errno : 0;
+            }
+        }
+        if (!err) {
+            void* map;
+            if (spool->map) munmap(spool->map, spool->size);
+            map = mmap(NULL, size, PROT_READ | PROT_WRITE, MAP_SHARED,
+                spool->fd, 0);
+            if (map != MAP_FAILED) {
+                spool->map = map;
+                spool->size = size;
+                return TRUE;
+            }
+            err = errno;
+            spool->map = NULL;
+            spool->size = 0;
+        }
+        PA_ERR("%s: %s", spool->path, strerror(err));
+    } else {
+        PA_ERR("%s: %s", spool->path, strerror(errno));
+    }
+    return FALSE;
+}
+
+static
+void
+push_spool_msync(
+    PushSpool* spool,
+    gsize from,
+    gsize to,
+    int flags)
+{
+    if (to > from) {
+        const gsize page = sysconf(_SC_PAGESIZE);
+        const gsize start = from - from % page;
+        if (msync(spool->map + start, to - start, flags) < 0) {
+            PA_ERR("%s: %s", spool->path, strerror(errno));
+        }
+    }
+}
+
+static
+void
+push_spool_sync(
+    PushSpool* spool,
+    gsize from,
+    gsize to)
+{
+    push_spool_msync(spool, from, to, MS_SYNC);
+}
+
+static
+void
+push_spool_sync_thread(
+    gpointer data,
+    gpointer user_data)
+{
+    const int fd = GPOINTER_TO_INT(data) - 1;
+    if (fdatasync(fd) < 0) {
+        PA_ERR("%s: %s", (const char*)user_data, strerror(errno));
+    }
+    close(fd);
+}
+
+static
+void
+push_spool_sync_async(
+    PushSpool* spool,
+    gsize from,
+    gsize to)
+{
+    /* The duplicate keeps the file open even if it gets replaced */
+    const int fd = spool->sync_pool ? dup(spool->fd) : -1;
+    if (fd >= 0) {
+        push_spool_msync(spool, from, to, MS_ASYNC);
+        g_thread_pool_push(spool->sync_pool, GINT_TO_POINTER(fd + 1), NULL);
+    } else {
+        push_spool_sync(spool, from, to);
+    }
+}
+
+static
+gboolean
+push_spool_reset(
+    PushSpool* spool)
+{
+    if (push_spool_map(spool, PUSH_SPOOL_CHUNK)) {
+        PushSpoolFileHeader* header = (PushSpoolFileHeader*)spool->map;
+        spool->generation++;
+        header->magic = PUSH_SPOOL_FILE_MAGIC;
+        header->version = PUSH_SPOOL_VERSION;
+        header->generation = spool->generation;
+        header->reserved = 0;
+        push_spool_sync(spool, 0, sizeof(*header));
+        spool->offset = spool->synced = sizeof(*header);
+        return TRUE;
+    }
+    return FALSE;
+}
+
+static
+const char*
+push_spool_string(
+    const guint8** ptr,
+    const guint8* end)
+{
+    const char* str = (const char*)*ptr;
+    const guint8* nul = memchr(*ptr, 0, end - *ptr);
+    if (nul) {
+        *ptr = nul + 1;
+        return str;
+    }
+    return NULL;
+}
+
+static
+gboolean
+push_spool_parse_notify(
+    const PushSpoolRecordHeader* hdr,
+    const char** imsi,
+    const char** type,
+    GPtrArray* handlers,
+    const guint8** data,
+    guint32* len)
+{
+    const guint8* ptr = (const guint8*)(hdr + 1);
+    const guint8* end = ptr + hdr->size;
+    if (hdr->size >= 8) {
+        guint32 i, n;
+        memcpy(&n, ptr, 4);
+        memcpy(len, ptr + 4, 4);
+        ptr += 8;
+        *imsi = push_spool_string(&ptr, end);
+        *type = push_spool_string(&ptr, end);
+        for (i=0; i<n && *imsi && *type; i++) {
+            const char* name = push_spool_string(&ptr, end);
+            if (!name) return FALSE;
+            if (handlers) g_ptr_array_add(handlers, g_strdup(name));
+        }
+        if (*imsi && *type && (gsize)(end - ptr) >= *len) {
+            *data = ptr;
+            return TRUE;
+        }
+    }
+    return FALSE;
+}
+
+static
+gint
+push_spool_id_compare(
+    gconstpointer a,
+    gconstpointer b)
+{
+    const guint64 id1 = *(const guint64*)a;
+    const guint64 id2 = *(const guint64*)b;
+    return (id1 < id2) ? (-1) : (id1 > id2);
+}
+
+static
+GArray*
+push_spool_ids(
+    PushSpool* spool)
+{
+    GHashTableIter it;
+    gpointer key;
+    GArray* ids = g_array_sized_new(FALSE, FALSE, sizeof(guint64),
+        g_hash_table_size(spool->entries));
+    g_hash_table_iter_init(&it, spool->entries);
+    while (g_hash_table_iter_next(&it, &key, NULL)) {
+        g_array_append_vals(ids, key, 1);
+    }
+    g_array_sort(ids, push_spool_id_compare);
+    return ids;
+}
+
+static
+gboolean
+push_spool_write_file(
+    const char* path,
+    const guint8* data,
+    gsize size,
+    int* fd_out)
+{
+    int fd = open(path, O_RDWR | O_CREAT | O_TRUNC | O_CLOEXEC, 0600);
+    if (fd >= 0) {
+        gsize done = 0;
+        while (done < size) {
+            const ssize_t n = write(fd, data + done, size - done);
+            if (n < 0) {
+                if (errno == EINTR) continue;
+                break;
+            }
+            done += n;
+        }
+        if (done == size && fdatasync(fd) == 0) {
+            *fd_out = fd;
+            return TRUE;
+        }
+        PA_ERR("%s: %s", path, strerror(errno));
+        close(fd);
+    } else {
+        PA_ERR("%s: %s", path, strerror(errno));
+    }
+    return FALSE;
+}
+
+/*
+ * Records which are still needed are copied into a new file of the next
+ * generation, which then replaces the journal. Without that, a single
+ * record that is never completed (e.g. a dead letter nobody replays)
+ * would keep the journal from ever being reset. The NOTIFY records only
+ * list the handlers that haven't got the notification yet, and there
+ * are no DONE records in the new file. Writing the new file does block,
+ * but it only happens once the dead space exceeds the live records by
+ * PUSH_SPOOL_COMPACT_RATIO and the file is at least
+ * PUSH_SPOOL_COMPACT_MIN bytes.
+ */
+static
+void
+push_spool_compact(
+    PushSpool* spool)
+{
+    guint i;
+    const guint32 generation = spool->generation + 1;
+    GArray* ids = push_spool_ids(spool);
+    /* Offset and size of each record in the new file */
+    GArray* offsets = g_array_sized_new(FALSE, FALSE, sizeof(gsize),
+        2 * ids->len);
+    GByteArray* buf = g_byte_array_sized_new(sizeof(PushSpoolFileHeader) +
+        spool->live);
+    PushSpoolFileHeader header;
+    char* tmp = g_strconcat(spool->path, ".new", NULL);
+    int fd = -1;
+
+    header.magic = PUSH_SPOOL_FILE_MAGIC;
+    header.version = PUSH_SPOOL_VERSION;
+    header.generation = generation;
+    header.reserved = 0;
+    g_byte_array_append(buf, (void*)&header, sizeof(header));
+    for (i=0; i<ids->len; i++) {
+        guint64 id = g_array_index(ids, guint64, i);
+        PushSpoolEntry* entry = g_hash_table_lookup(spool->entries, &id);
+        const PushSpoolRecordHeader* old = (void*)(spool->map +
+            entry->offset);
+        const char* const* names = (const char* const*)
+            entry->handlers->pdata;
+        const char* imsi;
+        const char* type;
+        const guint8* data;
+        guint32 len;
+        gsize offset = 0;
+        gsize total = 0;
+        if (push_spool_parse_notify(old, &imsi, &type, NULL, &data, &len)) {
+            const gsize size = push_spool_notify_size(imsi, type, names,
+                entry->handlers->len, len);
+            PushSpoolRecordHeader* hdr;
+            total = PUSH_SPOOL_ALIGN(sizeof(*old) + size);
+            offset = buf->len;
+            g_byte_array_set_size(buf, offset + total);
+            memset(buf->data + offset, 0, total);
+            hdr = (void*)(buf->data + offset);
+            push_spool_notify_write((guint8*)(hdr + 1), imsi, type, names,
+                entry->handlers->len, data, len);
+            hdr->magic = PUSH_SPOOL_RECORD_MAGIC;
+            hdr->type = PUSH_SPOOL_RECORD_NOTIFY;
+            hdr->size = size;
+            hdr->seq = id;
+            hdr->checksum = push_spool_checksum(generation, hdr, hdr + 1);
+        }
+        g_array_append_val(offsets, offset);
+        g_array_append_val(offsets, total);
+    }
+
+    if (push_spool_write_file(tmp, buf->data, buf->len, &fd) &&
+        rename(tmp, spool->path) == 0) {
+        char* dir = g_path_get_dirname(spool->path);
+        const int dirfd = open(dir, O_RDONLY | O_CLOEXEC);
+        const gsize before = spool->offset;
+        if (dirfd >= 0) {
+            /* Make the rename itself durable */
+            fsync(dirfd);
+            close(dirfd);
+        }
+        g_free(dir);
+        munmap(spool->map, spool->size);
+        close(spool->fd);
+        spool->fd = fd;
+        spool->map = NULL;
+        spool->size = 0;
+        spool->generation = generation;
+        spool->offset = spool->synced = buf->len;
+        for (i=0; i<ids->len; i++) {
+            guint64 id = g_array_index(ids, guint64, i);
+            PushSpoolEntry* entry = g_hash_table_lookup(spool->entries, &id);
+            const gsize offset = g_array_index(offsets, gsize, 2 * i);
+            if (offset) {
+                spool->live -= entry->size;
+                entry->offset = offset;
+                entry->size = g_array_index(offsets, gsize, 2 * i + 1);
+                spool->live += entry->size;
+            } else {
+                PA_WARN("Dropping damaged record %" G_GUINT64_FORMAT, id);
+                push_spool_entry_remove(spool, entry);
+            }
+        }
+        PA_DEBUG("Compacted %s from %u to %u bytes", spool->path,
+            (guint)before, (guint)spool->offset);
+        push_spool_map(spool, PUSH_SPOOL_CHUNK_ALIGN(spool->offset));
+    } else {
+        if (fd >= 0) close(fd);
+        unlink(tmp);
+    }
+    g_byte_array_free(buf, TRUE);
+    g_array_free(offsets, TRUE);
+    g_array_free(ids, TRUE);
+    g_free(tmp);
+}
+
+static
+void
+push_spool_flush(
+    PushSpool* spool,
+    gboolean wait)
+{
+    if (spool->commit_id) {
+        g_source_remove(spool->commit_id);
+        spool->commit_id = 0;
+    }
+    if (spool->map) {
+        if (wait) {
+            push_spool_sync(spool, spool->synced, spool->offset);
+        } else if (spool->offset > spool->synced) {
+            push_spool_sync_async(spool, spool->synced, spool->offset);
+        }
+        spool->synced = spool->offset;
+
+        if (!g_hash_table_size(spool->entries)) {
+            /* Once everything has been delivered, start from scratch */
+            if (spool->offset > sizeof(PushSpoolFileHeader)) {
+                PA_VERBOSE("Resetting %s", spool->path);
+                push_spool_reset(spool);
+            }
+        } else if (spool->offset >= PUSH_SPOOL_COMPACT_MIN &&
+            spool->offset - sizeof(PushSpoolFileHeader) - spool->live >
+            spool->live * PUSH_SPOOL_COMPACT_RATIO) {
+            push_spool_compact(spool);
+        }
+    }
+}
+
+void
+push_spool_commit(
+    PushSpool* spool)
+{
+    if (spool) {
+        push_spool_flush(spool, TRUE);
+    }
+}
+
+static
+gboolean
+push_spool_commit_timeout(
+    gpointer data)
+{
+    PushSpool* spool = data;
+    spool->commit_id = 0;
+    push_spool_flush(spool, FALSE);
+    return G_SOURCE_REMOVE;
+}
+
+static
+guint8*
+push_spool_record_begin(
+    PushSpool* spool,
+    gsize size)
+{
+    const gsize total = PUSH_SPOOL_ALIGN(sizeof(PushSpoolRecordHeader) + size);
+    if (spool->map && (spool->offset + total <= spool->size ||
+        push_spool_map(spool, PUSH_SPOOL_CHUNK_ALIGN(spool->offset+total)))) {
+        return spool->map + spool->offset + sizeof(PushSpoolRecordHeader);
+    }
+    return NULL;
+}
+
+static
+guint64
+push_spool_record_end(
+    PushSpool* spool,
+    PUSH_SPOOL_RECORD_TYPE type,
+    gsize size)
+{
+    PushSpoolRecordHeader* hdr = (void*)(spool->map + spool->offset);
+    hdr->magic = PUSH_SPOOL_RECORD_MAGIC;
+    hdr->type = type;
+    hdr->size = size;
+    hdr->seq = ++spool->seq;
+    hdr->checksum = push_spool_checksum(spool->generation, hdr, hdr + 1);
+    spool->offset += PUSH_SPOOL_ALIGN(sizeof(*hdr) + size);
+    if (!spool->commit_id) {
+        spool->commit_id = g_timeout_add(PUSH_SPOOL_COMMIT_MS,
+            push_spool_commit_timeout, spool);
+    }
+    return hdr->seq;
+}
+
+guint64
+push_spool_add(
+    PushSpool* spool,
+    const char* imsi,
+    const char* content_type,
+    GBytes* data,
+    const char* const* handlers,
+    guint count)
+{
+    guint64 id = 0;
+    if (spool && count > 0) {
+        gsize datalen = 0;
+        const void* bytes = g_bytes_get_data(data, &datalen);
+        const gsize size = push_spool_notify_size(imsi, content_type,
+            handlers, count, datalen);
+        guint8* ptr = push_spool_record_begin(spool, size);
+        if (ptr) {
+            PushSpoolEntry* entry = g_new0(PushSpoolEntry, 1);
+            const gsize offset = spool->offset;
+            guint i;
+
+            push_spool_notify_write(ptr, imsi, content_type, handlers, count,
+                bytes, datalen);
+            entry->handlers = g_ptr_array_new_full(count, g_free);
+            for (i=0; i<count; i++) {
+                g_ptr_array_add(entry->handlers, g_strdup(handlers[i]));
+            }
+
+            id = push_spool_record_end(spool, PUSH_SPOOL_RECORD_NOTIFY, size);
+            entry->id = id;
+            entry->offset = offset;
+            entry->size = PUSH_SPOOL_ALIGN(sizeof(PushSpoolRecordHeader) +
+                size);
+            push_spool_entry_insert(spool, entry);
+            PA_VERBOSE("Spooled %" G_GUINT64_FORMAT, id);
+        }
+    }
+    return id;
+}
+
+static
+gboolean
+push_spool_entry_done(
+    PushSpool* spool,
+    PushSpoolEntry* entry,
+    const char* handler)
+{
+    guint i;
+    for (i=0; i<entry->handlers->len; i++) {
+        if (!strcmp(entry->handlers->pdata[i], handler)) {
+            g_ptr_array_remove_index(entry->handlers, i);
+            if (!entry->handlers->len) {
+                push_spool_entry_remove(spool, entry);
+            }
+            return TRUE;
+        }
+    }
+    return FALSE;
+}
+
+void
+push_spool_done(
+    PushSpool* spool,
+    guint64 id,
+    const char* handler)
+{
+    PushSpoolEntry* entry = spool ? g_hash_table_lookup(spool->entries, &id) :
+        NULL;
+    if (entry) {
+        const gsize name_len = strlen(handler) + 1;
+        const gsize size = 8 + name_len;
+        guint8* ptr = push_spool_record_begin(spool, size);
+        if (ptr) {
+            memcpy(ptr, &id, 8);
+            memcpy(ptr + 8, handler, name_len);
+            push_spool_record_end(spool, PUSH_SPOOL_RECORD_DONE, size);
+        }
+        push_spool_entry_done(spool, entry, handler);
+    }
+}
+
+static
+void
+push_spool_scan_record(
+    PushSpool* spool,
+    const PushSpoolRecordHeader* hdr,
+    gsize offset)
+{
+    if (hdr->type == PUSH_SPOOL_RECORD_NOTIFY) {
+        const char* imsi;
+        const char* type;
+        const guint8* data;
+        guint32 len;
+        PushSpoolEntry* entry = g_new0(PushSpoolEntry, 1);
+        entry->id = hdr->seq;
+        entry->offset = offset;
+        entry->size = PUSH_SPOOL_ALIGN(sizeof(*hdr) + hdr->size);
+        entry->handlers = g_ptr_array_new_with_free_func(g_free);
+        if (push_spool_parse_notify(hdr, &imsi, &type, entry->handlers,
+            &data, &len) && entry->handlers->len) {
+            push_spool_entry_insert(spool, entry);
+        } else {
+            push_spool_entry_free(entry);
+        }
+    } else if (hdr->type == PUSH_SPOOL_RECORD_DONE && hdr->size > 8) {
+        const guint8* ptr = (const guint8*)(hdr + 1);
+        const guint8* end = ptr + hdr->size;
+        PushSpoolEntry* entry;
+        guint64 id;
+        memcpy(&id, ptr, 8);
+        ptr += 8;
+        entry = g_hash_table_lookup(spool->entries, &id);
+        if (entry) {
+            const char* name = push_spool_string(&ptr, end);
+            if (name) push_spool_entry_done(spool, entry, name);
+        }
+    }
+}
+
+static
+void
+push_spool_scan(
+    PushSpool* spool)
+{
+    gsize offset = sizeof(PushSpoolFileHeader);
+    while (offset + sizeof(PushSpoolRecordHeader) <= spool->size) {
+        const PushSpoolRecordHeader* hdr = (void*)(spool->map + offset);
+        if (hdr->magic != PUSH_SPOOL_RECORD_MAGIC ||
+            hdr->seq <= spool->seq || hdr->size >
+            spool->size - offset - sizeof(PushSpoolRecordHeader) ||
+            hdr->checksum != push_spool_checksum(spool->generation, hdr,
+            hdr + 1)) {
+            /* End of the journal (or a torn write) */
+            break;
+        }
+        push_spool_scan_record(spool, hdr, offset);
+        spool->seq = hdr->seq;
+        offset += PUSH_SPOOL_ALIGN(sizeof(*hdr) + hdr->size);
+    }
+    spool->offset = spool->synced = offset;
+}
+
+void
+push_spool_replay(
+    PushSpool* spool,
+    PushSpoolReplayFunc fn,
+    void* user_data)
+{
+    if (spool && g_hash_table_size(spool->entries)) {
+        guint i;
+        GArray* ids = push_spool_ids(spool);
+        PA_INFO("Replaying %u notification(s)", ids->len);
+
+        /* The callback may complete the entries as we go */
+        for (i=0; i<ids->len; i++) {
+            guint64 id = g_array_index(ids, guint64, i);
+            PushSpoolEntry* entry = g_hash_table_lookup(spool->entries, &id);
+            if (entry) {
+                const PushSpoolRecordHeader* hdr =
+                    (void*)(spool->map + entry->offset);
+                const char* imsi;
+                const char* type;
+                const guint8* bytes;
+                guint32 len;
+                if (push_spool_parse_notify(hdr, &imsi, &type, NULL,
+                    &bytes, &len)) {
+                    /* Copy everything, the callback may remap the file */
+                    GBytes* data = g_bytes_new(bytes, len);
+                    char* imsi_copy = g_strdup(imsi);
+                    char* type_copy = g_strdup(type);
+                    GPtrArray* names = g_ptr_array_new_with_free_func(g_free);
+                    guint k;
+                    for (k=0; k<entry->handlers->len; k++) {
+                        g_ptr_array_add(names,
+                            g_strdup(entry->handlers->pdata[k]));
+                    }
+                    fn(id, imsi_copy, type_copy, data,
+                        (const char* const*)names->pdata, names->len,
+                        user_data);
+                    g_ptr_array_free(names, TRUE);
+                    g_bytes_unref(data);
+                    g_free(imsi_copy);
+                    g_free(type_copy);
+                } else {
+                    PA_WARN("Dropping damaged record %" G_GUINT64_FORMAT, id);
+                    push_spool_entry_remove(spool, entry);
+                }
+            }
+        }
+        g_array_free(ids, TRUE);
+    }
+}
+
+static
+gboolean
+push_spool_open(
+    PushSpool* spool)
+{
+    struct stat st;
+    if (fstat(spool->fd, &st) == 0 &&
+        (gsize)st.st_size >= sizeof(PushSpoolFileHeader) &&
+        push_spool_map(spool, st.st_size)) {
+        const PushSpoolFileHeader* header = (void*)spool->map;
+        if (header->magic == PUSH_SPOOL_FILE_MAGIC &&
+            header->version == PUSH_SPOOL_VERSION) {
+            spool->generation = header->generation;
+            push_spool_scan(spool);
+            PA_DEBUG("%s: %u pending record(s)", spool->path,
+                g_hash_table_size(spool->entries));
+            return TRUE;
+        }
+        PA_WARN("%s is damaged, discarding it", spool->path);
+    }
+    spool->generation = g_random_int();
+    return push_spool_reset(spool);
+}
+
+PushSpool*
+push_spool_new(
+    const char* dir)
+{
+    PushSpool* spool = g_new0(PushSpool, 1);
+    g_mkdir_with_parents(dir, 0700);
+    spool->path = g_build_filename(dir, PUSH_SPOOL_FILE, NULL);
+    spool->fd = open(spool->path, O_RDWR | O_CREAT | O_CLOEXEC, 0600);
+    spool->entries = g_hash_table_new_full(g_int64_hash, g_int64_equal,
+        NULL, push_spool_entry_free);
+    if (spool->fd >= 0) {
+        if (push_spool_open(spool)) {
+            spool->sync_pool = g_thread_pool_new(push_spool_sync_thread,
+                spool->path, 1, FALSE, NULL);
+            PA_DEBUG("Spooling to %s", spool->path);
+            return spool;
+        }
+    } else {
+        PA_ERR("%s: %s", spool->path, strerror(errno));
+    }
+    push_spool_free(spool);
+    return NULL;
+}
+
+void
+push_spool_free(
+    PushSpool* spool)
+{
+    if (spool) {
+        push_spool_commit(spool);
+        if (spool->sync_pool) {
+            /* Wait for the pending flushes */
+            g_thread_pool_free(spool->sync_pool, FALSE, TRUE);
+        }
+        if (spool->map) munmap(spool->map, spool->size);
+        if (spool->fd >= 0) close(spool->fd);
+        g_hash_table_destroy(spool->entries);
+        g_free(spool->path);
+        g_free(spool);
+    }
+}
+
+/*
+ * Local Variables:
+ * mode: C
+ * c-basic-offset: 4
+ * indent-tabs-mode: nil
+ * End:
+ */
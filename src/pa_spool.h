@@ -0,0 +1,85 @@
+/*
+ * Copyright (C) 2013-2014 Jolla Ltd.
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License version 2 as
+ * published by the Free Software Foundation.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ */
+
+#ifndef JOLLA_PUSH_AGENT_SPOOL_H
+#define JOLLA_PUSH_AGENT_SPOOL_H
+
+#include <glib.h>
+
+/*
+ * Append-only journal of notifications which haven't been delivered
+ * to all of their handlers yet. Records are written to a memory mapped
+ * file and synced to disk in batches (group commit), so the cost of
+ * a disk flush is shared by all the records written in between.
+ */
+typedef struct push_spool PushSpool;
+
+typedef void
+(*PushSpoolReplayFunc)(
+    guint64 id,
+    const char* imsi,
+    const char* content_type,
+    GBytes* data,
+    const char* const* handlers,
+    guint count,
+    void* user_data);
+
+PushSpool*
+push_spool_new(
+    const char* dir);
+
+void
+push_spool_free(
+    PushSpool* spool);
+
+/* Returns the record id or zero on failure */
+guint64
+push_spool_add(
+    PushSpool* spool,
+    const char* imsi,
+    const char* content_type,
+    GBytes* data,
+    const char* const* handlers,
+    guint count);
+
+/* Marks the record as delivered to the handler */
+void
+push_spool_done(
+    PushSpool* spool,
+    guint64 id,
+    const char* handler);
+
+/* Invokes the callback for every record left undelivered by the
+ * previous instance, in the order they were added */
+void
+push_spool_replay(
+    PushSpool* spool,
+    PushSpoolReplayFunc fn,
+    void* user_data);
+
+/* Flushes everything to disk right away and waits for it to complete.
+ * Periodic commits are asynchronous and never block the caller. */
+void
+push_spool_commit(
+    PushSpool* spool);
+
+#endif /* JOLLA_PUSH_AGENT_SPOOL_H */
+
+/*
+ * Local Variables:
+ * mode: C
+ * c-basic-offset: 4
+ * indent-tabs-mode: nil
+ * End:
+ */
@@ -0,0 +1,329 @@
+/*
+ * Copyright (C) 2013-2014 Jolla Ltd.
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License version 2 as
+ * published by the Free Software Foundation.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ */
+
+#include "pa_table.h"
+#include "pa_log.h"
+
+#include <string.h>
+
+/* Handlers defined in one file. The file doesn't change once it has
+ * become a part of a table (it's sealed then) so it's shared by all
+ * the tables built from it. Files only tell which handlers need to be
+ * created anew, the routes are table-wide. */
+typedef struct push_handler_table_file {
+    gint ref_count;
+    char* name;
+    GPtrArray* handlers;
+    gboolean sealed;
+} PushHandlerTableFile;
+
+typedef struct push_handler_table_priv {
+    PushHandlerTable pub;
+    gint ref_count;
+    GPtrArray* files;
+    PushRouter* router;
+} PushHandlerTablePriv;
+
+struct push_handler_table_builder {
+    guint version;
+    GPtrArray* files;
+    GVariant* routes;
+};
+
+static inline PushHandlerTablePriv*
+push_handler_table_cast(PushHandlerTable* table)
+    { return (PushHandlerTablePriv*)table; }
+
+static
+void
+push_handler_table_handler_unref(
+    gpointer handler)
+{
+    push_handler_unref(handler);
+}
+
+static
+PushHandlerTableFile*
+push_handler_table_file_new(
+    const char* name)
+{
+    PushHandlerTableFile* file = g_new0(PushHandlerTableFile, 1);
+    file->ref_count = 1;
+    file->name = g_strdup(name);
+    file->handlers = g_ptr_array_new_with_free_func(
+        push_handler_table_handler_unref);
+    return file;
+}
+
+static
+PushHandlerTableFile*
+push_handler_table_file_ref(
+    PushHandlerTableFile* file)
+{
+    PA_ASSERT(file->ref_count > 0);
+    g_atomic_int_inc(&file->ref_count);
+    return file;
+}
+
+static
+void
+push_handler_table_file_unref(
+    gpointer data)
+{
+    PushHandlerTableFile* file = data;
+    PA_ASSERT(file->ref_count > 0);
+    if (g_atomic_int_dec_and_test(&file->ref_count)) {
+        g_ptr_array_unref(file->handlers);
+        g_free(file->name);
+        g_free(file);
+    }
+}
+
+static
+GPtrArray*
+push_handler_table_files_new(void)
+{
+    return g_ptr_array_new_with_free_func(push_handler_table_file_unref);
+}
+
+PushHandlerTable*
+push_handler_table_ref(
+    PushHandlerTable* table)
+{
+    if (table) {
+        PushHandlerTablePriv* priv = push_handler_table_cast(table);
+        PA_ASSERT(priv->ref_count > 0);
+        g_atomic_int_inc(&priv->ref_count);
+    }
+    return table;
+}
+
+void
+push_handler_table_unref(
+    PushHandlerTable* table)
+{
+    if (table) {
+        PushHandlerTablePriv* priv = push_handler_table_cast(table);
+        PA_ASSERT(priv->ref_count > 0);
+        if (g_atomic_int_dec_and_test(&priv->ref_count)) {
+            push_router_free(priv->router);
+            g_ptr_array_unref(table->handlers);
+            g_ptr_array_unref(priv->files);
+            g_free(priv);
+        }
+    }
+}
+
+PushHandler*
+push_handler_table_find(
+    PushHandlerTable* table,
+    const char* name)
+{
+    if (table) {
+        guint i;
+        for (i=0; i<table->handlers->len; i++) {
+            PushHandler* h = table->handlers->pdata[i];
+            if (!strcmp(h->name, name)) {
+                return h;
+            }
+        }
+    }
+    return NULL;
+}
+
+const GPtrArray*
+push_handler_table_route(
+    PushHandlerTable* table,
+    const PushWsp* wsp)
+{
+    return push_router_lookup(push_handler_table_cast(table)->router, wsp);
+}
+
+GVariant*
+push_handler_table_routes(
+    PushHandlerTable* table)
+{
+    PushHandlerTablePriv* priv = push_handler_table_cast(table);
+    GVariantBuilder names;
+    guint i;
+    g_variant_builder_init(&names, G_VARIANT_TYPE_STRING_ARRAY);
+    for (i=0; i<table->handlers->len; i++) {
+        PushHandler* h = table->handlers->pdata[i];
+        g_variant_builder_add(&names, "s", h->name);
+    }
+    return g_variant_new("(as@" PUSH_ROUTER_VARIANT_TYPE ")", &names,
+        push_router_export(priv->router, table->handlers));
+}
+
+static
+gboolean
+push_handler_table_import_routes(
+    PushHandlerTable* table,
+    GVariant* routes)
+{
+    PushHandlerTablePriv* priv = push_handler_table_cast(table);
+    gboolean ok = FALSE;
+    GVariant* names = g_variant_get_child_value(routes, 0);
+    if (g_variant_n_children(names) == table->handlers->len) {
+        guint i;
+        for (i=0; i<table->handlers->len; i++) {
+            PushHandler* h = table->handlers->pdata[i];
+            const char* name = NULL;
+            g_variant_get_child(names, i, "&s", &name);
+            if (strcmp(h->name, name)) break;
+        }
+        if (i == table->handlers->len) {
+            GVariant* map = g_variant_get_child_value(routes, 1);
+            ok = push_router_import(priv->router, table->handlers, map);
+            g_variant_unref(map);
+        }
+    }
+    g_variant_unref(names);
+    return ok;
+}
+
+PushHandlerTableBuilder*
+push_handler_table_builder_new(
+    PushHandlerTable* base)
+{
+    PushHandlerTableBuilder* builder = g_new0(PushHandlerTableBuilder, 1);
+    builder->files = push_handler_table_files_new();
+    if (base) {
+        PushHandlerTablePriv* priv = push_handler_table_cast(base);
+        guint i;
+        builder->version = base->version;
+        for (i=0; i<priv->files->len; i++) {
+            g_ptr_array_add(builder->files,
+                push_handler_table_file_ref(priv->files->pdata[i]));
+        }
+    }
+    return builder;
+}
+
+void
+push_handler_table_builder_remove_file(
+    PushHandlerTableBuilder* builder,
+    const char* name)
+{
+    guint i;
+    for (i=0; i<builder->files->len; i++) {
+        PushHandlerTableFile* file = builder->files->pdata[i];
+        if (!strcmp(file->name, name)) {
+            /* The handlers stay alive as long as older tables need them */
+            g_ptr_array_remove_index(builder->files, i);
+            break;
+        }
+    }
+}
+
+void
+push_handler_table_builder_add(
+    PushHandlerTableBuilder* builder,
+    const char* name,
+    PushHandler* handler)
+{
+    PushHandlerTableFile* file = NULL;
+    guint i;
+    for (i=0; i<builder->files->len && !file; i++) {
+        PushHandlerTableFile* f = builder->files->pdata[i];
+        if (!strcmp(f->name, name)) {
+            if (f->sealed) {
+                /* Copy on write, older tables keep the original */
+                guint k;
+                file = push_handler_table_file_new(name);
+                for (k=0; k<f->handlers->len; k++) {
+                    g_ptr_array_add(file->handlers,
+                        push_handler_ref(f->handlers->pdata[k]));
+                }
+                builder->files->pdata[i] = file;
+                push_handler_table_file_unref(f);
+            } else {
+                file = f;
+            }
+        }
+    }
+    if (!file) {
+        file = push_handler_table_file_new(name);
+        g_ptr_array_add(builder->files, file);
+    }
+    g_ptr_array_add(file->handlers, handler);
+}
+
+void
+push_handler_table_builder_set_routes(
+    PushHandlerTableBuilder* builder,
+    GVariant* routes)
+{
+    if (builder->routes) g_variant_unref(builder->routes);
+    builder->routes = routes ? g_variant_ref_sink(routes) : NULL;
+}
+
+PushHandlerTable*
+push_handler_table_builder_finish(
+    PushHandlerTableBuilder* builder)
+{
+    PushHandlerTablePriv* priv = g_new0(PushHandlerTablePriv, 1);
+    PushHandlerTable* table = &priv->pub;
+    guint i, changed = 0;
+    priv->ref_count = 1;
+    priv->files = builder->files;
+    priv->router = push_router_new();
+    table->version = builder->version + 1;
+    table->handlers = g_ptr_array_new_with_free_func(
+        push_handler_table_handler_unref);
+
+    /* One index for all files, so that the cost of routing doesn't
+     * depend on how the handlers are spread between the files. The
+     * unchanged files contribute the handlers they already have. */
+    for (i=0; i<priv->files->len; i++) {
+        PushHandlerTableFile* file = priv->files->pdata[i];
+        guint k = 0;
+        while (k < file->handlers->len) {
+            PushHandler* handler = file->handlers->pdata[k];
+            if (push_router_add(priv->router, handler)) {
+                g_ptr_array_add(table->handlers, push_handler_ref(handler));
+                k++;
+            } else {
+                /* Rejected when the file was new, the sealed ones
+                 * only contain the handlers that have been accepted */
+                PA_ASSERT(!file->sealed);
+                g_ptr_array_remove_index(file->handlers, k);
+            }
+        }
+        if (!file->sealed) {
+            file->sealed = TRUE;
+            changed++;
+        }
+    }
+    if (builder->routes && push_handler_table_import_routes(table,
+        builder->routes)) {
+        PA_DEBUG("Using saved routes");
+    } else {
+        push_router_compile(priv->router);
+    }
+    push_handler_table_builder_set_routes(builder, NULL);
+    g_free(builder);
+    PA_DEBUG("Handler table version %u, %u handler(s), %u/%u file(s) "
+        "changed", table->version, table->handlers->len, changed,
+        priv->files->len);
+    return table;
+}
+
+/*
+ * Local Variables:
+ * mode: C
+ * c-basic-offset: 4
+ * indent-tabs-mode: nil
+ * End:
+ */
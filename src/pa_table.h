@@ -0,0 +1,108 @@
+/*
+ * Copyright (C) 2013-2014 Jolla Ltd.
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License version 2 as
+ * published by the Free Software Foundation.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ */
+
+#ifndef JOLLA_PUSH_AGENT_TABLE_H
+#define JOLLA_PUSH_AGENT_TABLE_H
+
+#include "pa_handler.h"
+#include "pa_route.h"
+#include "pa_wsp.h"
+
+/*
+ * Immutable snapshot of the configured handlers and the routes between
+ * them. A reload never modifies the table in use, it builds a new one
+ * and swaps the pointer. Handlers are kept per file, the files that
+ * haven't changed are shared with the new table, so only the handlers
+ * defined in the changed files are created anew. The routing index
+ * covers the whole table and is rebuilt with it. Whoever needs the
+ * table for longer than a single call holds a reference to it, and
+ * keeps the version it started with even if the configuration changes
+ * in the meantime.
+ */
+typedef struct push_handler_table {
+    guint version;
+    GPtrArray* handlers;
+} PushHandlerTable;
+
+typedef struct push_handler_table_builder PushHandlerTableBuilder;
+
+PushHandlerTable*
+push_handler_table_ref(
+    PushHandlerTable* table);
+
+void
+push_handler_table_unref(
+    PushHandlerTable* table);
+
+PushHandler*
+push_handler_table_find(
+    PushHandlerTable* table,
+    const char* name);
+
+/* Same as push_router_lookup(). The routes are memoized, that's the
+ * only thing that changes in the table after it has been built, and
+ * it's only accessed from the main thread */
+const GPtrArray*
+push_handler_table_route(
+    PushHandlerTable* table,
+    const PushWsp* wsp);
+
+/* Compiled routes, handler names followed by the routes in the
+ * PUSH_ROUTER_VARIANT_TYPE format */
+#define PUSH_HANDLER_TABLE_ROUTES_TYPE "(as" PUSH_ROUTER_VARIANT_TYPE ")"
+
+/* Returns a floating reference */
+GVariant*
+push_handler_table_routes(
+    PushHandlerTable* table);
+
+/* Starts with the contents of the base table, if there is one */
+PushHandlerTableBuilder*
+push_handler_table_builder_new(
+    PushHandlerTable* base);
+
+void
+push_handler_table_builder_remove_file(
+    PushHandlerTableBuilder* builder,
+    const char* file);
+
+/* Takes ownership of the handler */
+void
+push_handler_table_builder_add(
+    PushHandlerTableBuilder* builder,
+    const char* file,
+    PushHandler* handler);
+
+/* Routes saved by push_handler_table_routes() for the same handlers.
+ * They are only used if the names of the handlers match, otherwise
+ * the routes get compiled. */
+void
+push_handler_table_builder_set_routes(
+    PushHandlerTableBuilder* builder,
+    GVariant* routes);
+
+/* Frees the builder and returns the new table */
+PushHandlerTable*
+push_handler_table_builder_finish(
+    PushHandlerTableBuilder* builder);
+
+#endif /* JOLLA_PUSH_AGENT_TABLE_H */
+
+/*
+ * Local Variables:
+ * mode: C
+ * c-basic-offset: 4
+ * indent-tabs-mode: nil
+ * End:
+ */
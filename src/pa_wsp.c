@@ -0,0 +1,437 @@
+/*
+ * Copyright (C) 2013-2014 Jolla Ltd.
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License version 2 as
+ * published by the Free Software Foundation.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ */
+
+#include "pa_wsp.h"
+#include "pa_log.h"
+
+#include <wspcodec.h>
+#include <string.h>
+
+#define WSP_PDU_PUSH                (0x06)
+#define WSP_LENGTH_QUOTE            (31)
+#define WSP_QUOTE                   (127)
+#define WSP_SHIFT_DELIMITER         (127)
+#define WSP_DEFAULT_CODE_PAGE       (1)
+
+typedef enum push_wsp_value_type {
+    PUSH_WSP_VALUE_TEXT,
+    PUSH_WSP_VALUE_SHORT,
+    PUSH_WSP_VALUE_DATA
+} PushWspValueType;
+
+typedef struct push_wsp_value {
+    PushWspValueType type;
+    const char* text;
+    const guint8* data;
+    guint len;
+    guint8 code;
+} PushWspValue;
+
+typedef enum push_wsp_format {
+    PUSH_WSP_FORMAT_TEXT,
+    PUSH_WSP_FORMAT_INTEGER,
+    PUSH_WSP_FORMAT_APP_ID
+} PushWspFormat;
+
+/* Well-known headers we decode, indexed by the field code */
+static const struct push_wsp_header_desc {
+    const char* name;
+    PushWspFormat format;
+} push_wsp_headers[] = {
+    [0x0d] = { "Content-Length",        PUSH_WSP_FORMAT_INTEGER },
+    [0x0e] = { "Content-Location",      PUSH_WSP_FORMAT_TEXT },
+    [0x12] = { "Date",                  PUSH_WSP_FORMAT_INTEGER },
+    [0x14] = { "Expires",               PUSH_WSP_FORMAT_INTEGER },
+    [0x15] = { "From",                  PUSH_WSP_FORMAT_TEXT },
+    [0x1c] = { "Location",              PUSH_WSP_FORMAT_TEXT },
+    [0x1d] = { "Last-Modified",         PUSH_WSP_FORMAT_INTEGER },
+    [0x2f] = { "X-Wap-Application-Id",  PUSH_WSP_FORMAT_APP_ID },
+    [0x30] = { "X-Wap-Content-URI",     PUSH_WSP_FORMAT_TEXT },
+    [0x31] = { "X-Wap-Initiator-URI",   PUSH_WSP_FORMAT_TEXT },
+    [0x33] = { "Bearer-Indication",     PUSH_WSP_FORMAT_INTEGER },
+    [0x34] = { "Push-Flag",             PUSH_WSP_FORMAT_INTEGER },
+    [0x40] = { "Content-ID",            PUSH_WSP_FORMAT_TEXT }
+};
+
+#define WSP_HEADER_APP_ID           (0x2f)
+
+/* Registered push application ids (OMNA) */
+static const char* const push_wsp_app_ids[] = {
+    "x-wap-application:*",              /* 0x00 */
+    "x-wap-application:push.sia",       /* 0x01 */
+    "x-wap-application:wml.ua",         /* 0x02 */
+    "x-wap-application:wta.ua",         /* 0x03 */
+    "x-wap-application:mms.ua",         /* 0x04 */
+    "x-wap-application:push.syncml",    /* 0x05 */
+    "x-wap-application:loc.ua",         /* 0x06 */
+    "x-wap-application:syncml.dm",      /* 0x07 */
+    "x-wap-application:drm.ua",         /* 0x08 */
+    "x-wap-application:emn.ua",         /* 0x09 */
+    "x-wap-application:wv.ua"           /* 0x0a */
+};
+
+static
+char*
+push_wsp_app_id_from_code(
+    guint64 code)
+{
+    if (code < G_N_ELEMENTS(push_wsp_app_ids)) {
+        return g_strdup(push_wsp_app_ids[code]);
+    } else {
+        return g_strdup_printf("0x%" G_GINT64_MODIFIER "x", code);
+    }
+}
+
+char*
+push_wsp_app_id(
+    const char* value)
+{
+    if (value && value[0]) {
+        char* end = NULL;
+        guint64 code = g_ascii_strtoull(value, &end, 0);
+        if (end && !*end) {
+            return push_wsp_app_id_from_code(code);
+        } else if (strchr(value, ':')) {
+            return g_ascii_strdown(value, -1);
+        }
+    }
+    return NULL;
+}
+
+const char*
+push_wsp_header_name(
+    const char* name)
+{
+    guint i;
+    for (i=0; i<G_N_ELEMENTS(push_wsp_headers); i++) {
+        const char* known = push_wsp_headers[i].name;
+        if (known && !g_ascii_strcasecmp(known, name)) {
+            return known;
+        }
+    }
+    return NULL;
+}
+
+static
+gboolean
+push_wsp_decode_value(
+    const guint8* p,
+    guint len,
+    PushWspValue* value,
+    guint* consumed)
+{
+    const guint8 b = len ? p[0] : 0;
+    if (!len) {
+        return FALSE;
+    } else if (b < WSP_LENGTH_QUOTE) {
+        /* Short-length followed by that many bytes of data */
+        if (1 + b > len) return FALSE;
+        value->type = PUSH_WSP_VALUE_DATA;
+        value->data = p + 1;
+        value->len = b;
+        *consumed = 1 + b;
+    } else if (b == WSP_LENGTH_QUOTE) {
+        unsigned int n = 0, off = 0;
+        /* The uintvar may come close to UINT_MAX, 1 + off + n could
+         * wrap around. The decoder doesn't consume more than len - 1. */
+        if (!wsp_decode_uintvar(p + 1, len - 1, &n, &off) ||
+            off > len - 1 || n > len - 1 - off) {
+            return FALSE;
+        }
+        value->type = PUSH_WSP_VALUE_DATA;
+        value->data = p + 1 + off;
+        value->len = n;
+        *consumed = 1 + off + n;
+    } else if (b < 128) {
+        /* NULL terminated text, possibly quoted */
+        const guint8* end = memchr(p, 0, len);
+        if (!end) return FALSE;
+        value->type = PUSH_WSP_VALUE_TEXT;
+        value->text = (const char*)p + ((b == WSP_QUOTE || b == '"') ? 1 : 0);
+        *consumed = end - p + 1;
+    } else {
+        value->type = PUSH_WSP_VALUE_SHORT;
+        value->code = b & 0x7f;
+        *consumed = 1;
+    }
+    return TRUE;
+}
+
+static
+gboolean
+push_wsp_value_integer(
+    const PushWspValue* value,
+    guint64* out)
+{
+    if (value->type == PUSH_WSP_VALUE_SHORT) {
+        *out = value->code;
+        return TRUE;
+    } else if (value->type == PUSH_WSP_VALUE_DATA &&
+        value->len > 0 && value->len <= 8) {
+        /* Long-integer, big-endian */
+        guint i;
+        *out = 0;
+        for (i=0; i<value->len; i++) *out = (*out << 8) | value->data[i];
+        return TRUE;
+    }
+    return FALSE;
+}
+
+static
+void
+push_wsp_add_header(
+    PushWsp* wsp,
+    const char* name,
+    char* value)
+{
+    PushWspHeader header;
+    if (!wsp->headers) {
+        wsp->headers = g_array_new(FALSE, FALSE, sizeof(PushWspHeader));
+    }
+    header.name = name;
+    header.value = value;
+    g_array_append_val(wsp->headers, header);
+    PA_DEBUG("%s: %s", name, value);
+}
+
+static
+void
+push_wsp_add_well_known_header(
+    PushWsp* wsp,
+    guint code,
+    const PushWspValue* value)
+{
+    if (code < G_N_ELEMENTS(push_wsp_headers) && push_wsp_headers[code].name) {
+        const struct push_wsp_header_desc* desc = push_wsp_headers + code;
+        guint64 n;
+        char* str = NULL;
+        switch (desc->format) {
+        case PUSH_WSP_FORMAT_TEXT:
+            if (value->type == PUSH_WSP_VALUE_TEXT) {
+                str = g_strdup(value->text);
+            }
+            break;
+        case PUSH_WSP_FORMAT_INTEGER:
+            if (push_wsp_value_integer(value, &n)) {
+                str = g_strdup_printf("%" G_GUINT64_FORMAT, n);
+            }
+            break;
+        case PUSH_WSP_FORMAT_APP_ID:
+            if (value->type == PUSH_WSP_VALUE_TEXT) {
+                str = g_ascii_strdown(value->text, -1);
+            } else if (push_wsp_value_integer(value, &n)) {
+                str = push_wsp_app_id_from_code(n);
+            }
+            if (str && !wsp->app_id) wsp->app_id = str;
+            break;
+        }
+        if (str) push_wsp_add_header(wsp, desc->name, str);
+    }
+}
+
+static
+gboolean
+push_wsp_decode_headers(
+    PushWsp* wsp,
+    const guint8* p,
+    guint len)
+{
+    guint8 page = WSP_DEFAULT_CODE_PAGE;
+    guint pos = 0;
+    while (pos < len) {
+        const guint8 b = p[pos];
+        PushWspValue value;
+        guint consumed = 0;
+        if (b == WSP_SHIFT_DELIMITER) {
+            if (pos + 1 >= len) return FALSE;
+            page = p[pos + 1];
+            pos += 2;
+        } else if (b > 0 && b < 32) {
+            /* Short-cut shift */
+            page = b;
+            pos++;
+        } else if (b & 0x80) {
+            /* Well-known header */
+            pos++;
+            if (!push_wsp_decode_value(p + pos, len - pos, &value,
+                &consumed)) {
+                return FALSE;
+            }
+            if (page == WSP_DEFAULT_CODE_PAGE) {
+                push_wsp_add_well_known_header(wsp, b & 0x7f, &value);
+            }
+            pos += consumed;
+        } else if (b) {
+            /* Application header, token text followed by text value */
+            const char* name = (const char*)p + pos;
+            const guint8* end = memchr(p + pos, 0, len - pos);
+            if (!end) return FALSE;
+            pos = end - p + 1;
+            if (!push_wsp_decode_value(p + pos, len - pos, &value,
+                &consumed)) {
+                return FALSE;
+            }
+            if (value.type == PUSH_WSP_VALUE_TEXT) {
+                push_wsp_add_header(wsp, name, g_strdup(value.text));
+            }
+            pos += consumed;
+        } else {
+            return FALSE;
+        }
+    }
+    return TRUE;
+}
+
+static
+gboolean
+push_wsp_decode_block(
+    PushWsp* wsp,
+    const guint8* p,
+    guint len)
+{
+    /* Content type comes first, then the headers */
+    const void* ct = NULL;
+    unsigned int off = 0;
+    if (wsp_decode_content_type(p, len, &ct, &off, NULL) &&
+        push_wsp_decode_headers(wsp, p + off, len - off)) {
+        wsp->content_type = ct;
+        return TRUE;
+    }
+    return FALSE;
+}
+
+gboolean
+push_wsp_decode(
+    PushWsp* wsp,
+    const guint8* pdu,
+    gsize len)
+{
+    memset(wsp, 0, sizeof(*wsp));
+    /* First two bytes are Transaction ID and PDU Type */
+    if (len >= 3 && pdu[1] == WSP_PDU_PUSH) {
+        guint remain = len - 2;
+        const guint8* data = pdu + 2;
+        unsigned int hdrlen = 0;
+        unsigned int off = 0;
+        if (wsp_decode_uintvar(data, remain, &hdrlen, &off) &&
+            (off + hdrlen) <= remain) {
+            data += off;
+            remain -= off;
+            PA_DEBUG("WAP header %u bytes", hdrlen);
+            if (push_wsp_decode_block(wsp, data, hdrlen)) {
+                wsp->payload_offset = (data + hdrlen) - pdu;
+                wsp->payload_len = remain - hdrlen;
+                PA_DEBUG("WSP payload %u bytes", (guint)wsp->payload_len);
+                PA_DEBUG("Content type %s", wsp->content_type);
+                return TRUE;
+            }
+        }
+    }
+    push_wsp_clear(wsp);
+    return FALSE;
+}
+
+void
+push_wsp_clear(
+    PushWsp* wsp)
+{
+    if (wsp->headers) {
+        guint i;
+        for (i=0; i<wsp->headers->len; i++) {
+            g_free(g_array_index(wsp->headers, PushWspHeader, i).value);
+        }
+        g_array_free(wsp->headers, TRUE);
+    }
+    memset(wsp, 0, sizeof(*wsp));
+}
+
+const char*
+push_wsp_header(
+    const PushWsp* wsp,
+    const char* name)
+{
+    if (wsp->headers) {
+        guint i;
+        for (i=0; i<wsp->headers->len; i++) {
+            const PushWspHeader* header = &g_array_index(wsp->headers,
+                PushWspHeader, i);
+            if (!g_ascii_strcasecmp(header->name, name)) {
+                return header->value;
+            }
+        }
+    }
+    return NULL;
+}
+
+gboolean
+push_wsp_multipart_init(
+    PushWspMultipartIter* iter,
+    const guint8* pdu,
+    const PushWsp* wsp)
+{
+    static const char multipart[] = "application/vnd.wap.multipart.";
+    memset(iter, 0, sizeof(*iter));
+    if (g_str_has_prefix(wsp->content_type, multipart)) {
+        unsigned int count = 0, off = 0;
+        if (wsp_decode_uintvar(pdu + wsp->payload_offset, wsp->payload_len,
+            &count, &off)) {
+            PA_DEBUG("%u part(s)", count);
+            iter->pdu = pdu;
+            iter->pos = wsp->payload_offset + off;
+            iter->end = wsp->payload_offset + wsp->payload_len;
+            iter->remaining = count;
+            return TRUE;
+        }
+    }
+    return FALSE;
+}
+
+gboolean
+push_wsp_multipart_next(
+    PushWspMultipartIter* iter,
+    PushWsp* part)
+{
+    memset(part, 0, sizeof(*part));
+    if (iter->remaining > 0) {
+        /* HeadersLen, DataLen, ContentType, Headers, Data */
+        const guint8* p = iter->pdu + iter->pos;
+        guint remain = iter->end - iter->pos;
+        unsigned int hdrlen = 0, datalen = 0, off1 = 0, off2 = 0;
+        if (wsp_decode_uintvar(p, remain, &hdrlen, &off1) &&
+            wsp_decode_uintvar(p + off1, remain - off1, &datalen, &off2) &&
+            ((guint64)off1 + off2 + hdrlen + datalen) <= remain) {
+            p += off1 + off2;
+            if (push_wsp_decode_block(part, p, hdrlen)) {
+                part->payload_offset = (p + hdrlen) - iter->pdu;
+                part->payload_len = datalen;
+                iter->pos = part->payload_offset + datalen;
+                iter->remaining--;
+                PA_DEBUG("Part %s, %u bytes", part->content_type, datalen);
+                return TRUE;
+            }
+        }
+        PA_WARN("Malformed multipart, %u part(s) skipped", iter->remaining);
+        iter->remaining = 0;
+        push_wsp_clear(part);
+    }
+    return FALSE;
+}
+
+/*
+ * Local Variables:
+ * mode: C
+ * c-basic-offset: 4
+ * indent-tabs-mode: nil
+ * End:
+ */
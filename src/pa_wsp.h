@@ -0,0 +1,94 @@
+/*
+ * Copyright (C) 2013-2014 Jolla Ltd.
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License version 2 as
+ * published by the Free Software Foundation.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ */
+
+#ifndef JOLLA_PUSH_AGENT_WSP_H
+#define JOLLA_PUSH_AGENT_WSP_H
+
+#include <glib.h>
+
+/* Push PDU decoded in a single pass over its headers. Strings point
+ * either to static tables or into the PDU, except for header values
+ * which have to be converted to text. */
+typedef struct push_wsp_header {
+    const char* name;
+    char* value;
+} PushWspHeader;
+
+typedef struct push_wsp {
+    const char* content_type;
+    const char* app_id;
+    GArray* headers;
+    gsize payload_offset;
+    gsize payload_len;
+} PushWsp;
+
+/* Walks the parts of a multipart body without copying anything */
+typedef struct push_wsp_multipart_iter {
+    const guint8* pdu;
+    gsize pos;
+    gsize end;
+    guint remaining;
+} PushWspMultipartIter;
+
+/* Returns FALSE if this is not a well-formed push PDU */
+gboolean
+push_wsp_decode(
+    PushWsp* wsp,
+    const guint8* pdu,
+    gsize len);
+
+void
+push_wsp_clear(
+    PushWsp* wsp);
+
+/* Returns FALSE if the payload is not application/vnd.wap.multipart.* */
+gboolean
+push_wsp_multipart_init(
+    PushWspMultipartIter* iter,
+    const guint8* pdu,
+    const PushWsp* wsp);
+
+/* Decodes the next part, its payload offset is relative to the PDU.
+ * The part has to be cleared by the caller. */
+gboolean
+push_wsp_multipart_next(
+    PushWspMultipartIter* iter,
+    PushWsp* part);
+
+/* Value of the header, NULL if it's not there */
+const char*
+push_wsp_header(
+    const PushWsp* wsp,
+    const char* name);
+
+/* Canonical header name, NULL if it's not a header we decode */
+const char*
+push_wsp_header_name(
+    const char* name);
+
+/* Converts numeric application ids into the registered URIs. Returns
+ * NULL if the string is neither a valid number nor a URI */
+char*
+push_wsp_app_id(
+    const char* value);
+
+#endif /* JOLLA_PUSH_AGENT_WSP_H */
+
+/*
+ * Local Variables:
+ * mode: C
+ * c-basic-offset: 4
+ * indent-tabs-mode: nil
+ * End:
+ */